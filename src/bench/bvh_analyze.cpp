@@ -0,0 +1,306 @@
+/**
+ * BVH quality analyzer. Builds a scene's BVH once per split strategy and parameter set (SAH bucket count,
+ * leaf size, traversal to intersection cost ratio) and reports what each tree looks like (SAH cost, depth
+ * and leaf size histograms, how much sibling boxes overlap) next to what rays actually pay to get through
+ * it, sampled from the camera and from random rays inside the scene bounds.
+ *
+ * Usage: torrey_bvh_analyze <scene.xml> [-buckets 4,8,12,16,32] [-leaf 1,2,4,8] [-ratio 0.0625,0.125,0.25,0.5]
+ *                           [-rays <n>] [-full] [-histograms] [-json <report>]
+ *
+ * Without -full every list is swept on its own around the renderer's defaults, -full builds every combination.
+ * -ratio sets the traversal cost with the intersection cost fixed at 1. The ratio only matters once SAH gets
+ * to decide between a leaf and a split, so those builds are also marked "cost" (BVHBuildSettings::leafByCost)
+ * and may split ranges below the leaf size or stop above it. The SAH cost column always uses the default
+ * constants so the rows compare.
+ */
+
+#include "../custom/bvh_analysis.h"
+#include "../custom/camera.h"
+#include "../custom/pcg.h"
+#include "../custom/scene.h"
+#include "../flexception.h"
+#include "../parse_scene.h"
+#include "../timer.h"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace cu_utils;
+
+struct BuildResult
+{
+    std::string name;
+    BVHBuildSettings settings;
+    Real buildSeconds = 0;
+    BVHQuality quality;       // Tree metrics, and the random rays
+    BVHQuality cameraQuality; // Only the ray metrics are filled in
+};
+
+template <typename T>
+static std::vector<T> parseList(const std::string &list)
+{
+    std::vector<T> values;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+    {
+        std::istringstream field(item);
+        T value;
+        if (!(field >> value))
+            Error(std::string("Can't read list ") + list);
+        values.push_back(value);
+    }
+    return values;
+}
+
+static std::string settingsName(const BVHBuildSettings &settings)
+{
+    std::ostringstream name;
+    if (settings.split == BVHSplit::Median)
+        name << "median l" << settings.maxLeafSize;
+    else
+        name << "sah b" << settings.numBuckets << " l" << settings.maxLeafSize << " t" << settings.traversalCost
+             << (settings.leafByCost ? " cost" : "");
+    return name.str();
+}
+
+static std::vector<BVHBuildSettings> sweep(const std::vector<int> &buckets, const std::vector<int> &leafSizes,
+                                           const std::vector<Real> &ratios, bool full)
+{
+    std::vector<BVHBuildSettings> all;
+    BVHBuildSettings defaults;
+    auto add = [&](BVHBuildSettings settings)
+    {
+        for (const BVHBuildSettings &s : all)
+        {
+            if (settingsName(s) == settingsName(settings))
+                return;
+        }
+        all.push_back(settings);
+    };
+
+    add(defaults);
+    if (full)
+    {
+        for (int b : buckets)
+            for (int l : leafSizes)
+            {
+                BVHBuildSettings s;
+                s.numBuckets = b;
+                s.maxLeafSize = l;
+                add(s);
+                s.leafByCost = true;
+                for (Real t : ratios)
+                {
+                    s.traversalCost = t;
+                    add(s);
+                }
+            }
+    }
+    else
+    {
+        for (int b : buckets)
+        {
+            BVHBuildSettings s;
+            s.numBuckets = b;
+            add(s);
+        }
+        for (int l : leafSizes)
+        {
+            BVHBuildSettings s;
+            s.maxLeafSize = l;
+            add(s);
+        }
+        for (Real t : ratios)
+        {
+            BVHBuildSettings s;
+            s.traversalCost = t;
+            s.leafByCost = true;
+            add(s);
+        }
+    }
+
+    for (int l : full ? leafSizes : std::vector<int>{defaults.maxLeafSize})
+    {
+        BVHBuildSettings s;
+        s.split = BVHSplit::Median;
+        s.maxLeafSize = l;
+        add(s);
+    }
+    return all;
+}
+
+// Primary rays through random points of the image, the way the renderer shoots them
+static std::vector<Ray> cameraRays(const ParsedScene &parsed, const Scene &scene, int count)
+{
+    Camera cam = CameraBuilder(parsed.camera.width, parsed.camera.height)
+                     .setLookFrom(scene.camera.lookfrom)
+                     .setLookAt(scene.camera.lookat)
+                     .setUp(scene.camera.up)
+                     .setFov(scene.camera.vfov)
+                     .build();
+
+    pcg32_state rng = init_pcg32(2);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        Real x = next_pcg32_real<Real>(rng) * parsed.camera.width;
+        Real y = next_pcg32_real<Real>(rng) * parsed.camera.height;
+        rays.push_back(cam.ScToWRay(x, y));
+    }
+    return rays;
+}
+
+static void writeReport(const fs::path &path, const std::string &scene, size_t numPrimitives, const std::vector<BuildResult> &results)
+{
+    std::ofstream out(path);
+    out << std::setprecision(10);
+    out << "{\n  \"scene\": \"" << scene << "\",\n  \"primitives\": " << numPrimitives << ",\n  \"builds\": [\n";
+    auto histogram = [&](const std::vector<int> &counts)
+    {
+        out << "[";
+        for (size_t i = 0; i < counts.size(); i++)
+            out << (i ? ", " : "") << counts[i];
+        out << "]";
+    };
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BuildResult &r = results[i];
+        const BVHQuality &q = r.quality;
+        out << "    {\"name\": \"" << r.name << "\", \"split\": \"" << (r.settings.split == BVHSplit::SAH ? "sah" : "median")
+            << "\", \"buckets\": " << r.settings.numBuckets << ", \"max_leaf_size\": " << r.settings.maxLeafSize
+            << ", \"traversal_cost\": " << r.settings.traversalCost << ", \"intersect_cost\": " << r.settings.intersectCost
+            << ", \"build_seconds\": " << r.buildSeconds << ", \"nodes\": " << q.numNodes << ", \"leaves\": " << q.numLeaves
+            << ", \"max_depth\": " << q.maxDepth << ", \"sah_cost\": " << q.sahCost << ", \"sibling_overlap\": " << q.siblingOverlap
+            << ", \"leaf_area_ratio\": " << q.leafAreaRatio << ", \"mean_leaf_size\": " << q.meanLeafSize
+            << ", \"camera_nodes_per_ray\": " << r.cameraQuality.nodesPerRay
+            << ", \"camera_primitives_per_ray\": " << r.cameraQuality.primitivesPerRay
+            << ", \"camera_ns_per_ray\": " << r.cameraQuality.nsPerRay << ", \"random_nodes_per_ray\": " << q.nodesPerRay
+            << ", \"random_primitives_per_ray\": " << q.primitivesPerRay << ", \"random_ns_per_ray\": " << q.nsPerRay
+            << ", \"leaves_per_depth\": ";
+        histogram(q.leavesPerDepth);
+        out << ", \"leaves_per_size\": ";
+        histogram(q.leavesPerSize);
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char *argv[])
+{
+    fs::path scenePath, jsonPath;
+    std::vector<int> buckets = {4, 8, 12, 16, 32};
+    std::vector<int> leafSizes = {1, 2, 4, 8};
+    std::vector<Real> ratios = {0.0625, 0.125, 0.25, 0.5};
+    int numRays = 100000;
+    bool full = false;
+    bool histograms = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-buckets" && i + 1 < argc)
+            buckets = parseList<int>(argv[++i]);
+        else if (arg == "-leaf" && i + 1 < argc)
+            leafSizes = parseList<int>(argv[++i]);
+        else if (arg == "-ratio" && i + 1 < argc)
+            ratios = parseList<Real>(argv[++i]);
+        else if (arg == "-rays" && i + 1 < argc)
+            numRays = std::stoi(argv[++i]);
+        else if (arg == "-json" && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (arg == "-full")
+            full = true;
+        else if (arg == "-histograms")
+            histograms = true;
+        else if (arg[0] != '-' && scenePath.empty())
+            scenePath = arg;
+        else
+        {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (scenePath.empty())
+    {
+        std::cerr << "Usage: torrey_bvh_analyze <scene.xml> [-buckets 4,8,12] [-leaf 1,2,4] [-ratio 0.125,0.25] [-rays n] [-full] [-histograms] [-json file]" << std::endl;
+        return 1;
+    }
+
+    Timer timer;
+    tick(timer);
+    ParsedScene parsed = parse_scene(scenePath);
+    Scene scene(parsed, true); // Textures don't matter here, never decoded
+    std::cout << "Loaded " << scenePath.string() << " (" << scene.shapes.size() << " primitives) in " << tick(timer) << " seconds" << std::endl;
+
+    std::vector<Ray> camera = cameraRays(parsed, scene, numRays);
+    std::vector<Ray> random;
+
+    std::vector<BuildResult> results;
+    for (const BVHBuildSettings &settings : sweep(buckets, leafSizes, ratios, full))
+    {
+        BuildResult r;
+        r.name = settingsName(settings);
+        r.settings = settings;
+
+        tick(timer);
+        BVHNode root = BVHNode::buildTree(scene.shapes, settings);
+        r.buildSeconds = tick(timer);
+
+        // Every tree bounds the same primitives, so one set of random rays serves them all
+        if (random.empty())
+            random = sampleRays(root.box, numRays);
+
+        r.quality = analyzeBVH(root);
+        measureRays(root, random, r.quality);
+        measureRays(root, camera, r.cameraQuality);
+
+        if (histograms)
+        {
+            std::cout << r.name << ":" << std::endl;
+            printBVHQuality(std::cout, r.quality);
+        }
+        results.push_back(r);
+    }
+
+    std::cout << std::endl
+              << std::left << std::setw(28) << "build" << std::right << std::setw(8) << "build s" << std::setw(9) << "nodes"
+              << std::setw(6) << "depth" << std::setw(7) << "leaf" << std::setw(8) << "SAH" << std::setw(9) << "overlap"
+              << std::setw(10) << "leaf area" << std::setw(11) << "cam nodes" << std::setw(10) << "cam prims" << std::setw(9) << "cam ns"
+              << std::setw(11) << "rand nodes" << std::setw(11) << "rand prims" << std::setw(9) << "rand ns" << std::endl;
+    std::cout << std::fixed;
+    size_t bestSah = 0, bestCamera = 0;
+    auto measured = [](const BVHQuality &q) { return traversalCost() * q.nodesPerRay + intersectCost() * q.primitivesPerRay; };
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BuildResult &r = results[i];
+        const BVHQuality &q = r.quality;
+        const BVHQuality &c = r.cameraQuality;
+        std::cout << std::left << std::setw(28) << r.name << std::right << std::setprecision(3) << std::setw(8) << r.buildSeconds
+                  << std::setw(9) << q.numNodes << std::setw(6) << q.maxDepth << std::setprecision(2) << std::setw(7) << q.meanLeafSize
+                  << std::setprecision(3) << std::setw(8) << q.sahCost << std::setw(9) << q.siblingOverlap << std::setprecision(1)
+                  << std::setw(10) << q.leafAreaRatio << std::setw(11) << c.nodesPerRay << std::setw(10) << c.primitivesPerRay
+                  << std::setw(9) << c.nsPerRay << std::setw(11) << q.nodesPerRay << std::setw(11) << q.primitivesPerRay
+                  << std::setw(9) << q.nsPerRay << std::endl;
+
+        if (q.sahCost < results[bestSah].quality.sahCost)
+            bestSah = i;
+        if (measured(c) < measured(results[bestCamera].cameraQuality))
+            bestCamera = i;
+    }
+    std::cout << std::endl
+              << "Lowest SAH cost: " << results[bestSah].name << std::endl
+              << "Cheapest camera rays (" << std::setprecision(3) << traversalCost() << " per node + " << intersectCost() << " per primitive): "
+              << results[bestCamera].name << std::endl;
+
+    if (!jsonPath.empty())
+    {
+        writeReport(jsonPath, scenePath.string(), scene.shapes.size(), results);
+        std::cout << "Wrote " << jsonPath.string() << std::endl;
+    }
+    return 0;
+}
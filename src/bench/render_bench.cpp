@@ -0,0 +1,353 @@
+/**
+ * End-to-end render benchmark. Renders every scene in a manifest at a fixed spp and depth, and records
+ * wall time, rays per second, peak memory, and how far the image is from a stored reference (RMSE and
+ * relMSE). Time and error together tell whether a change made the renderer faster at the same quality.
+ *
+ * Usage: torrey_render_bench [-manifest <file>] [-json <report>] [-compare <old report>] [-threshold <percent>]
+ *                            [-images <dir>] [-write_references] [-reference_spp <n>] [-t <threads>] [-perf]
+ *
+ * Manifest lines are "name scene.xml spp max_depth [width height]", paths relative to the manifest.
+ * References live next to it in references/<name>.exr. -write_references renders them at reference_spp.
+ * -perf adds hardware counters (IPC, cache and branch misses) per render phase where Linux allows it.
+ * Run it from the build folder like torrey, the skybox is loaded relative to there.
+ */
+
+#include "../custom/memory_report.h"
+#include "../custom/renderer.h"
+#include "../flexception.h"
+#include "../image.h"
+#include "../parallel.h"
+#include "../parse_scene.h"
+#include "../perf_counters.h"
+#include "../timer.h"
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef TORREY_BENCH_MANIFEST
+#define TORREY_BENCH_MANIFEST "render_scenes.txt"
+#endif
+
+using namespace cu_utils;
+
+struct BenchScene
+{
+    std::string name;
+    fs::path scene;
+    int spp;
+    int maxDepth;
+    int width = 0, height = 0; // 0 keeps the scene's resolution
+};
+
+struct SceneResult
+{
+    std::string name;
+    bool rendered = false;
+    Real wallSeconds = 0;   // Parse, load and render
+    Real renderSeconds = 0; // Just the render
+    uint64_t rays = 0;
+    Real raysPerSecond = 0;
+    size_t peakRssKB = 0;
+    bool hasReference = false;
+    Real rmse = 0;
+    Real relMSE = 0;
+    std::vector<PerfPhase> phases; // Only with -perf
+};
+
+static std::vector<BenchScene> readManifest(const fs::path &path)
+{
+    std::ifstream in(path);
+    if (!in)
+        Error(std::string("Can't read manifest ") + path.string());
+
+    std::vector<BenchScene> scenes;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        BenchScene scene;
+        std::string file;
+        if (!(fields >> scene.name >> file >> scene.spp >> scene.maxDepth))
+            continue;
+        fields >> scene.width >> scene.height;
+        scene.scene = fs::absolute(path.parent_path() / file).lexically_normal();
+        scenes.push_back(scene);
+    }
+    return scenes;
+}
+
+// relMSE divides by the reference so dark and bright regions count the same, the epsilon keeps black pixels sane
+static void compareImages(const Image3 &img, const Image3 &ref, Real &rmse, Real &relMSE)
+{
+    double se = 0, rel = 0;
+    for (int i = 0; i < (int)img.data.size(); i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            double d = img.data[i][c] - ref.data[i][c];
+            se += d * d;
+            rel += d * d / (ref.data[i][c] * ref.data[i][c] + 1e-2);
+        }
+    }
+    double n = 3.0 * img.data.size();
+    rmse = std::sqrt(se / n);
+    relMSE = rel / n;
+}
+
+static Image3 renderScene(const BenchScene &bench, int spp, Renderer &renderer)
+{
+    ParsedScene parsed = parse_scene(bench.scene);
+    parsed.samples_per_pixel = spp;
+    if (bench.width > 0 && bench.height > 0)
+    {
+        parsed.camera.width = bench.width;
+        parsed.camera.height = bench.height;
+    }
+
+    renderer.maxDepth = bench.maxDepth;
+    return renderer.render(parsed);
+}
+
+static void writeReport(const fs::path &path, const std::vector<SceneResult> &results, int threads)
+{
+    std::ofstream out(path);
+    out << std::setprecision(10);
+    out << "{\n  \"threads\": " << threads << ",\n  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const SceneResult &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"rendered\": " << (r.rendered ? "true" : "false");
+        if (r.rendered)
+        {
+            out << ", \"wall_seconds\": " << r.wallSeconds << ", \"render_seconds\": " << r.renderSeconds << ", \"rays\": " << r.rays
+                << ", \"rays_per_second\": " << r.raysPerSecond << ", \"peak_rss_kb\": " << r.peakRssKB;
+            if (r.hasReference)
+            {
+                out << ", \"rmse\": " << r.rmse << ", \"relmse\": " << r.relMSE << ", \"efficiency\": ";
+                // A render that matches its reference exactly has no error to divide by, and JSON has no inf
+                Real cost = r.relMSE * r.renderSeconds;
+                if (cost > 0)
+                    out << 1 / cost;
+                else
+                    out << "null";
+            }
+            if (!r.phases.empty())
+            {
+                out << ", \"perf\": {";
+                for (size_t p = 0; p < r.phases.size(); p++)
+                {
+                    const PerfCounts &c = r.phases[p].counts;
+                    out << (p > 0 ? ", " : "") << "\"" << r.phases[p].name << "\": {\"seconds\": " << r.phases[p].seconds
+                        << ", \"ipc\": " << c.ipc();
+                    const std::pair<const char *, PerfEvent> fields[] = {{"cycles", PerfEvent::Cycles}, {"instructions", PerfEvent::Instructions},
+                                                                         {"cache_misses", PerfEvent::CacheMisses},
+                                                                         {"branch_misses", PerfEvent::BranchMisses}};
+                    for (const auto &field : fields)
+                    {
+                        if (c.has(field.second))
+                            out << ", \"" << field.first << "\": " << c[field.second];
+                    }
+                    out << "}";
+                }
+                out << "}";
+            }
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+// The report has one scene per line, so reading it back doesn't need a real json parser
+static bool jsonField(const std::string &line, const std::string &key, Real &value)
+{
+    size_t pos = line.find("\"" + key + "\": ");
+    if (pos == std::string::npos)
+        return false;
+    value = std::stod(line.substr(pos + key.size() + 4));
+    return true;
+}
+
+static std::map<std::string, SceneResult> readReport(const fs::path &path)
+{
+    std::ifstream in(path);
+    if (!in)
+        Error(std::string("Can't read report ") + path.string());
+
+    std::map<std::string, SceneResult> results;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t pos = line.find("\"name\": \"");
+        if (pos == std::string::npos)
+            continue;
+        SceneResult r;
+        r.name = line.substr(pos + 9, line.find('"', pos + 9) - pos - 9);
+        r.rendered = jsonField(line, "render_seconds", r.renderSeconds);
+        jsonField(line, "wall_seconds", r.wallSeconds);
+        jsonField(line, "rays_per_second", r.raysPerSecond);
+        Real rss = 0;
+        jsonField(line, "peak_rss_kb", rss);
+        r.peakRssKB = (size_t)rss;
+        r.hasReference = jsonField(line, "relmse", r.relMSE);
+        jsonField(line, "rmse", r.rmse);
+        results[r.name] = r;
+    }
+    return results;
+}
+
+static std::string percentChange(Real before, Real after)
+{
+    std::ostringstream out;
+    out << std::showpos << std::fixed << std::setprecision(1) << (before == 0 ? 0 : 100 * (after - before) / before) << "%";
+    return out.str();
+}
+
+// Prints old vs new per scene, returns how many scenes got slower or noisier by more than the threshold
+static int compareReports(const std::map<std::string, SceneResult> &before, const std::vector<SceneResult> &after, Real threshold)
+{
+    int regressions = 0;
+    std::cout << std::endl
+              << std::left << std::setw(24) << "scene" << std::right << std::setw(12) << "render" << std::setw(12) << "rays/s"
+              << std::setw(12) << "peak rss" << std::setw(12) << "relMSE" << std::endl;
+    for (const SceneResult &r : after)
+    {
+        auto it = before.find(r.name);
+        if (!r.rendered || it == before.end() || !it->second.rendered)
+            continue;
+
+        const SceneResult &old = it->second;
+        bool slower = r.renderSeconds > old.renderSeconds * (1 + threshold / 100);
+        bool noisier = r.hasReference && old.hasReference && r.relMSE > old.relMSE * (1 + threshold / 100);
+        std::cout << std::left << std::setw(24) << r.name << std::right << std::setw(12) << percentChange(old.renderSeconds, r.renderSeconds)
+                  << std::setw(12) << percentChange(old.raysPerSecond, r.raysPerSecond) << std::setw(12) << percentChange(old.peakRssKB, r.peakRssKB)
+                  << std::setw(12) << (r.hasReference && old.hasReference ? percentChange(old.relMSE, r.relMSE) : "-")
+                  << (slower || noisier ? "  REGRESSION" : "") << std::endl;
+        regressions += slower || noisier;
+    }
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    fs::path manifest = TORREY_BENCH_MANIFEST;
+    fs::path jsonPath, comparePath, imageDir;
+    bool writeReferences = false;
+    bool perf = false;
+    int referenceSpp = 1024;
+    Real threshold = 5;
+    int threads = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-manifest" && i + 1 < argc)
+            manifest = argv[++i];
+        else if (arg == "-json" && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (arg == "-compare" && i + 1 < argc)
+            comparePath = argv[++i];
+        else if (arg == "-threshold" && i + 1 < argc)
+            threshold = std::stod(argv[++i]);
+        else if (arg == "-images" && i + 1 < argc)
+            imageDir = argv[++i];
+        else if (arg == "-write_references")
+            writeReferences = true;
+        else if (arg == "-reference_spp" && i + 1 < argc)
+            referenceSpp = std::stoi(argv[++i]);
+        else if (arg == "-t" && i + 1 < argc)
+            threads = std::stoi(argv[++i]);
+        else if (arg == "-perf")
+            perf = true;
+        else
+        {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    parallel_init(threads);
+    if (perf)
+        perf_enable();
+
+    fs::path referenceDir = manifest.parent_path() / "references";
+    if (!imageDir.empty())
+        fs::create_directories(imageDir);
+
+    std::vector<SceneResult> results;
+    for (const BenchScene &bench : readManifest(manifest))
+    {
+        SceneResult result;
+        result.name = bench.name;
+        if (!fs::exists(bench.scene))
+        {
+            std::cout << "Skipping " << bench.name << ", " << bench.scene.string() << " doesn't exist" << std::endl;
+            results.push_back(result);
+            continue;
+        }
+
+        fs::path reference = referenceDir / (bench.name + ".exr");
+        if (writeReferences)
+        {
+            Renderer renderer(Mode::MATTE_REFLECT);
+            fs::create_directories(referenceDir);
+            imwrite(reference, renderScene(bench, referenceSpp, renderer));
+            std::cout << "Wrote reference " << reference.string() << std::endl;
+        }
+
+        // Peak RSS is process wide, start it over for each scene
+        resetPeakRss();
+        perf_reset_phases();
+        Timer timer;
+        tick(timer);
+        Renderer renderer(Mode::MATTE_REFLECT);
+        Image3 img = renderScene(bench, bench.spp, renderer);
+
+        result.rendered = true;
+        result.wallSeconds = tick(timer);
+        result.renderSeconds = renderer.renderSeconds;
+        result.rays = renderer.raysTraced();
+        result.raysPerSecond = result.rays / std::max(result.renderSeconds, (Real)1e-9);
+        result.peakRssKB = peakRssBytes() / 1024;
+        result.phases = perf_phases();
+        perf_report(std::cout);
+
+        if (fs::exists(reference))
+        {
+            Image3 ref = imread3(reference);
+            if (ref.width == img.width && ref.height == img.height)
+            {
+                result.hasReference = true;
+                compareImages(img, ref, result.rmse, result.relMSE);
+            }
+            else
+                std::cout << "Reference for " << bench.name << " is " << ref.width << "x" << ref.height << ", skipping the comparison" << std::endl;
+        }
+
+        if (!imageDir.empty())
+            imwrite(imageDir / (bench.name + ".exr"), img);
+
+        std::cout << bench.name << ": " << result.renderSeconds << " s render (" << result.wallSeconds << " s total), "
+                  << result.raysPerSecond / 1e6 << " Mrays/s, " << result.peakRssKB / 1024 << " MB peak";
+        if (result.hasReference)
+            std::cout << ", RMSE " << result.rmse << ", relMSE " << result.relMSE;
+        std::cout << std::endl;
+        results.push_back(result);
+    }
+
+    if (!jsonPath.empty())
+        writeReport(jsonPath, results, threads);
+
+    int regressions = 0;
+    if (!comparePath.empty())
+        regressions = compareReports(readReport(comparePath), results, threshold);
+
+    parallel_cleanup();
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,507 @@
+/**
+ * Microbenchmarks for the hot kernels: ray/box, ray/triangle, ray/sphere, BVH build and traversal,
+ * the rng, texture sampling and the materials. Everything is generated from fixed seeds so two runs
+ * (or two commits) measure exactly the same work.
+ *
+ * Usage: torrey_bench [-filter <substring>] [-repeats <n>] [-min_time <seconds>] [-json <file>]
+ * The table goes to stdout, -json writes the same numbers out for regression tracking.
+ */
+
+#include "../custom/bounding_box.h"
+#include "../custom/camera.h"
+#include "../custom/materials.h"
+#include "../custom/pcg.h"
+#include "../custom/ray_packet.h"
+#include "../custom/shapes.h"
+#include "../custom/texture.h"
+#include "../parallel.h"
+#include "../timer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace cu_utils;
+
+struct BenchResult
+{
+    std::string name;
+    std::string unit;    // What one op is
+    int64_t opsPerSample; // Ops in one timed sample
+    std::vector<Real> seconds;
+    double checksum;     // Keeps the work from being optimized out, and should match between runs
+
+    Real nsPerOp(Real s) const { return s * 1e9 / opsPerSample; }
+    Real median() const
+    {
+        std::vector<Real> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[sorted.size() / 2];
+    }
+    Real best() const { return *std::min_element(seconds.begin(), seconds.end()); }
+};
+
+struct BenchOptions
+{
+    std::string filter;
+    int repeats = 7;
+    Real minTime = 0.05; // Seconds per sample, short runs get looped until they take this long
+    std::string jsonPath;
+};
+
+// A run returns a checksum of whatever it computed
+using BenchFunc = std::function<double()>;
+
+struct Bench
+{
+    int64_t opsPerRun;
+    BenchFunc run;
+};
+
+class BenchSuite
+{
+public:
+    BenchSuite(const BenchOptions &options) : options(options) {}
+
+    // setup only runs if the benchmark isn't filtered out, so skipped ones don't pay for their data
+    void add(const std::string &name, const std::string &unit, const std::function<Bench()> &setup)
+    {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+            return;
+
+        Bench bench = setup();
+        BenchFunc &run = bench.run;
+        BenchResult result{name, unit, bench.opsPerRun, {}, 0};
+
+        // One untimed run to warm caches and fault pages in, and to see how many runs make up a sample
+        Timer timer;
+        tick(timer);
+        result.checksum = run();
+        Real once = tick(timer);
+        int runsPerSample = (int)std::clamp(std::ceil(options.minTime / std::max(once, (Real)1e-9)), (Real)1, (Real)1e6);
+        result.opsPerSample *= runsPerSample;
+
+        for (int i = 0; i < options.repeats; i++)
+        {
+            tick(timer);
+            for (int j = 0; j < runsPerSample; j++)
+            {
+                double checksum = run();
+                if (checksum != result.checksum)
+                    std::cerr << "Warning: " << name << " isn't deterministic (checksum " << checksum << " vs " << result.checksum << ")" << std::endl;
+            }
+            result.seconds.push_back(tick(timer));
+        }
+
+        std::cout << std::left << std::setw(32) << name << std::right << std::setw(12) << std::fixed << std::setprecision(2)
+                  << result.nsPerOp(result.median()) << " ns/" << std::left << std::setw(10) << unit << std::right
+                  << " (best " << result.nsPerOp(result.best()) << ")" << std::endl;
+        results.push_back(result);
+    }
+
+    void writeJson(const std::string &path) const
+    {
+        std::ofstream out(path);
+        out << std::setprecision(10);
+        out << "{\n  \"real_size\": " << sizeof(Real) << ",\n  \"repeats\": " << options.repeats << ",\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const BenchResult &r = results[i];
+            out << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\", \"ops_per_sample\": " << r.opsPerSample
+                << ", \"median_ns_per_op\": " << r.nsPerOp(r.median()) << ", \"best_ns_per_op\": " << r.nsPerOp(r.best())
+                << ", \"checksum\": " << r.checksum << ", \"seconds\": [";
+            for (size_t j = 0; j < r.seconds.size(); j++)
+                out << (j ? ", " : "") << r.seconds[j];
+            out << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+private:
+    BenchOptions options;
+    std::vector<BenchResult> results;
+};
+
+static Real rand01(pcg32_state &rng)
+{
+    return next_pcg32_real<Real>(rng);
+}
+
+static Vector3 randomPoint(pcg32_state &rng, Real extent)
+{
+    return Vector3{rand01(rng) * 2 - 1, rand01(rng) * 2 - 1, rand01(rng) * 2 - 1} * extent;
+}
+
+static std::vector<Ray> randomRays(int count, uint64_t seed, Real extent)
+{
+    pcg32_state rng = init_pcg32(seed);
+    std::vector<Ray> rays;
+    for (int i = 0; i < count; i++)
+    {
+        Vector3 origin = randomPoint(rng, extent * 2);
+        rays.push_back(Ray(origin, randomPoint(rng, extent) - origin));
+    }
+    return rays;
+}
+
+// Small triangles scattered through a cube, like a chopped up mesh
+static std::vector<Shape *> randomTriangles(int count, uint64_t seed)
+{
+    pcg32_state rng = init_pcg32(seed);
+    Real size = 4 / std::cbrt((Real)count);
+    std::vector<Shape *> shapes;
+    for (int i = 0; i < count; i++)
+    {
+        Vector3 p = randomPoint(rng, 2);
+        shapes.push_back(new Triangle(p, p + randomPoint(rng, size), p + randomPoint(rng, size), 0));
+    }
+    return shapes;
+}
+
+// A bumpy heightfield, closer to what real meshes look like to the BVH than a triangle soup
+static std::vector<Shape *> heightfield(int n)
+{
+    std::vector<Vector3> grid((n + 1) * (n + 1));
+    for (int y = 0; y <= n; y++)
+        for (int x = 0; x <= n; x++)
+        {
+            Real u = (Real)x / n * 4 - 2, v = (Real)y / n * 4 - 2;
+            grid[y * (n + 1) + x] = Vector3{u, 0.3 * std::sin(5 * u) * std::cos(4 * v), v - 4};
+        }
+
+    std::vector<Shape *> shapes;
+    for (int y = 0; y < n; y++)
+        for (int x = 0; x < n; x++)
+        {
+            int i = y * (n + 1) + x;
+            shapes.push_back(new Triangle(grid[i], grid[i + 1], grid[i + n + 1], 0));
+            shapes.push_back(new Triangle(grid[i + 1], grid[i + n + 2], grid[i + n + 1], 0));
+        }
+    return shapes;
+}
+
+static void freeShapes(std::vector<Shape *> &shapes)
+{
+    for (Shape *shape : shapes)
+        delete shape;
+    shapes.clear();
+}
+
+static void addIntersectionBenches(BenchSuite &suite)
+{
+    const int numRays = 1024, numPrims = 256;
+
+    suite.add("ray_box", "test", [=]()
+              {
+        auto rays = std::make_shared<std::vector<Ray>>(randomRays(numRays, 1, 2));
+        auto boxes = std::make_shared<std::vector<BoundingBox>>();
+        pcg32_state rng = init_pcg32(2);
+        for (int i = 0; i < numPrims; i++)
+        {
+            Vector3 c = randomPoint(rng, 2);
+            Vector3 e = Vector3{rand01(rng), rand01(rng), rand01(rng)} * 0.5;
+            boxes->push_back(BoundingBox(c - e, c + e));
+        }
+        return Bench{(int64_t)numRays * numPrims, [=]()
+        {
+            double hits = 0;
+            for (const Ray &ray : *rays)
+                for (const BoundingBox &box : *boxes)
+                    hits += box.checkHit(ray, 0, infinity<Real>());
+            return hits;
+        }}; });
+
+    for (bool watertight : {false, true})
+    {
+        suite.add(watertight ? "ray_triangle_watertight" : "ray_triangle", "test", [=]()
+                  {
+            auto rays = std::make_shared<std::vector<Ray>>(randomRays(numRays, 3, 2));
+            std::shared_ptr<std::vector<Shape *>> tris(new std::vector<Shape *>(randomTriangles(numPrims, 4)), [](std::vector<Shape *> *s)
+                                                       { freeShapes(*s); delete s; });
+            return Bench{(int64_t)numRays * numPrims, [=]()
+            {
+                bool old = Triangle::watertight;
+                Triangle::watertight = watertight;
+                double sum = 0;
+                for (const Ray &ray : *rays)
+                    for (Shape *shape : *tris)
+                    {
+                        Real t, u, v;
+                        if (static_cast<Triangle *>(shape)->intersect(ray, 0, infinity<Real>(), t, u, v))
+                            sum += t;
+                    }
+                Triangle::watertight = old;
+                return sum;
+            }}; });
+    }
+
+    suite.add("ray_sphere", "test", [=]()
+              {
+        auto rays = std::make_shared<std::vector<Ray>>(randomRays(numRays, 5, 2));
+        auto spheres = std::make_shared<std::vector<Sphere>>();
+        pcg32_state rng = init_pcg32(6);
+        for (int i = 0; i < numPrims; i++)
+            spheres->push_back(Sphere(randomPoint(rng, 2), 0.05 + rand01(rng) * 0.2, 0));
+        return Bench{(int64_t)numRays * numPrims, [=]()
+        {
+            double sum = 0;
+            for (const Ray &ray : *rays)
+                for (const Sphere &sphere : *spheres)
+                {
+                    RayHit hit = sphere.checkHit(ray, 0, infinity<Real>());
+                    if (hit.hit)
+                        sum += hit.t;
+                }
+            return sum;
+        }}; });
+}
+
+static void addBVHBenches(BenchSuite &suite)
+{
+    for (int count : {1000, 10000, 100000})
+    {
+        suite.add("bvh_build/" + std::to_string(count), "prim", [=]()
+                  {
+            std::shared_ptr<std::vector<Shape *>> tris(new std::vector<Shape *>(randomTriangles(count, 7)), [](std::vector<Shape *> *s)
+                                                       { freeShapes(*s); delete s; });
+            return Bench{count, [=]()
+            {
+                BVHNode root = BVHNode::buildTree(*tris);
+                return (double)root.children.size() + root.box.maxc.x;
+            }}; });
+    }
+
+    // Heightfield seen from above at an angle, 2 * 256^2 triangles
+    struct TraversalScene
+    {
+        std::vector<Shape *> shapes;
+        BVHNode root;
+        std::vector<Ray> cameraRays;
+        std::vector<Ray> shadowRays;
+        std::vector<Real> shadowDist;
+
+        ~TraversalScene() { freeShapes(shapes); }
+    };
+
+    auto makeScene = []()
+    {
+        auto scene = std::make_shared<TraversalScene>();
+        scene->shapes = heightfield(256);
+        scene->root = BVHNode::buildTree(scene->shapes);
+
+        const int width = 128, height = 128;
+        Camera cam = CameraBuilder(width, height).setLookFrom(Vector3{0, 2, 0}).setLookAt(Vector3{0, 0, -4}).setUp(Vector3{0, 1, 0}).setFov(60).build();
+        Vector3 light{1, 3, -3};
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+            {
+                Ray ray = cam.ScToWRay(x + 0.5, y + 0.5);
+                scene->cameraRays.push_back(ray);
+
+                // Shadow rays from wherever the camera rays land, towards a point light
+                RayHit hit = scene->root.checkHit(ray, 0, infinity<Real>());
+                if (hit.hit)
+                {
+                    Vector3 p = ray * hit.t + hit.normal * 1e-4;
+                    scene->shadowRays.push_back(Ray(p, light - p));
+                    scene->shadowDist.push_back(length(light - p));
+                }
+            }
+        return scene;
+    };
+
+    std::shared_ptr<TraversalScene> scene;
+    auto getScene = [&]()
+    {
+        if (!scene)
+            scene = makeScene();
+        return scene;
+    };
+
+    suite.add("bvh_closest_hit", "ray", [&]()
+              {
+        auto s = getScene();
+        return Bench{128 * 128, [s]()
+        {
+            double sum = 0;
+            for (const Ray &ray : s->cameraRays)
+            {
+                RayHit hit = s->root.checkHit(ray, 0, infinity<Real>());
+                if (hit.hit)
+                    sum += hit.t;
+            }
+            return sum;
+        }}; });
+
+    // Same camera rays in 4x4 pixel packets, the checksum has to match bvh_closest_hit
+    suite.add("bvh_packet_closest_hit", "ray", [&]()
+              {
+        auto s = getScene();
+        return Bench{128 * 128, [s]()
+        {
+            double sum = 0;
+            for (int by = 0; by < 128; by += PACKET_WIDTH)
+                for (int bx = 0; bx < 128; bx += PACKET_WIDTH)
+                {
+                    RayPacket packet;
+                    for (int y = by; y < by + PACKET_WIDTH; y++)
+                        for (int x = bx; x < bx + PACKET_WIDTH; x++)
+                            packet.add(s->cameraRays[y * 128 + x]);
+
+                    s->root.checkHitPacket(packet);
+                    for (int k = 0; k < packet.size; k++)
+                    {
+                        if (packet.hits[k].hit)
+                            sum += packet.hits[k].t;
+                    }
+                }
+            return sum;
+        }}; });
+
+    // Shadow rays only need to know if anything is in the way. Closest hit on the same rays for comparison.
+    for (bool anyHit : {false, true})
+    {
+        suite.add(anyHit ? "bvh_any_hit" : "bvh_shadow_closest_hit", "ray", [&]()
+                  {
+            auto s = getScene();
+            return Bench{(int64_t)s->shadowRays.size(), [s, anyHit]()
+            {
+                double blocked = 0;
+                for (size_t i = 0; i < s->shadowRays.size(); i++)
+                {
+                    if (anyHit)
+                        blocked += s->root.occluded(s->shadowRays[i], 0, s->shadowDist[i]);
+                    else
+                        blocked += s->root.checkHit(s->shadowRays[i], 0, s->shadowDist[i]).hit;
+                }
+                return blocked;
+            }}; });
+    }
+}
+
+static void addSamplingBenches(BenchSuite &suite)
+{
+    const int count = 1 << 20;
+    suite.add("pcg32_real", "sample", [=]()
+              {
+        return Bench{count, [=]()
+        {
+            pcg32_state rng = init_pcg32(9);
+            double sum = 0;
+            for (int i = 0; i < count; i++)
+                sum += next_pcg32_real<Real>(rng);
+            return sum;
+        }}; });
+
+    for (TexelFormat format : {TexelFormat::GAMMA8, TexelFormat::HALF})
+    {
+        std::string name = format == TexelFormat::HALF ? "texture_sample_half" : "texture_sample_8bit";
+        suite.add(name, "lookup", [=]()
+                  {
+            // Smooth pattern so the mips aren't all grey
+            Image3 image(1024, 1024);
+            for (int y = 0; y < image.height; y++)
+                for (int x = 0; x < image.width; x++)
+                    image(x, y) = Vector3{0.5 + 0.5 * std::sin(x * 0.05), 0.5 + 0.5 * std::cos(y * 0.03), (Real)((x ^ y) & 255) / 255};
+            auto map = std::make_shared<MipMap>(image, format);
+            return Bench{count / 4, [=]()
+            {
+                pcg32_state rng = init_pcg32(10);
+                double sum = 0;
+                for (int i = 0; i < count / 4; i++)
+                {
+                    Real u = rand01(rng), v = rand01(rng);
+                    sum += map->sample(u, v, rand01(rng) * 8)[0];
+                }
+                return sum;
+            }}; });
+    }
+}
+
+static void addMaterialBenches(BenchSuite &suite)
+{
+    const int count = 1 << 18;
+
+    struct MaterialCase
+    {
+        std::string name;
+        std::function<Material *()> make;
+    };
+    std::vector<MaterialCase> cases = {
+        {"lambert", []() -> Material * { return new LambertMaterial(); }},
+        {"phong", []() -> Material * { auto m = new PhongMaterial(); m->exp = 50; return m; }},
+        {"blinn_phong", []() -> Material * { auto m = new BlinnPhongMaterial(); m->exp = 50; return m; }},
+        {"microfacet", []() -> Material * { auto m = new MicrofacetMaterial(); m->exp = 50; return m; }},
+    };
+
+    for (const MaterialCase &c : cases)
+    {
+        suite.add("scatter/" + c.name, "sample", [=]()
+                  {
+            std::shared_ptr<Material> material(c.make());
+            material->flatColor = Vector3{0.8, 0.6, 0.4};
+            material->finish();
+            return Bench{count, [=]()
+            {
+                pcg32_state rng = init_pcg32(11);
+                double sum = 0;
+                for (int i = 0; i < count; i++)
+                {
+                    // Incoming rays over the upper hemisphere of a flat hit at the origin
+                    Vector3 from = Vector3{rand01(rng) * 2 - 1, rand01(rng) + 0.1, rand01(rng) * 2 - 1};
+                    Ray ray(from, -from);
+                    RayHit hit(true, length(from), nullptr, Vector3{0, 1, 0}, 0.5, 0.5, false);
+
+                    Vector3 albedo;
+                    Ray scattered;
+                    Real pdf;
+                    if (material->scatter(ray, hit, albedo, scattered, pdf, rng))
+                        sum += pdf + material->scattering_pdf(ray, hit, scattered);
+                }
+                return sum;
+            }}; });
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-filter" && i + 1 < argc)
+            options.filter = argv[++i];
+        else if (arg == "-repeats" && i + 1 < argc)
+            options.repeats = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "-min_time" && i + 1 < argc)
+            options.minTime = std::stod(argv[++i]);
+        else if (arg == "-json" && i + 1 < argc)
+            options.jsonPath = argv[++i];
+        else
+        {
+            std::cerr << "Usage: torrey_bench [-filter <substring>] [-repeats <n>] [-min_time <seconds>] [-json <file>]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Everything runs on the calling thread, the pool is only here for code that expects one
+    parallel_init(1);
+
+    BenchSuite suite(options);
+    addIntersectionBenches(suite);
+    addBVHBenches(suite);
+    addSamplingBenches(suite);
+    addMaterialBenches(suite);
+
+    if (!options.jsonPath.empty())
+        suite.writeJson(options.jsonPath);
+
+    parallel_cleanup();
+    return 0;
+}
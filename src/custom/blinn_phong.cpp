@@ -11,21 +11,22 @@ using namespace cu_utils;
 
 cu_utils::BlinnPhongMaterial::BlinnPhongMaterial() : Material(){};
 
-Vector3 cu_utils::BlinnPhongMaterial::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
+bool cu_utils::BlinnPhongMaterial::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
 {
-        Vector3 color = Vector3{0, 0, 0};
     Vector3 hit = ray * bestHit.t;
 
     // Perform diffuse interreflection now
     if (depth <= 0)
-        return Vector3{0, 0, 0};
+    {
+        emitted = Vector3{0, 0, 0};
+        return false;
+    }
     
     // Copied from Peter Shirley's Ray Tracing in One Weekend
     Ray scattered;
-    Vector3 attenuation;
-    Vector3 emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
     Real pdf;
     Vector3 albedo;
+    emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
 
     // Make sure we hit on the right side, otherwise emitted light is 0
     if (bestHit.backface)
@@ -47,7 +48,7 @@ Vector3 cu_utils::BlinnPhongMaterial::shadePoint(const Renderer *renderer, const
     Real scatterOrLight = next_pcg32_real<Real>(rng);
     if (scatterOrLight <= 0.5 || numAreaLights == 0) {
         if (!scatter(ray, bestHit, albedo, scattered, pdf, rng))
-            return emitted;
+            return false;
     } else {
         // Sample the shape
         Real jacobian;
@@ -55,7 +56,7 @@ Vector3 cu_utils::BlinnPhongMaterial::shadePoint(const Renderer *renderer, const
         Vector3 scatterDir = normalize(emissionRay.origin - hit);
 
         scattered = Ray(hit, scatterDir);
-        albedo = getTexColor(bestHit.u, bestHit.v);
+        albedo = getTexColor(bestHit);
     }
 
     // What is pdf? It is the joint probability of both the sampler and the emitter! :D
@@ -73,9 +74,9 @@ Vector3 cu_utils::BlinnPhongMaterial::shadePoint(const Renderer *renderer, const
 
     Real coeff = (exp+2) / (4 * MY_PI * (2-pow(2, -exp/2)));
 
-    return emitted
-         + fresnel * coeff * pow(dot(bestHit.normal, half), exp)
-        * renderer->getPixelColor(scattered, scene, objRoot, rng, depth - 1) / pdf;
+    next = scattered;
+    weight = fresnel * coeff * pow(dot(bestHit.normal, half), exp) / pdf;
+    return true;
 }
 
 
@@ -96,7 +97,7 @@ bool BlinnPhongMaterial::scatter(const Ray &ray, const RayHit &hit, Vector3 &alb
 
     Vector3 direction = reflect(ray.dir, half);
     scattered = Ray(ray * hit.t, direction);
-    alb = getTexColor(hit.u, hit.v);
+    alb = getTexColor(hit);
 
     pdf = scattering_pdf(ray, hit, scattered);
 
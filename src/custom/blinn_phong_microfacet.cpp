@@ -30,21 +30,22 @@ Real genGeomShadowMask(const RayHit &bestHit, const Vector3 &dir, const Real exp
 }
 
 // Should prolly pass by reference here
-Vector3 cu_utils::MicrofacetMaterial::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
+bool cu_utils::MicrofacetMaterial::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
 {
-        Vector3 color = Vector3{0, 0, 0};
     Vector3 hit = ray * bestHit.t;
 
     // Perform diffuse interreflection now
     if (depth <= 0)
-        return Vector3{0, 0, 0};
+    {
+        emitted = Vector3{0, 0, 0};
+        return false;
+    }
     
     // Copied from Peter Shirley's Ray Tracing in One Weekend
     Ray scattered;
-    Vector3 attenuation;
-    Vector3 emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
     Real pdf;
     Vector3 albedo;
+    emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
 
     // Make sure we hit on the right side, otherwise emitted light is 0
     if (bestHit.backface)
@@ -66,7 +67,7 @@ Vector3 cu_utils::MicrofacetMaterial::shadePoint(const Renderer *renderer, const
     Real scatterOrLight = next_pcg32_real<Real>(rng);
     if (scatterOrLight <= 0.5 || numAreaLights == 0) {
         if (!scatter(ray, bestHit, albedo, scattered, pdf, rng))
-            return emitted;
+            return false;
     } else {
         // Sample the shape
         Real jacobian;
@@ -74,7 +75,7 @@ Vector3 cu_utils::MicrofacetMaterial::shadePoint(const Renderer *renderer, const
         Vector3 scatterDir = normalize(emissionRay.origin - hit);
 
         scattered = Ray(hit, scatterDir);
-        albedo = getTexColor(bestHit.u, bestHit.v);
+        albedo = getTexColor(bestHit);
     }
 
     // What is pdf? It is the joint probability of both the sampler and the emitter! :D
@@ -96,7 +97,10 @@ Vector3 cu_utils::MicrofacetMaterial::shadePoint(const Renderer *renderer, const
 
     // Honestly don't think this ever happens but just in case
     if (dot(scattered.dir, bestHit.normal) <= 0)
-        return Vector3{0, 0, 0};
+    {
+        emitted = Vector3{0, 0, 0};
+        return false;
+    }
 
     Vector3 coeff = fresnel * ndf * geomShadowMask / (4 * dot(bestHit.normal, -ray.dir)) / pdf;
 
@@ -105,12 +109,14 @@ Vector3 cu_utils::MicrofacetMaterial::shadePoint(const Renderer *renderer, const
 
     // Get texture emission as well
     Vector3 texEmit = Vector3{0, 0, 0};
-    if (emissiveMeta != nullptr) {
-        texEmit = getEmission(bestHit.u, bestHit.v);
+    if (emissiveTex.valid()) {
+        texEmit = getEmission(bestHit);
     }
 
-    return emitted + texEmit
-         + coeff * renderer->getPixelColor(scattered, scene, objRoot, rng, depth - 1);
+    emitted = emitted + texEmit;
+    next = scattered;
+    weight = coeff;
+    return true;
 }
 
 /**
@@ -132,7 +138,7 @@ bool MicrofacetMaterial::scatter(const Ray &ray, const RayHit &hit, Vector3 &alb
 
     Vector3 direction = reflect(ray.dir, half);
     scattered = Ray(ray * hit.t, direction);
-    alb = getTexColor(hit.u, hit.v);
+    alb = getTexColor(hit);
 
     pdf = scattering_pdf(ray, hit, scattered);
 
@@ -4,6 +4,7 @@
 #include <iostream>
 #include "utils.h"
 #include "sah.h"
+#include "render_stats.h"
 
 using namespace cu_utils;
 
@@ -58,8 +59,6 @@ BoundingBox BoundingBox::operator+(const BoundingBox &other) const {
     return BoundingBox(minc, maxc);    
 }
 
-int BVHNode::scansMade = 0;
-int BVHNode::boxesHit = 0;
 
 BVHNode::BVHNode(): BVHNode(BoundingBox(), std::vector<Shape *>()) {}
 
@@ -83,6 +82,10 @@ BVHPrimitiveInfo::BVHPrimitiveInfo(Shape *primitiveRef, BoundingBox bounds)
 
 // Give shapes and precompute bounding boxes
 BVHNode BVHNode::buildTree(std::vector<Shape *> shapes) {
+    return buildTree(shapes, BVHBuildSettings());
+}
+
+BVHNode BVHNode::buildTree(std::vector<Shape *> shapes, const BVHBuildSettings &settings) {
 
     // Generate primitive info
     std::vector<BVHPrimitiveInfo> primInfo;
@@ -93,16 +96,20 @@ BVHNode BVHNode::buildTree(std::vector<Shape *> shapes) {
     }
 
     // Build the tree
-    return buildTree(primInfo, 0, shapes.size());
+    return buildTree(primInfo, 0, shapes.size(), settings);
 }
 
 BVHNode BVHNode::buildTree(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end)
 {
-    // If it's just one shape, return a node with that shape
-    // Wonder if this catches all leaf cases? :/
-    if (end - start == 1)
+    return buildTree(primInfo, start, end, BVHBuildSettings());
+}
+
+BVHNode BVHNode::buildTree(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, const BVHBuildSettings &settings)
+{
+    // Few enough shapes to test them all at once
+    if (end - start <= 1 || (!settings.leafByCost && end - start <= settings.maxLeafSize))
     {
-        return BVHNode(primInfo[start].bounds, std::vector<Shape *>{primInfo[start].primitiveRef});
+        return makeLeaf(primInfo, start, end);
     }
 
     // Otherwise, return a branch node
@@ -130,98 +137,157 @@ BVHNode BVHNode::buildTree(std::vector<BVHPrimitiveInfo> &primInfo, int start, i
     int mid = start + (end - start) / 2;
 
     // Perform SAH
-    BucketInfo buckets[DEF_NUM_BUCKETS];
-    computeBuckets(primInfo, start, end, root.box, longestAxis, buckets);
-
-    Real cost[DEF_NUM_BUCKETS - 1];
-    for (int i = 0; i < DEF_NUM_BUCKETS - 1; i++) {
-        cost[i] = computeBucketCost(buckets, i, root.box);
+    int numBuckets = std::clamp(settings.numBuckets, 2, MAX_NUM_BUCKETS);
+    BucketInfo buckets[MAX_NUM_BUCKETS];
+    Real cost[MAX_NUM_BUCKETS - 1];
+    if (settings.split == BVHSplit::SAH) {
+        computeBuckets(primInfo, start, end, root.box, longestAxis, buckets, numBuckets);
+        for (int i = 0; i < numBuckets - 1; i++) {
+            cost[i] = computeBucketCost(buckets, i, root.box, numBuckets, settings.traversalCost, settings.intersectCost);
+        }
     }
 
     // If everything fills into only 1 bucket, split midwise
     int populatedBuckets = 0;
-    for (int i = 0; i < DEF_NUM_BUCKETS - 1; i++) {
+    for (int i = 0; i < numBuckets - 1; i++) {
         if (buckets[i].count > 0) {
             populatedBuckets++;
         }
     }
 
     // Split midwise if there are too few shapes or if everything falls into one bucket (so our cost function doesn't work)
-    if (numPrimitives <= 4 || populatedBuckets == 1)
+    if (settings.split == BVHSplit::Median || (!settings.leafByCost && numPrimitives <= 4) || populatedBuckets == 1)
     {
         // Sort the shapes by the longest axis
         std::nth_element(primInfo.begin()+start, primInfo.begin()+mid, primInfo.begin()+end , [longestAxis](BVHPrimitiveInfo a, BVHPrimitiveInfo b)
                 { return a.bounds.centroid()[longestAxis] < b.bounds.centroid()[longestAxis]; });
 
         // Recursively build the tree
-        root.children.push_back(buildTree(primInfo, start, mid));
-        root.children.push_back(buildTree(primInfo, mid, end));
+        root.children.push_back(buildTree(primInfo, start, mid, settings));
+        root.children.push_back(buildTree(primInfo, mid, end, settings));
 
         return root;
     }
 
     Real minCost = cost[0];
     int minCostSplitBucket = 0;
-    for (int i = 1; i < DEF_NUM_BUCKETS - 1; i++) {
+    for (int i = 1; i < numBuckets - 1; i++) {
         if (cost[i] < minCost) {
             minCost = cost[i];
             minCostSplitBucket = i;
         }
     }
 
-    Real leafCost = intersectCost() * numPrimitives;
-    if (numPrimitives > 4 || minCost < leafCost) {
+    Real leafCost = settings.intersectCost * numPrimitives;
+    if (numPrimitives > settings.maxLeafSize || minCost < leafCost) {
         // Overwrite mid to the SAH split
         // If no preference is found (perhaps because there is a big plane stretching the space), split midwise.
-        mid = partitionPrimitives(primInfo, start, end, root.box, longestAxis, minCostSplitBucket);
+        mid = partitionPrimitives(primInfo, start, end, root.box, longestAxis, minCostSplitBucket, numBuckets);
+
+        // Everything landed in the last bucket (the populated count above skips it), halve instead of recursing forever
+        if (mid == start || mid == end)
+        {
+            mid = start + (end - start) / 2;
+            std::nth_element(primInfo.begin()+start, primInfo.begin()+mid, primInfo.begin()+end , [longestAxis](BVHPrimitiveInfo a, BVHPrimitiveInfo b)
+                    { return a.bounds.centroid()[longestAxis] < b.bounds.centroid()[longestAxis]; });
+        }
     }
     else {
         // Dump to one node
-        for (int i = start; i < end; i++) {
-            root.shapes.push_back(primInfo[i].primitiveRef);
-        }
-        return root;
+        return makeLeaf(primInfo, start, end);
     }
 
     root.children = {
-        buildTree(primInfo, start, mid), 
-        buildTree(primInfo, mid, end)
+        buildTree(primInfo, start, mid, settings),
+        buildTree(primInfo, mid, end, settings)
     };
 
     return root;
 }
 
-RayHit BVHNode::checkHit(const Ray &ray, Real mint, Real maxt) const
+BVHNode BVHNode::makeLeaf(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end)
 {
-    // Check for bounding box effectiveness.
-    // scansMade++; I believe these hurt performance by breaking parallelism
+    BVHNode leaf = BVHNode(primInfo[start].bounds, std::vector<Shape *>());
 
-    if (!box.checkHit(ray, mint, maxt))
+    // Triangles first so they line up with the blocks, everything else is tested one at a time after
+    std::vector<Shape *> others;
+    for (int i = start; i < end; i++)
     {
-        return RayHit();
+        leaf.box = leaf.box + primInfo[i].bounds;
+
+        Shape *shape = primInfo[i].primitiveRef;
+        if (const Triangle *tri = dynamic_cast<const Triangle *>(shape))
+        {
+            if (leaf.numTriangles % TRI_BLOCK_SIZE == 0)
+                leaf.triangleBlocks.push_back(TriangleBlock());
+
+            leaf.triangleBlocks.back().add(tri);
+            leaf.shapes.push_back(shape);
+            leaf.numTriangles++;
+        }
+        else
+            others.push_back(shape);
     }
 
-    // boxesHit++;
+    leaf.shapes.insert(leaf.shapes.end(), others.begin(), others.end());
+    return leaf;
+}
 
-    if (shapes.size() > 0)
+RayHit BVHNode::checkLeaf(const Ray &ray, Real mint, Real maxt) const
+{
+    STAT_ADD(PrimitivesTested, shapes.size());
+
+    // Only finish the triangle hit (normals, normal map) once we know it's the closest
+    const Triangle *bestTri = nullptr;
+    Real bestT = maxt, bestU = 0, bestV = 0;
+    Real farthest = maxt;
+
+    for (const TriangleBlock &block : triangleBlocks)
     {
-        // Go thru shapes and get best t
-        RayHit bestHit = RayHit();
-        Real farthest = std::numeric_limits<Real>::max();
+        Real t, u, v;
+        int lane = block.intersect(ray, mint, farthest, t, u, v);
+        if (lane >= 0)
+        {
+            bestTri = block.tris[lane];
+            bestT = t;
+            bestU = u;
+            bestV = v;
+            farthest = t;
+        }
+    }
 
-        for (int i = 0; i < shapes.size(); i++)
+    RayHit bestHit = RayHit();
+    for (size_t i = numTriangles; i < shapes.size(); i++)
+    {
+        RayHit hit = shapes[i]->checkHit(ray, mint, farthest);
+        if (hit.hit && hit.t <= farthest)
         {
-            RayHit hit = shapes[i]->checkHit(ray, 0, farthest);
-            if (hit.hit && (bestHit.hit == false || hit.t < bestHit.t))
-            {
-                bestHit = hit;
-                farthest = hit.t;
-            }
+            bestHit = hit;
+            bestTri = nullptr;
+            farthest = hit.t;
         }
+    }
+
+    if (bestTri != nullptr)
+        return bestTri->finishHit(ray, bestT, bestU, bestV);
+
+    return bestHit;
+}
+
+RayHit BVHNode::checkHit(const Ray &ray, Real mint, Real maxt) const
+{
+    STAT_INC(NodesVisited);
 
-        return bestHit;
+    if (!box.checkHit(ray, mint, maxt))
+    {
+        return RayHit();
     }
 
+    STAT_INC(BoxesHit);
+
+    if (shapes.size() > 0)
+        return checkLeaf(ray, mint, maxt);
+
     // Go over every child and compare their rayhit dists
     RayHit bestHit = RayHit();
     Real farthest = maxt;
@@ -237,4 +303,164 @@ RayHit BVHNode::checkHit(const Ray &ray, Real mint, Real maxt) const
     }
 
     return bestHit;
-}
\ No newline at end of file
+}
+
+size_t BVHNode::memoryBytes() const
+{
+    size_t total = shapes.capacity() * sizeof(Shape *) + triangleBlocks.capacity() * sizeof(TriangleBlock) +
+                   children.capacity() * sizeof(BVHNode);
+    for (const BVHNode &child : children)
+        total += child.memoryBytes();
+    return total;
+}
+
+RayHit BVHNode::checkHitCost(const Ray &ray, Real mint, Real maxt, TraversalCost &cost) const
+{
+    cost.nodesVisited++;
+    if (!box.checkHit(ray, mint, maxt))
+        return RayHit();
+
+    if (shapes.size() > 0)
+    {
+        cost.primitivesTested += shapes.size();
+        return checkLeaf(ray, mint, maxt);
+    }
+
+    RayHit bestHit = RayHit();
+    Real farthest = maxt;
+    for (const BVHNode &child : children)
+    {
+        RayHit hit = child.checkHitCost(ray, mint, farthest, cost);
+        if (hit.hit && (bestHit.hit == false || hit.t < bestHit.t))
+        {
+            bestHit = hit;
+            farthest = hit.t;
+        }
+    }
+
+    return bestHit;
+}
+
+bool BVHNode::occluded(const Ray &ray, Real mint, Real maxt) const
+{
+    STAT_INC(ShadowRays);
+    return occludedNode(ray, mint, maxt);
+}
+
+bool BVHNode::occludedNode(const Ray &ray, Real mint, Real maxt) const
+{
+    STAT_INC(NodesVisited);
+    if (!box.checkHit(ray, mint, maxt))
+        return false;
+
+    STAT_INC(BoxesHit);
+    if (shapes.size() > 0)
+    {
+        STAT_ADD(PrimitivesTested, shapes.size());
+        // No need to find the closest, or to finish the hit
+        for (const TriangleBlock &block : triangleBlocks)
+        {
+            Real t, u, v;
+            if (block.intersect(ray, mint, maxt, t, u, v) >= 0)
+                return true;
+        }
+
+        for (size_t i = numTriangles; i < shapes.size(); i++)
+        {
+            if (shapes[i]->checkHit(ray, mint, maxt).hit)
+                return true;
+        }
+        return false;
+    }
+
+    for (const BVHNode &child : children)
+    {
+        if (child.occludedNode(ray, mint, maxt))
+            return true;
+    }
+    return false;
+}
+
+// Rays left in a lane mask
+static int countLanes(uint32_t mask)
+{
+    int n = 0;
+    for (; mask != 0; mask &= mask - 1)
+        n++;
+    return n;
+}
+
+void BVHNode::checkHitPacket(RayPacket &packet) const
+{
+    packet.finalize();
+    traversePacket(packet, packet.laneMask() & ~packet.retiredLanes);
+}
+
+void BVHNode::traversePacket(RayPacket &packet, uint32_t active) const
+{
+    // Shadow rays that hit in a sibling subtree are done
+    active &= ~packet.retiredLanes;
+    if (active == 0)
+        return;
+
+    // Counted per ray so packets and single rays compare
+    STAT_ADD(NodesVisited, countLanes(active));
+
+    // Cheap test for the whole packet first, then every lane at once
+    if (packet.missesBox(box))
+        return;
+    uint32_t hitting = active & packet.boxMask(box);
+    int numHitting = countLanes(hitting);
+    STAT_ADD(BoxesHit, numHitting);
+
+    if (hitting == 0)
+        return;
+
+    if (shapes.size() > 0)
+    {
+        for (int i = 0; i < packet.size; i++)
+        {
+            if (hitting & (1u << i))
+                packet.recordHit(i, checkLeaf(packet.rays[i], 0, packet.tmax[i]));
+        }
+        return;
+    }
+
+    // The packet has diverged, finish these rays off on their own
+    if (numHitting <= PACKET_FALLBACK_RAYS)
+    {
+        for (int i = 0; i < packet.size; i++)
+        {
+            if (!(hitting & (1u << i)))
+                continue;
+
+            if (packet.anyHit)
+            {
+                // Shadow rays stop at whatever blocks them first, only hit matters so t stays at tmax
+                if (occludedNode(packet.rays[i], 0, packet.tmax[i]))
+                {
+                    packet.hits[i] = RayHit(true, packet.tmax[i], nullptr, Vector3(0.0, 0.0, 0.0), 0, 0, false);
+                    packet.retiredLanes |= 1u << i;
+                }
+                continue;
+            }
+
+            packet.recordHit(i, checkHit(packet.rays[i], 0, packet.tmax[i]));
+        }
+        return;
+    }
+
+    // Visit the child nearer to the packet first so the far one gets culled by the shrunk tmax
+    int lead = 0;
+    while (!(hitting & (1u << lead)))
+        lead++;
+    int first = 0;
+    if (children.size() == 2 && dot(children[0].box.centroid() - children[1].box.centroid(), packet.rays[lead].dir) > 0)
+        first = 1;
+
+    for (size_t c = 0; c < children.size(); c++)
+    {
+        const BVHNode &child = children[(c + first) % children.size()];
+        child.traversePacket(packet, hitting);
+    }
+}
@@ -4,9 +4,13 @@
 #include <vector>
 #include "../vector.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "triangle_block.h"
 
 namespace cu_utils
 {
+    struct BVHBuildSettings;
+
     struct BoundingBox
     {
     public:
@@ -33,6 +37,13 @@ namespace cu_utils
         BVHPrimitiveInfo(Shape *primitiveRef, BoundingBox bounds);
     };
 
+    // How much work one ray took to trace, for the heatmap
+    struct TraversalCost
+    {
+        int nodesVisited = 0;
+        int primitivesTested = 0;
+    };
+
     struct BVHNode
     {
     public:
@@ -40,16 +51,40 @@ namespace cu_utils
         std::vector<Shape *> shapes;
         std::vector<BVHNode> children;
 
+        // Leaves only. Triangles come first in shapes and are also packed into blocks for the leaf kernel.
+        std::vector<TriangleBlock> triangleBlocks;
+        int numTriangles = 0;
+
         BVHNode(BoundingBox box, std::vector<Shape *> shapes); // Children are written to afterwards
         BVHNode(BoundingBox box, std::vector<Shape *> shapes, std::vector<BVHNode> children); // Children are written to afterwards
         BVHNode();
 
         RayHit checkHit(const Ray &ray, Real mint, Real maxt) const;
 
+        // Same as checkHit, but tallies the nodes and primitives it went through into cost
+        RayHit checkHitCost(const Ray &ray, Real mint, Real maxt, TraversalCost &cost) const;
+
+        // Any hit in (mint, maxt), stops at the first one found. For visibility queries.
+        bool occluded(const Ray &ray, Real mint, Real maxt) const;
+
+        // Traces every ray of the packet together, results land in packet.hits.
+        // Same hits as calling checkHit(ray, 0, tmax) per ray.
+        void checkHitPacket(RayPacket &packet) const;
+
+        // Closest hit among this leaf's shapes
+        RayHit checkLeaf(const Ray &ray, Real mint, Real maxt) const;
+
         static BVHNode buildTree(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end);
+        static BVHNode buildTree(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, const BVHBuildSettings &settings);
+        static BVHNode makeLeaf(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end);
         static BVHNode buildTree(std::vector<Shape *> shapes);
+        static BVHNode buildTree(std::vector<Shape *> shapes, const BVHBuildSettings &settings);
+
+        // Heap memory held by this node and everything under it, not counting the node itself
+        size_t memoryBytes() const;
 
-        static int scansMade;
-        static int boxesHit;
+    private:
+        bool occludedNode(const Ray &ray, Real mint, Real maxt) const;
+        void traversePacket(RayPacket &packet, uint32_t active) const;
     };
-}
\ No newline at end of file
+}
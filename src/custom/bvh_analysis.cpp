@@ -0,0 +1,152 @@
+#include "bvh_analysis.h"
+#include "pcg.h"
+#include "utils.h"
+
+#include <chrono>
+#include <iomanip>
+
+using namespace cu_utils;
+
+struct TreeWalk
+{
+    BVHQuality &quality;
+    Real rootArea;
+    Real overlapSum = 0;
+    int numInterior = 0;
+    long long numPrimitives = 0;
+};
+
+// Surface area of the box both overlap in, 0 if they don't
+static Real overlapArea(const BoundingBox &a, const BoundingBox &b)
+{
+    Vector3 lo = max(a.minc, b.minc);
+    Vector3 hi = min(a.maxc, b.maxc);
+    if (hi.x < lo.x || hi.y < lo.y || hi.z < lo.z)
+        return 0;
+    return surfaceArea(BoundingBox(lo, hi));
+}
+
+static void walk(const BVHNode &node, int depth, TreeWalk &w)
+{
+    BVHQuality &q = w.quality;
+    q.numNodes++;
+    q.maxDepth = std::max(q.maxDepth, depth);
+    Real area = surfaceArea(node.box) / w.rootArea;
+
+    if (node.children.empty())
+    {
+        size_t size = node.shapes.size();
+        q.numLeaves++;
+        w.numPrimitives += size;
+        if (q.leavesPerDepth.size() <= (size_t)depth)
+            q.leavesPerDepth.resize(depth + 1);
+        q.leavesPerDepth[depth]++;
+        if (q.leavesPerSize.size() <= size)
+            q.leavesPerSize.resize(size + 1);
+        q.leavesPerSize[size]++;
+
+        q.sahCost += area * intersectCost() * size;
+        q.leafAreaRatio += area;
+        return;
+    }
+
+    q.sahCost += area * traversalCost();
+
+    Real parentArea = surfaceArea(node.box);
+    if (node.children.size() > 1 && parentArea > 0)
+    {
+        Real overlap = 0;
+        int pairs = 0;
+        for (size_t i = 0; i < node.children.size(); i++)
+        {
+            for (size_t j = i + 1; j < node.children.size(); j++)
+            {
+                overlap += overlapArea(node.children[i].box, node.children[j].box) / parentArea;
+                pairs++;
+            }
+        }
+        w.overlapSum += overlap / pairs;
+        w.numInterior++;
+    }
+
+    for (const BVHNode &child : node.children)
+        walk(child, depth + 1, w);
+}
+
+BVHQuality cu_utils::analyzeBVH(const BVHNode &root)
+{
+    BVHQuality quality;
+    Real rootArea = surfaceArea(root.box);
+    TreeWalk w{quality, rootArea > 0 ? rootArea : 1};
+    walk(root, 0, w);
+
+    quality.meanLeafSize = quality.numLeaves ? (Real)w.numPrimitives / quality.numLeaves : 0;
+    quality.siblingOverlap = w.numInterior ? w.overlapSum / w.numInterior : 0;
+    return quality;
+}
+
+void cu_utils::measureRays(const BVHNode &root, const std::vector<Ray> &rays, BVHQuality &quality)
+{
+    // TraversalCost's ints are sized for one pixel, summed over millions of rays they'd overflow
+    uint64_t nodesVisited = 0, primitivesTested = 0, hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const Ray &ray : rays)
+    {
+        TraversalCost cost;
+        hits += root.checkHitCost(ray, 0, infinity<Real>(), cost).hit;
+        nodesVisited += cost.nodesVisited;
+        primitivesTested += cost.primitivesTested;
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    quality.numRays = rays.size();
+    if (rays.empty())
+        return;
+    quality.nodesPerRay = (Real)nodesVisited / rays.size();
+    quality.primitivesPerRay = (Real)primitivesTested / rays.size();
+    quality.hitFraction = (Real)hits / rays.size();
+    quality.nsPerRay = elapsed.count() / rays.size();
+}
+
+std::vector<Ray> cu_utils::sampleRays(const BoundingBox &bounds, int count, uint64_t seed)
+{
+    pcg32_state rng = init_pcg32(1, seed);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    Vector3 extent = bounds.maxc - bounds.minc;
+    for (int i = 0; i < count; i++)
+    {
+        Vector3 origin = bounds.minc + Vector3(next_pcg32_real<Real>(rng) * extent.x, next_pcg32_real<Real>(rng) * extent.y,
+                                               next_pcg32_real<Real>(rng) * extent.z);
+        rays.push_back(Ray(origin, randomUnitVector(rng)));
+    }
+    return rays;
+}
+
+void cu_utils::printBVHQuality(std::ostream &os, const BVHQuality &q)
+{
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+
+    os << std::fixed << std::setprecision(3);
+    os << "  " << q.numNodes << " nodes, " << q.numLeaves << " leaves, max depth " << q.maxDepth << std::endl;
+    os << "  SAH cost " << q.sahCost << ", sibling overlap " << q.siblingOverlap << ", leaf area / root area "
+       << q.leafAreaRatio << std::endl;
+    if (q.numRays > 0)
+        os << "  " << q.numRays << " rays: " << q.nodesPerRay << " nodes, " << q.primitivesPerRay << " primitives, "
+           << std::setprecision(1) << q.nsPerRay << " ns per ray, " << 100 * q.hitFraction << "% hit" << std::endl;
+
+    os << "  leaves per depth:";
+    for (size_t d = 0; d < q.leavesPerDepth.size(); d++)
+        if (q.leavesPerDepth[d] > 0)
+            os << " " << d << ":" << q.leavesPerDepth[d];
+    os << std::endl;
+    os << "  leaves per size:";
+    for (size_t s = 0; s < q.leavesPerSize.size(); s++)
+        if (q.leavesPerSize[s] > 0)
+            os << " " << s << ":" << q.leavesPerSize[s];
+    os << std::endl;
+
+    os.flags(flags);
+    os.precision(precision);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+#include "bounding_box.h"
+#include "sah.h"
+
+/**
+ * Measures how good a BVH is, independent of the renderer around it. The SAH cost is what the
+ * builder thinks it's minimizing, the sampled ray costs are what traversal actually pays.
+ */
+namespace cu_utils
+{
+    struct BVHQuality
+    {
+        int numNodes = 0;
+        int numLeaves = 0;
+        int maxDepth = 0;
+
+        // Expected cost of a random ray through the root box, with the default cost constants so trees built
+        // with different ratios stay comparable
+        Real sahCost = 0;
+
+        std::vector<int> leavesPerDepth; // Indexed by depth, the root is 0
+        std::vector<int> leavesPerSize;  // Indexed by primitive count
+        Real meanLeafSize = 0;
+
+        // Surface area of the box two siblings share over their parent's, averaged over interior nodes.
+        // 0 means the children never overlap, 1 means they're the same box.
+        Real siblingOverlap = 0;
+        // Summed leaf surface area over the root's. Leaves overlapping each other push it up.
+        Real leafAreaRatio = 0;
+
+        // Filled in by measureRays
+        int numRays = 0;
+        Real nodesPerRay = 0;
+        Real primitivesPerRay = 0;
+        Real hitFraction = 0;
+        Real nsPerRay = 0;
+    };
+
+    // Walks the tree for everything but the ray measurements
+    BVHQuality analyzeBVH(const BVHNode &root);
+
+    // Traces the rays with checkHitCost and averages what they cost
+    void measureRays(const BVHNode &root, const std::vector<Ray> &rays, BVHQuality &quality);
+
+    // Origins anywhere in the box, directions uniform over the sphere. A stand-in for bounce rays.
+    std::vector<Ray> sampleRays(const BoundingBox &bounds, int count, uint64_t seed = 1);
+
+    void printBVHQuality(std::ostream &os, const BVHQuality &quality);
+}
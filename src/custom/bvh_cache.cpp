@@ -0,0 +1,258 @@
+#include "bvh_cache.h"
+#include "../timer.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+using namespace cu_utils;
+
+static const char BVH_MAGIC[8] = {'T', 'O', 'R', 'R', 'E', 'Y', 'B', 'V'};
+static const int32_t BVH_VERSION = 1;
+
+struct BVHFileHeader
+{
+    char magic[8];
+    int32_t version;
+    int32_t realSize;
+    uint64_t geometryHash;
+    uint64_t numShapes;
+    uint64_t numNodes;
+    uint64_t numPrimitives;
+};
+
+// One node in preorder. Children follow their parent directly, the primitives of leaves are consecutive.
+struct FlatNode
+{
+    Real minc[3];
+    Real maxc[3];
+    int32_t numChildren;
+    int32_t numShapes;
+    int32_t numTriangles;
+    int32_t pad;
+};
+
+static uint64_t mixWord(uint64_t h, uint64_t word)
+{
+    h ^= word;
+    h *= 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+static uint64_t mixReal(uint64_t h, Real value)
+{
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(Real));
+    return mixWord(h, bits);
+}
+
+uint64_t cu_utils::geometryHash(const std::vector<Shape *> &shapes)
+{
+    uint64_t h = mixWord(0, shapes.size());
+    for (const Shape *shape : shapes)
+    {
+        if (const Triangle *tri = dynamic_cast<const Triangle *>(shape))
+        {
+            h = mixWord(h, 1);
+            for (const Vector3 *v : {&tri->v0, &tri->v1, &tri->v2})
+                for (int a = 0; a < 3; a++)
+                    h = mixReal(h, (*v)[a]);
+        }
+        else if (const Sphere *sphere = dynamic_cast<const Sphere *>(shape))
+        {
+            h = mixWord(h, 2);
+            for (int a = 0; a < 3; a++)
+                h = mixReal(h, sphere->center[a]);
+            h = mixReal(h, sphere->radius);
+        }
+        else
+        {
+            // Unknown shapes still count, their bounds are all the tree sees of them
+            BoundingBox box = shape->getBoundingBox();
+            h = mixWord(h, 3);
+            for (int a = 0; a < 3; a++)
+                h = mixReal(mixReal(h, box.minc[a]), box.maxc[a]);
+        }
+    }
+    return h;
+}
+
+static void flatten(const BVHNode &node, const std::unordered_map<const Shape *, int32_t> &shapeIndex,
+                    std::vector<FlatNode> &nodes, std::vector<int32_t> &primitives)
+{
+    FlatNode flat;
+    for (int a = 0; a < 3; a++)
+    {
+        flat.minc[a] = node.box.minc[a];
+        flat.maxc[a] = node.box.maxc[a];
+    }
+    flat.numChildren = (int32_t)node.children.size();
+    flat.numShapes = (int32_t)node.shapes.size();
+    flat.numTriangles = node.numTriangles;
+    flat.pad = 0;
+    nodes.push_back(flat);
+
+    for (const Shape *shape : node.shapes)
+        primitives.push_back(shapeIndex.at(shape));
+
+    for (const BVHNode &child : node.children)
+        flatten(child, shapeIndex, nodes, primitives);
+}
+
+bool cu_utils::saveBVH(const BVHNode &root, const std::vector<Shape *> &shapes, const std::filesystem::path &path)
+{
+    std::unordered_map<const Shape *, int32_t> shapeIndex;
+    for (int i = 0; i < (int)shapes.size(); i++)
+        shapeIndex[shapes[i]] = i;
+
+    std::vector<FlatNode> nodes;
+    std::vector<int32_t> primitives;
+    flatten(root, shapeIndex, nodes, primitives);
+
+    BVHFileHeader header;
+    std::memcpy(header.magic, BVH_MAGIC, sizeof(header.magic));
+    header.version = BVH_VERSION;
+    header.realSize = sizeof(Real);
+    header.geometryHash = geometryHash(shapes);
+    header.numShapes = shapes.size();
+    header.numNodes = nodes.size();
+    header.numPrimitives = primitives.size();
+
+    // Through a temporary file so a concurrent render never loads half a tree. The cache is optional,
+    // so an unwritable folder or a full disk just means no cache this time
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    if (ec)
+        return false;
+    std::filesystem::path tmp = path;
+    tmp += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out)
+            return false;
+        out.write((const char *)&header, sizeof(header));
+        out.write((const char *)nodes.data(), nodes.size() * sizeof(FlatNode));
+        out.write((const char *)primitives.data(), primitives.size() * sizeof(int32_t));
+        out.close();
+        if (!out)
+        {
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+    {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+// Rebuilds the subtree starting at nodes[next], returns false on anything inconsistent
+static bool unflatten(const std::vector<FlatNode> &nodes, const std::vector<int32_t> &primitives,
+                      const std::vector<Shape *> &shapes, size_t &next, size_t &nextPrim, BVHNode &node, int depth)
+{
+    if (next >= nodes.size() || depth > 256)
+        return false;
+
+    const FlatNode &flat = nodes[next++];
+    node.box = BoundingBox(Vector3{flat.minc[0], flat.minc[1], flat.minc[2]}, Vector3{flat.maxc[0], flat.maxc[1], flat.maxc[2]});
+    node.numTriangles = 0;
+
+    if (flat.numShapes < 0 || flat.numTriangles < 0 || flat.numTriangles > flat.numShapes || nextPrim + flat.numShapes > primitives.size())
+        return false;
+
+    node.shapes.resize(flat.numShapes);
+    for (int i = 0; i < flat.numShapes; i++)
+    {
+        int32_t index = primitives[nextPrim++];
+        if (index < 0 || index >= (int32_t)shapes.size())
+            return false;
+        node.shapes[i] = shapes[index];
+
+        // Same block packing as makeLeaf
+        if (i < flat.numTriangles)
+        {
+            const Triangle *tri = dynamic_cast<const Triangle *>(shapes[index]);
+            if (tri == nullptr)
+                return false;
+
+            if (node.numTriangles % TRI_BLOCK_SIZE == 0)
+                node.triangleBlocks.push_back(TriangleBlock());
+            node.triangleBlocks.back().add(tri);
+            node.numTriangles++;
+        }
+    }
+
+    if (flat.numChildren < 0)
+        return false;
+
+    node.children.resize(flat.numChildren);
+    for (BVHNode &child : node.children)
+    {
+        if (!unflatten(nodes, primitives, shapes, next, nextPrim, child, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+bool cu_utils::loadBVH(const std::filesystem::path &path, const std::vector<Shape *> &shapes, BVHNode &root)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+
+    BVHFileHeader header;
+    in.read((char *)&header, sizeof(header));
+    if (!in || std::memcmp(header.magic, BVH_MAGIC, sizeof(header.magic)) != 0 || header.version != BVH_VERSION ||
+        header.realSize != sizeof(Real) || header.numShapes != shapes.size() || header.geometryHash != geometryHash(shapes))
+        return false;
+
+    // Check the counts against the file before allocating anything from them
+    std::error_code ec;
+    uint64_t body = std::filesystem::file_size(path, ec) - sizeof(header);
+    if (ec || header.numNodes > body / sizeof(FlatNode) || header.numPrimitives > body / sizeof(int32_t) ||
+        header.numNodes * sizeof(FlatNode) + header.numPrimitives * sizeof(int32_t) != body)
+        return false;
+
+    std::vector<FlatNode> nodes(header.numNodes);
+    std::vector<int32_t> primitives(header.numPrimitives);
+    in.read((char *)nodes.data(), nodes.size() * sizeof(FlatNode));
+    in.read((char *)primitives.data(), primitives.size() * sizeof(int32_t));
+    if (!in || nodes.empty())
+        return false;
+
+    size_t next = 0, nextPrim = 0;
+    BVHNode loaded;
+    if (!unflatten(nodes, primitives, shapes, next, nextPrim, loaded, 0) || next != nodes.size() || nextPrim != primitives.size())
+        return false;
+
+    root = std::move(loaded);
+    return true;
+}
+
+BVHNode cu_utils::loadOrBuildBVH(const std::vector<Shape *> &shapes, const std::filesystem::path &cacheDir)
+{
+    Timer timer;
+    tick(timer);
+
+    // The file is named after the geometry, the header hash double checks it
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.torreybvh", (unsigned long long)geometryHash(shapes));
+    std::filesystem::path path = cacheDir / name;
+
+    BVHNode root;
+    if (loadBVH(path, shapes, root))
+    {
+        std::cout << "Loaded object hierarchy from " << path.filename().string() << " in " << tick(timer) << " seconds." << std::endl;
+        return root;
+    }
+
+    root = BVHNode::buildTree(shapes);
+    if (saveBVH(root, shapes, path))
+        std::cout << "Built object hierarchy and cached it as " << path.filename().string() << std::endl;
+    else
+        std::cout << "Built object hierarchy, could not cache it in " << cacheDir.string() << std::endl;
+    return root;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file bvh_cache.h
+ * Saving built BVHs to disk so renders of unchanged geometry skip the build.
+ * The tree is written flattened in preorder (one record per node, plus the primitive order as indices into the
+ * scene's shapes) and tagged with a hash of the geometry. Loading rebuilds the nested nodes and the leaf
+ * triangle blocks straight from that, no SAH involved.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <vector>
+#include "bounding_box.h"
+#include "shapes.h"
+
+namespace cu_utils
+{
+    // Hash of everything the hierarchy depends on: shape order, types and positions. Materials, uvs and
+    // normals don't change the tree so they're left out.
+    uint64_t geometryHash(const std::vector<Shape *> &shapes);
+
+    // Returns false, leaving no file behind, when the cache can't be written
+    bool saveBVH(const BVHNode &root, const std::vector<Shape *> &shapes, const std::filesystem::path &path);
+
+    // False if the file is missing, corrupt or was built for different geometry
+    bool loadBVH(const std::filesystem::path &path, const std::vector<Shape *> &shapes, BVHNode &root);
+
+    // Loads the tree for these shapes from cacheDir, building and saving it there if it isn't cached yet
+    BVHNode loadOrBuildBVH(const std::vector<Shape *> &shapes, const std::filesystem::path &cacheDir);
+}
@@ -69,6 +69,17 @@ namespace cu_utils
             // return Ray(m_lookFrom, sRayDir);
         }
 
+        // Same as ScToWRay but also fills in the ray differentials.
+        // scale shrinks the footprint when several samples share a pixel.
+        Ray ScToWRayDifferential(Real x, Real y, Real scale = 1) const
+        {
+            Ray ray = ScToWRay(x, y);
+            ray.hasDifferentials = true;
+            ray.rxDir = ray.dir + (ScToWRay(x + 1, y).dir - ray.dir) * scale;
+            ray.ryDir = ray.dir + (ScToWRay(x, y + 1).dir - ray.dir) * scale;
+            return ray;
+        }
+
         // Camera values are protected since they are functions of each other
         Real GetScreenWidth() const
         {
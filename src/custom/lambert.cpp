@@ -12,6 +12,19 @@ using namespace cu_utils;
 cu_utils::LambertMaterial::LambertMaterial() : Material(){};
 
 Vector3 cu_utils::matte(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth)
+{
+    Vector3 emitted, weight;
+    Ray next;
+    if (!matteBounce(ray, bestHit, scene, rng, depth, emitted, weight, next))
+    {
+        renderer->endPath(depth);
+        return emitted;
+    }
+
+    return emitted + weight * renderer->getPixelColor(next, scene, objRoot, rng, depth - 1);
+}
+
+bool cu_utils::matteBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next)
 {
     Material *material = scene.materials[bestHit.sphere->material_id];
 
@@ -19,19 +32,20 @@ Vector3 cu_utils::matte(const Renderer *renderer, const Ray ray, const RayHit be
     // if (PlasticMaterial *plastic = dynamic_cast<PlasticMaterial *>(material))
     //     material = &plastic->backingLambert;
 
-    Vector3 color = Vector3{0, 0, 0};
     Vector3 hit = ray * bestHit.t;
 
     // Perform diffuse interreflection now
     if (depth <= 0)
-        return Vector3{0, 0, 0};
+    {
+        emitted = Vector3{0, 0, 0};
+        return false;
+    }
     
     // Copied from Peter Shirley's Ray Tracing in One Weekend
     Ray scattered;
-    Vector3 attenuation;
-    Vector3 emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
     Real pdf;
     Vector3 albedo;
+    emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
 
     // Make sure we hit on the right side, otherwise emitted light is 0
     if (bestHit.backface)
@@ -58,7 +72,7 @@ Vector3 cu_utils::matte(const Renderer *renderer, const Ray ray, const RayHit be
     Real scatterOrLight = next_pcg32_real<Real>(rng);
     if (scatterOrLight <= 0.5 || numAreaLights == 0) {
         if (!material->scatter(ray, bestHit, albedo, scattered, pdf, rng))
-            return emitted;
+            return false;
     } else {
         // Sample the shape
         Real jacobian;
@@ -66,7 +80,7 @@ Vector3 cu_utils::matte(const Renderer *renderer, const Ray ray, const RayHit be
         Vector3 scatterDir = normalize(emissionRay.origin - hit);
 
         scattered = Ray(hit, scatterDir);
-        albedo = material->getTexColor(bestHit.u, bestHit.v);
+        albedo = material->getTexColor(bestHit);
     }
 
     // material->scatter(ray, bestHit, albedo, scattered, pdf, rng);
@@ -80,14 +94,14 @@ Vector3 cu_utils::matte(const Renderer *renderer, const Ray ray, const RayHit be
 
     // Move scatter forwards a bit to avoid self-intersection
     scattered.origin += scattered.dir * 0.0001;
-    return emitted
-         + albedo * material->light_contribution(ray, bestHit, scattered)
-                  * renderer->getPixelColor(scattered, scene, objRoot, rng, depth - 1) / pdf;
+    next = scattered;
+    weight = albedo * material->light_contribution(ray, bestHit, scattered) / pdf;
+    return true;
 }
 
-Vector3 cu_utils::LambertMaterial::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
+bool cu_utils::LambertMaterial::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
 {
-    return matte(renderer, ray, bestHit, scene, objRoot, rng, depth);
+    return matteBounce(ray, bestHit, scene, rng, depth, emitted, weight, next);
 }
 
 
@@ -98,7 +112,7 @@ bool LambertMaterial::scatter(const Ray &ray, const RayHit &hit, Vector3 &alb, R
     auto direction = uvw.local(random_cosine_direction(rng));
 
     scattered = Ray(ray * hit.t, normalize(direction));
-    alb = getTexColor(hit.u, hit.v);
+    alb = getTexColor(hit);
     pdf = scattering_pdf(ray, hit, scattered);
     return true;
 }
@@ -9,27 +9,49 @@
 
 using namespace cu_utils;
 
-Vector3 cu_utils::mirror(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth)
+// Write in material methods
+Vector3 cu_utils::Material::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
 {
-    Material *material = scene.materials[bestHit.sphere->material_id];
-
-    Ray reflectRay = getBounceRay(ray, bestHit);
-
-    // Recurse
-    Vector3 albedo = material->getTexColor(bestHit.u, bestHit.v);
-    Vector3 fresnel = fresnelSchlick(albedo, bestHit.normal, reflectRay.dir);
+    Vector3 emitted, weight;
+    Ray next;
+    if (!sampleBounce(ray, bestHit, scene, rng, depth, emitted, weight, next))
+    {
+        renderer->endPath(depth);
+        return emitted;
+    }
+
+    return emitted + weight * renderer->getPixelColor(next, scene, objRoot, rng, depth - 1);
+}
 
-    return hadamard(fresnel, renderer->getPixelColor(reflectRay, scene, objRoot, rng, depth - 1));
+bool cu_utils::Material::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
+{
+    std::cerr << "Material::sampleBounce() called, this should never happen\n"
+              << std::endl;
+    emitted = Vector3{0, 0, 0};
+    return false;
 }
 
-Vector3 cu_utils::plastic(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth)
+bool cu_utils::MirrorMaterial::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
 {
+    if (depth <= 0)
+        return matteBounce(ray, bestHit, scene, rng, depth, emitted, weight, next);
+
     Material *material = scene.materials[bestHit.sphere->material_id];
 
+    next = getBounceRay(ray, bestHit);
+
+    // Reflection is tinted by fresnel
+    Vector3 albedo = material->getTexColor(bestHit);
+    weight = fresnelSchlick(albedo, bestHit.normal, next.dir);
+    emitted = Vector3{0, 0, 0};
+    return true;
+}
+
+bool cu_utils::PlasticMaterial::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
+{
     // Compute reflect component
     Ray reflectRay = getBounceRay(ray, bestHit);
 
-    // Recurse
     Real fresnelN = 1.5;
     Real Fz = (fresnelN - 1) * (fresnelN - 1) / ((fresnelN + 1) * (fresnelN + 1));
     Vector3 fresnel = fresnelSchlick(Vector3{Fz, Fz, Fz}, bestHit.normal, reflectRay.dir);
@@ -38,34 +60,13 @@ Vector3 cu_utils::plastic(const Renderer *renderer, const Ray ray, const RayHit
     // Get average of fresnel for weighting (just fresnel.x since we use uniform color for F0)
     Real avgFresnel = (fresnel.x + fresnel.y + fresnel.z) / 3;
     if (next_pcg32_real<Real>(rng) > avgFresnel)
-        return matte(renderer, ray, bestHit, scene, objRoot, rng, depth);
+        return matteBounce(ray, bestHit, scene, rng, depth, emitted, weight, next);
 
     reflectRay.origin = reflectRay.origin + reflectRay.dir * 0.001;
-    Vector3 reflectColor = renderer->getPixelColor(reflectRay, scene, objRoot, rng, depth - 1);
-    // Vector3 specular = hadamard(fresnel, reflectColor);
-
-    return reflectColor;
-}
-
-// Write in material methods
-Vector3 cu_utils::Material::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
-{
-    std::cerr << "Material::shadePoint() called, this should never happen\n"
-              << std::endl;
-    return Vector3{0, 0, 0};
-}
-
-Vector3 cu_utils::MirrorMaterial::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth = 0) const
-{
-    if (depth <= 0)
-        return matte(renderer, ray, bestHit, scene, objRoot, rng, depth);
-
-    return mirror(renderer, ray, bestHit, scene, objRoot, rng, depth);
-}
-
-Vector3 cu_utils::PlasticMaterial::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth = 0) const
-{
-    return plastic(renderer, ray, bestHit, scene, objRoot, rng, depth);
+    next = reflectRay;
+    weight = Vector3{1, 1, 1};
+    emitted = Vector3{0, 0, 0};
+    return true;
 }
 
 // Constructors
@@ -74,7 +75,6 @@ cu_utils::Material::Material()
     this->flatColor = Vector3{1, 1, 1};
     this->scene = nullptr;
     this->eta = 0;
-    this->texMeta = nullptr;
 }
 
 cu_utils::MirrorMaterial::MirrorMaterial() : Material(){};
@@ -86,7 +86,7 @@ void PlasticMaterial::finish()
     this->backingLambert.flatColor = this->flatColor;
     this->backingLambert.scene = this->scene;
     this->backingLambert.eta = this->eta;
-    this->backingLambert.texMeta = this->texMeta;
+    this->backingLambert.colorTex = this->colorTex;
 }
 
 bool PlasticMaterial::scatter(const Ray &ray, const RayHit &hit, Vector3 &alb, Ray &scattered, Real &pdf, pcg32_state &rng) const {
@@ -95,7 +95,7 @@ bool PlasticMaterial::scatter(const Ray &ray, const RayHit &hit, Vector3 &alb, R
     auto direction = uvw.local(random_cosine_direction(rng));
 
     scattered = Ray(ray * hit.t, normalize(direction));
-    alb = getTexColor(hit.u, hit.v);
+    alb = getTexColor(hit);
     pdf = scattering_pdf(ray, hit, scattered);
     return true;
 }
@@ -4,6 +4,7 @@
 #include "ray.h"
 #include "bounding_box.h"
 #include "pcg.h"
+#include "texture.h"
 
 namespace cu_utils
 {
@@ -19,9 +20,9 @@ namespace cu_utils
         Real eta;
 
         // Can have a backing image texture.
-        ParsedImageTexture *texMeta;
-        ParsedImageTexture *normalMeta;
-        ParsedImageTexture *emissiveMeta = nullptr;
+        TextureRef colorTex;
+        TextureRef normalTex;
+        TextureRef emissiveTex;
 
         Material();
 
@@ -29,9 +30,19 @@ namespace cu_utils
         Vector3 getNormalOffset(Real u, Real v) const;
         Vector3 getEmission(Real u, Real v) const;
 
+        // Filtered lookups using the hit's uv footprint
+        Vector3 getTexColor(const RayHit &hit) const;
+        Vector3 getEmission(const RayHit &hit) const;
+
         void loadTexture(ParsedImageTexture *texMeta);
 
-        virtual Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const;
+        // Recursive shading, traces the bounce from sampleBounce through the renderer
+        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const;
+
+        // Non-recursive form of shadePoint, used by the wavefront integrator.
+        // Writes the light emitted at the hit and, if the path continues, the throughput weight and ray of the next bounce.
+        // Returns false if the path ends here.
+        virtual bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const;
 
         // Guessing that if albedo is 0, just don't scatter at all
         // Scatter handles the actual generation of sampling rays
@@ -51,7 +62,7 @@ namespace cu_utils
     struct LambertMaterial : public Material
     {
         LambertMaterial();
-        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const override;
+        bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const override;
 
         bool scatter(const Ray &ray, const RayHit &hit, Vector3 &albedo, Ray &scattered, Real &pdf, pcg32_state &rng) const;
         Real scattering_pdf(const Ray &ray, const RayHit &hit, const Ray &scattered) const;
@@ -62,7 +73,7 @@ namespace cu_utils
     struct MirrorMaterial : public Material
     {
         MirrorMaterial();
-        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const override;
+        bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const override;
     };
 
     struct PlasticMaterial : public Material
@@ -71,7 +82,7 @@ namespace cu_utils
         LambertMaterial backingLambert;
 
         PlasticMaterial();
-        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const override;
+        bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const override;
         void finish() override;
 
         bool scatter(const Ray &ray, const RayHit &hit, Vector3 &albedo, Ray &scattered, Real &pdf, pcg32_state &rng) const;
@@ -84,7 +95,7 @@ namespace cu_utils
         Real exp = 1;
 
         PhongMaterial();
-        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const override;
+        bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const override;
 
         bool scatter(const Ray &ray, const RayHit &hit, Vector3 &albedo, Ray &scattered, Real &pdf, pcg32_state &rng) const;
         Real scattering_pdf(const Ray &ray, const RayHit &hit, const Ray &scattered) const;
@@ -95,7 +106,7 @@ namespace cu_utils
         Real exp = 1;
 
         BlinnPhongMaterial();
-        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const override;
+        bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const override;
 
         bool scatter(const Ray &ray, const RayHit &hit, Vector3 &albedo, Ray &scattered, Real &pdf, pcg32_state &rng) const;
         Real scattering_pdf(const Ray &ray, const RayHit &hit, const Ray &scattered) const;
@@ -106,15 +117,14 @@ namespace cu_utils
         Real exp = 1;
 
         MicrofacetMaterial();
-        Vector3 shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const override;
+        bool sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const override;
 
         bool scatter(const Ray &ray, const RayHit &hit, Vector3 &albedo, Ray &scattered, Real &pdf, pcg32_state &rng) const;
         Real scattering_pdf(const Ray &ray, const RayHit &hit, const Ray &scattered) const;
     };
 
     Vector3 matte(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth);
-    Vector3 mirror(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth);
-    Vector3 plastic(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth);
+    bool matteBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next);
     // Vector3 phong(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth);
 
 }
@@ -0,0 +1,163 @@
+#include "memory_report.h"
+#include "bounding_box.h"
+#include "materials.h"
+#include "scene.h"
+#include "shapes.h"
+
+#include <fstream>
+#include <iomanip>
+#include <string>
+
+#ifndef _WINDOWS
+#include <sys/resource.h>
+#endif
+
+using namespace cu_utils;
+
+template <typename T>
+static size_t vectorBytes(const std::vector<T> &v)
+{
+    return v.capacity() * sizeof(T);
+}
+
+// The scene only keeps base pointers, so the real size depends on the type behind them
+static size_t shapeBytes(const Shape *shape)
+{
+    if (dynamic_cast<const Triangle *>(shape))
+        return sizeof(Triangle);
+    if (dynamic_cast<const Sphere *>(shape))
+        return sizeof(Sphere);
+    return sizeof(Shape);
+}
+
+static size_t materialBytes(const Material *material)
+{
+    if (dynamic_cast<const LambertMaterial *>(material))
+        return sizeof(LambertMaterial);
+    if (dynamic_cast<const MirrorMaterial *>(material))
+        return sizeof(MirrorMaterial);
+    if (dynamic_cast<const PlasticMaterial *>(material))
+        return sizeof(PlasticMaterial);
+    if (dynamic_cast<const PhongMaterial *>(material))
+        return sizeof(PhongMaterial);
+    if (dynamic_cast<const MicrofacetMaterial *>(material))
+        return sizeof(MicrofacetMaterial);
+    if (dynamic_cast<const BlinnPhongMaterial *>(material))
+        return sizeof(BlinnPhongMaterial);
+    return sizeof(Material);
+}
+
+size_t MemoryReport::total() const
+{
+    size_t sum = 0;
+    for (size_t b : bytes)
+        sum += b;
+    return sum;
+}
+
+void MemoryReport::addParsedScene(const ParsedScene &parsed)
+{
+    size_t &meshBytes = bytes[(int)MemCategory::MeshBuffers];
+    meshBytes += vectorBytes(parsed.shapes);
+    for (const ParsedShape &shape : parsed.shapes)
+    {
+        if (const ParsedTriangleMesh *mesh = std::get_if<ParsedTriangleMesh>(&shape))
+            meshBytes += vectorBytes(mesh->positions) + vectorBytes(mesh->indices) + vectorBytes(mesh->normals) + vectorBytes(mesh->uvs);
+    }
+}
+
+void MemoryReport::addScene(const Scene &scene)
+{
+    size_t &shapes = bytes[(int)MemCategory::Shapes];
+    shapes += vectorBytes(scene.shapes);
+    for (const Shape *shape : scene.shapes)
+        shapes += shapeBytes(shape);
+    for (const AreaLight *light : scene.areaLights)
+        shapes += sizeof(AreaLight) + vectorBytes(light->shapes);
+    numPrimitives += scene.shapes.size();
+
+    size_t &materials = bytes[(int)MemCategory::Materials];
+    materials += vectorBytes(scene.materials);
+    for (const Material *material : scene.materials)
+        materials += materialBytes(material);
+
+    size_t &textures = bytes[(int)MemCategory::Textures];
+    textures += vectorBytes(scene.textures) + vectorBytes(scene.skybox.data);
+    for (const MipMap &texture : scene.textures)
+        textures += texture.memoryBytes();
+    if (scene.textureCache)
+    {
+        TextureCacheStats stats = scene.textureCache->stats();
+        textures += stats.residentBytes + stats.heldBytes;
+    }
+}
+
+void MemoryReport::addBVH(const BVHNode &root)
+{
+    bytes[(int)MemCategory::BVHNodes] += sizeof(BVHNode) + root.memoryBytes();
+}
+
+void MemoryReport::addFramebuffer(const Image3 &img)
+{
+    bytes[(int)MemCategory::Framebuffers] += vectorBytes(img.data);
+}
+
+void MemoryReport::addPathState(size_t pathBytes)
+{
+    bytes[(int)MemCategory::PathState] += pathBytes;
+}
+
+void MemoryReport::print(std::ostream &os) const
+{
+    const char *names[] = {"shapes", "mesh buffers", "BVH nodes", "textures", "materials", "framebuffers", "path state"};
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+
+    os << "Memory after scene setup (" << numPrimitives << " primitives):" << std::endl;
+    os << std::fixed;
+    for (int i = 0; i < (int)MemCategory::Count; i++)
+    {
+        os << "  " << std::left << std::setw(14) << names[i] << std::right << std::setprecision(1) << std::setw(10)
+           << bytes[i] / (1024.0 * 1024.0) << " MB" << std::setw(10) << (numPrimitives ? (double)bytes[i] / numPrimitives : 0.0)
+           << " B/prim" << std::endl;
+    }
+    os << "  " << std::left << std::setw(14) << "total" << std::right << std::setw(10) << total() / (1024.0 * 1024.0) << " MB"
+       << std::setw(10) << (numPrimitives ? (double)total() / numPrimitives : 0.0) << " B/prim" << std::endl;
+    if (peakRss > 0)
+        os << "  Peak RSS " << peakRss / (1024.0 * 1024.0) << " MB" << std::endl;
+
+    os.flags(flags);
+    os.precision(precision);
+}
+
+size_t cu_utils::peakRssBytes()
+{
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.rfind("VmHWM:", 0) == 0)
+            return std::stoull(line.substr(6)) * 1024;
+    }
+#endif
+#ifndef _WINDOWS
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss; // Already bytes on macOS
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+void cu_utils::resetPeakRss()
+{
+#ifdef __linux__
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+#endif
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include "../image.h"
+#include "../parse_scene.h"
+
+namespace cu_utils
+{
+    struct Scene;
+    struct BVHNode;
+
+    enum class MemCategory
+    {
+        Shapes,
+        MeshBuffers,  // The parsed meshes, still alive while rendering
+        BVHNodes,
+        Textures,     // Mip pyramids, resident cache tiles and the skybox
+        Materials,
+        Framebuffers,
+        PathState,    // Wavefront path queues, the other integrators only keep per-thread stack state
+        Count
+    };
+
+    /**
+     * Where the memory of a render goes, by walking the structures that own it (ParsedScene, Scene,
+     * the BVH, the image). Counts what the containers hold (capacity, not size), not allocator overhead,
+     * so peak RSS is printed next to it for the part nothing here accounts for.
+     */
+    struct MemoryReport
+    {
+        size_t bytes[(int)MemCategory::Count] = {};
+        size_t numPrimitives = 0;
+        size_t peakRss = 0;
+
+        size_t operator[](MemCategory category) const { return bytes[(int)category]; }
+        size_t total() const;
+
+        void addParsedScene(const ParsedScene &parsed);
+        void addScene(const Scene &scene);
+        void addBVH(const BVHNode &root);
+        void addFramebuffer(const Image3 &img);
+        void addPathState(size_t pathBytes);
+
+        void print(std::ostream &os) const;
+    };
+
+    // Process wide high water mark of resident memory, 0 where the OS won't say
+    size_t peakRssBytes();
+
+    // Starts the high water mark over from the current RSS (Linux only, a no-op elsewhere)
+    void resetPeakRss();
+}
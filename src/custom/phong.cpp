@@ -11,26 +11,27 @@ using namespace cu_utils;
 
 cu_utils::PhongMaterial::PhongMaterial() : Material(){};
 
-Vector3 cu_utils::PhongMaterial::shadePoint(const Renderer *renderer, const Ray ray, const RayHit bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
+bool cu_utils::PhongMaterial::sampleBounce(const Ray &ray, const RayHit &bestHit, const Scene &scene, pcg32_state &rng, int depth, Vector3 &emitted, Vector3 &weight, Ray &next) const
 {
     // JANK incoming: do pdf mixing here
     // Will require scattering pdf to be implemented to generate the probability of a scattered ray to be from the BRDF pdf.
     // Also needs area light sampling functionality
     // And scattering pdf for area lights
 
-    Vector3 color = Vector3{0, 0, 0};
     Vector3 hit = ray * bestHit.t;
 
     // Perform diffuse interreflection now
     if (depth <= 0)
-        return Vector3{0, 0, 0};
+    {
+        emitted = Vector3{0, 0, 0};
+        return false;
+    }
     
     // Copied from Peter Shirley's Ray Tracing in One Weekend
     Ray scattered;
-    Vector3 attenuation;
-    Vector3 emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
     Real pdf;
     Vector3 albedo;
+    emitted = bestHit.sphere->areaLight ? bestHit.sphere->areaLight->intensity : Vector3{0, 0, 0};
 
     // Make sure we hit on the right side, otherwise emitted light is 0
     if (bestHit.backface)
@@ -52,7 +53,7 @@ Vector3 cu_utils::PhongMaterial::shadePoint(const Renderer *renderer, const Ray
     Real scatterOrLight = next_pcg32_real<Real>(rng);
     if (scatterOrLight <= 0.5 || numAreaLights == 0) {
         if (!scatter(ray, bestHit, albedo, scattered, pdf, rng))
-            return emitted;
+            return false;
     } else {
         // Sample the shape
         Real jacobian;
@@ -60,7 +61,7 @@ Vector3 cu_utils::PhongMaterial::shadePoint(const Renderer *renderer, const Ray
         Vector3 scatterDir = normalize(emissionRay.origin - hit);
 
         scattered = Ray(hit, scatterDir);
-        albedo = getTexColor(bestHit.u, bestHit.v);
+        albedo = getTexColor(bestHit);
     }
 
     // What is pdf? It is the joint probability of both the sampler and the emitter! :D
@@ -70,13 +71,13 @@ Vector3 cu_utils::PhongMaterial::shadePoint(const Renderer *renderer, const Ray
         pdf = scattering_pdf(ray, bestHit, scattered);
 
     if (dot(scattered.dir, bestHit.normal) < 0)
-        return emitted;
+        return false;
 
     // Move scatter forwards a bit to avoid self-intersection
     scattered.origin += scattered.dir * 0.0001;
-    return emitted
-         + albedo * scattering_pdf(ray, bestHit, scattered)
-                  * renderer->getPixelColor(scattered, scene, objRoot, rng, depth - 1) / pdf;
+    next = scattered;
+    weight = albedo * scattering_pdf(ray, bestHit, scattered) / pdf;
+    return true;
 }
 
 
@@ -99,7 +100,7 @@ bool PhongMaterial::scatter(const Ray &ray, const RayHit &hit, Vector3 &alb, Ray
 
     Vector3 direction = uvw.local(Vector3{x, y, z});
     scattered = Ray(ray * hit.t, direction);
-    alb = getTexColor(hit.u, hit.v);
+    alb = getTexColor(hit);
 
     pdf = scattering_pdf(ray, hit, scattered);
     return true;
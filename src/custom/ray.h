@@ -18,6 +18,11 @@ namespace cu_utils
         Vector3 origin;
         Vector3 dir; // dir should be normalized
 
+        // Directions of the rays through the neighbouring pixel in x and y, for texture filtering.
+        // Only camera rays have these, and those all share the same origin so only the directions are kept.
+        bool hasDifferentials = false;
+        Vector3 rxDir, ryDir;
+
         // At operation
         Vector3 operator*(Real t) const;
     };
@@ -43,5 +48,9 @@ namespace cu_utils
         Real v;
 
         bool backface;
+
+        // How uv changes per pixel in screen x and y. All zero if the ray had no differentials.
+        Real dudx = 0, dvdx = 0;
+        Real dudy = 0, dvdy = 0;
     };
 }
\ No newline at end of file
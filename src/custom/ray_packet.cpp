@@ -0,0 +1,133 @@
+#include "ray_packet.h"
+#include "bounding_box.h"
+#include <algorithm>
+
+using namespace cu_utils;
+
+void RayPacket::add(const Ray &ray, Real maxt)
+{
+    rays[size] = ray;
+    for (int a = 0; a < 3; a++)
+    {
+        origins[a][size] = ray.origin[a];
+        invDirs[a][size] = 1.0 / ray.dir[a];
+    }
+    tmax[size] = maxt;
+    hits[size] = RayHit();
+    size++;
+}
+
+void RayPacket::finalize()
+{
+    coherent = size > 0;
+    if (!coherent)
+        return;
+
+    originMin = originMax = rays[0].origin;
+    for (int a = 0; a < 3; a++)
+        invDirMin[a] = invDirMax[a] = invDirs[a][0];
+
+    for (int i = 0; i < size; i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            originMin[a] = std::min(originMin[a], origins[a][i]);
+            originMax[a] = std::max(originMax[a], origins[a][i]);
+            invDirMin[a] = std::min(invDirMin[a], invDirs[a][i]);
+            invDirMax[a] = std::max(invDirMax[a], invDirs[a][i]);
+
+            // Axis-parallel rays give infinite slabs, just leave those to the per-ray test
+            if (rays[i].dir[a] == 0)
+                coherent = false;
+        }
+    }
+
+    // Mixed direction signs means the near and far planes differ between rays
+    for (int a = 0; a < 3; a++)
+    {
+        if (invDirMin[a] < 0 && invDirMax[a] > 0)
+            coherent = false;
+    }
+}
+
+// Range of (plane - origin) * invDir over the whole packet
+static void slabInterval(Real plane, Real oMin, Real oMax, Real iMin, Real iMax, Real &lo, Real &hi)
+{
+    Real d0 = plane - oMax;
+    Real d1 = plane - oMin;
+    Real p[4] = {d0 * iMin, d0 * iMax, d1 * iMin, d1 * iMax};
+
+    lo = std::min(std::min(p[0], p[1]), std::min(p[2], p[3]));
+    hi = std::max(std::max(p[0], p[1]), std::max(p[2], p[3]));
+}
+
+bool RayPacket::missesBox(const BoundingBox &box) const
+{
+    if (!coherent)
+        return false;
+
+    // Earliest any ray could enter and latest any ray could leave
+    Real entry = 0;
+    Real exit = std::numeric_limits<Real>::max();
+
+    for (int a = 0; a < 3; a++)
+    {
+        bool positive = invDirMin[a] > 0;
+        Real nearPlane = positive ? box.minc[a] : box.maxc[a];
+        Real farPlane = positive ? box.maxc[a] : box.minc[a];
+
+        Real lo, hi;
+        slabInterval(nearPlane, originMin[a], originMax[a], invDirMin[a], invDirMax[a], lo, hi);
+        entry = std::max(entry, lo);
+
+        slabInterval(farPlane, originMin[a], originMax[a], invDirMin[a], invDirMax[a], lo, hi);
+        exit = std::min(exit, hi);
+
+        if (exit < entry)
+            return true;
+    }
+
+    return false;
+}
+
+uint32_t RayPacket::boxMask(const BoundingBox &box) const
+{
+    // Same steps as BoundingBox::checkHit, but branch free and across the lanes, so the inner loops vectorize
+    Real lo[PACKET_SIZE], hi[PACKET_SIZE];
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        lo[i] = 0;
+        hi[i] = tmax[i];
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        Real minPlane = box.minc[a];
+        Real maxPlane = box.maxc[a];
+        for (int i = 0; i < PACKET_SIZE; i++)
+        {
+            Real t0 = (minPlane - origins[a][i]) * invDirs[a][i];
+            Real t1 = (maxPlane - origins[a][i]) * invDirs[a][i];
+            Real tNear = invDirs[a][i] < 0 ? t1 : t0;
+            Real tFar = invDirs[a][i] < 0 ? t0 : t1;
+            lo[i] = tNear > lo[i] ? tNear : lo[i];
+            hi[i] = tFar < hi[i] ? tFar : hi[i];
+        }
+    }
+
+    uint32_t mask = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+        mask |= (uint32_t)!(hi[i] < lo[i]) << i;
+    return mask & laneMask();
+}
+
+void RayPacket::recordHit(int i, const RayHit &hit)
+{
+    if (!hit.hit || hit.t >= tmax[i])
+        return;
+
+    hits[i] = hit;
+    tmax[i] = hit.t;
+    if (anyHit)
+        retiredLanes |= 1u << i;
+}
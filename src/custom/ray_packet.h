@@ -0,0 +1,67 @@
+/**
+ * @file ray_packet.h
+ * Small bundles of coherent rays (a 4x4 pixel block of primary rays, or shadow rays towards one light)
+ * that get pushed through the BVH together by BVHNode::checkHitPacket.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include "ray.h"
+
+namespace cu_utils
+{
+    struct BoundingBox;
+
+    // Packets cover PACKET_WIDTH x PACKET_WIDTH pixels
+    constexpr int PACKET_WIDTH = 4;
+    constexpr int PACKET_SIZE = PACKET_WIDTH * PACKET_WIDTH;
+    static_assert(PACKET_SIZE <= 32, "Lane masks are 32 bit");
+
+    // Once this few rays of a packet still hit a node, the rest of the subtree is traced one ray at a time
+    constexpr int PACKET_FALLBACK_RAYS = 2;
+
+    struct RayPacket
+    {
+        int size = 0;
+
+        // Shadow ray packets only care whether something is hit, so rays retire on their first hit
+        bool anyHit = false;
+
+        Ray rays[PACKET_SIZE];
+        Real tmax[PACKET_SIZE] = {};
+        RayHit hits[PACKET_SIZE];
+
+        // The rays again, one array per axis so the box test runs down all lanes at once.
+        // Lanes past size stay zeroed, they get masked off anyway.
+        Real origins[3][PACKET_SIZE] = {};
+        Real invDirs[3][PACKET_SIZE] = {};
+
+        // Bit i set once ray i is done and doesn't need to be traversed any further
+        uint32_t retiredLanes = 0;
+
+        // Bounds over the whole packet, used to cull boxes with interval arithmetic.
+        // Only valid if every ray agrees on the sign of each direction component.
+        bool coherent = false;
+        Vector3 originMin, originMax;
+        Vector3 invDirMin, invDirMax;
+
+        void add(const Ray &ray, Real maxt = std::numeric_limits<Real>::max());
+
+        // Computes the packet bounds. Call once all rays are added.
+        void finalize();
+
+        // Conservative test, true only if every ray of the packet misses the box
+        bool missesBox(const BoundingBox &box) const;
+
+        // Slab test of every lane against the box, bit i set if ray i hits it within [0, tmax[i]]
+        uint32_t boxMask(const BoundingBox &box) const;
+
+        // Keeps hit for ray i if it's closer than what the ray has so far
+        void recordHit(int i, const RayHit &hit);
+
+        bool retired(int i) const { return (retiredLanes >> i) & 1; }
+        uint32_t laneMask() const { return (uint32_t)((1ull << size) - 1); }
+    };
+}
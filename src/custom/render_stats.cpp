@@ -0,0 +1,71 @@
+#include "render_stats.h"
+
+#include <iomanip>
+
+using namespace cu_utils;
+
+RenderStats::Slot RenderStats::slots[RenderStats::SLOTS];
+
+RenderStats RenderStats::merge()
+{
+    RenderStats total;
+    for (const Slot &s : slots)
+    {
+        for (int i = 0; i < (int)Stat::Count; i++)
+            total.counters[i] += s.counters[i].load(std::memory_order_relaxed);
+        for (int i = 0; i <= STATS_MAX_PATH_LENGTH; i++)
+            total.pathLengths[i] += s.pathLengths[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void RenderStats::reset()
+{
+    for (Slot &s : slots)
+    {
+        for (auto &counter : s.counters)
+            counter.store(0, std::memory_order_relaxed);
+        for (auto &counter : s.pathLengths)
+            counter.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Avoids dividing by zero when a counter never got touched
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b == 0 ? 0 : (double)a / (double)b;
+}
+
+void RenderStats::print(std::ostream &os) const
+{
+    const RenderStats &s = *this;
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    uint64_t rays = s[Stat::CameraRays] + s[Stat::BounceRays] + s[Stat::ShadowRays];
+
+    os << "Render stats:" << std::endl;
+    os << "  Rays: " << rays << " (" << s[Stat::CameraRays] << " camera, " << s[Stat::BounceRays] << " bounce, "
+       << s[Stat::ShadowRays] << " shadow)" << std::endl;
+    os << "  BVH nodes visited: " << s[Stat::NodesVisited] << " (" << std::fixed << std::setprecision(1)
+       << ratio(s[Stat::NodesVisited], rays) << " per ray), boxes hit: " << s[Stat::BoxesHit] << " ("
+       << 100 * ratio(s[Stat::BoxesHit], s[Stat::NodesVisited]) << "%)" << std::endl;
+    os << "  Primitives tested: " << s[Stat::PrimitivesTested] << " (" << ratio(s[Stat::PrimitivesTested], rays) << " per ray)" << std::endl;
+    os << "  Shading calls: " << s[Stat::ShadingCalls] << std::endl;
+
+    uint64_t paths = 0, segments = 0;
+    for (int i = 0; i <= STATS_MAX_PATH_LENGTH; i++)
+    {
+        paths += s.pathLengths[i];
+        segments += i * s.pathLengths[i];
+    }
+    os << "  Paths: " << paths << ", mean length " << ratio(segments, paths) << std::endl;
+    for (int i = 0; i <= STATS_MAX_PATH_LENGTH; i++)
+    {
+        if (s.pathLengths[i] == 0)
+            continue;
+        os << "    " << (i == STATS_MAX_PATH_LENGTH ? ">=" : "") << i << ": " << s.pathLengths[i] << " ("
+           << 100 * ratio(s.pathLengths[i], paths) << "%)" << std::endl;
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include "../parallel.h"
+
+/**
+ * Counters for how much traversal and shading work a render does. They're only compiled in when
+ * building with -DTORREY_STATS=ON, otherwise the STAT_ macros expand to nothing.
+ * Every thread bumps its own padded slot and the slots get summed once the render is done.
+ */
+namespace cu_utils
+{
+    enum class Stat
+    {
+        NodesVisited,
+        BoxesHit,
+        PrimitivesTested,
+        CameraRays,
+        BounceRays,
+        ShadowRays,
+        ShadingCalls,
+        Count
+    };
+
+    // Paths longer than this all land in the last bucket
+    constexpr int STATS_MAX_PATH_LENGTH = 16;
+
+    struct RenderStats
+    {
+        uint64_t counters[(int)Stat::Count] = {};
+        uint64_t pathLengths[STATS_MAX_PATH_LENGTH + 1] = {}; // Indexed by rays traced along the path
+
+        uint64_t operator[](Stat stat) const { return counters[(int)stat]; }
+
+        // Adds up every thread's slot. Only meaningful when nothing is rendering.
+        static RenderStats merge();
+        static void reset();
+
+        static void add(Stat stat, uint64_t count)
+        {
+            bump(slot().counters[(int)stat], count);
+        }
+
+        static void addPathLength(int length)
+        {
+            bump(slot().pathLengths[std::min(std::max(length, 0), STATS_MAX_PATH_LENGTH)], 1);
+        }
+
+        void print(std::ostream &os) const;
+
+    private:
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t> counters[(int)Stat::Count];
+            std::atomic<uint64_t> pathLengths[STATS_MAX_PATH_LENGTH + 1];
+        };
+
+        static constexpr int SLOTS = 64;
+        static Slot slots[SLOTS];
+
+        static Slot &slot() { return slots[ThreadIndex % SLOTS]; }
+
+        // Each thread owns its slot, so a plain load and store is enough (no locked add).
+        // Past 64 threads two can share a slot and lose the odd count, fine for stats.
+        static void bump(std::atomic<uint64_t> &counter, uint64_t count)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+        }
+    };
+}
+
+#ifdef TORREY_STATS
+#define STAT_ADD(stat, count) cu_utils::RenderStats::add(cu_utils::Stat::stat, count)
+#define STAT_PATH_LENGTH(length) cu_utils::RenderStats::addPathLength(length)
+#else
+#define STAT_ADD(stat, count) \
+    do                        \
+    {                         \
+    } while (0)
+#define STAT_PATH_LENGTH(length) \
+    do                           \
+    {                            \
+    } while (0)
+#endif
+
+#define STAT_INC(stat) STAT_ADD(stat, 1)
@@ -10,15 +10,27 @@
 #include "camera.h"
 #include "ray.h"
 #include "bounding_box.h"
+#include "ray_packet.h"
+#include "bvh_cache.h"
+#include "memory_report.h"
+#include "render_stats.h"
 
 #include "pcg.h"
 #include <iostream>
 #include <vector>
 #include "scene.h"
+#include "wavefront.h"
 
 #include "../parallel.h"
 #include "../parse_scene.h"
+#include "../perf_counters.h"
 #include "../progressreporter.h"
+#include "../timer.h"
+#include "../trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
 
 namespace cu_utils
 {
@@ -31,6 +43,7 @@ namespace cu_utils
         MATTE_REFLECT, // Handles matte and reflective materials
         BARYCENTRIC,   // Renders triangles as barycentric and everything else as flat
         AABB,
+        HEATMAP,       // Colors pixels by how much BVH work their camera ray took, log scale
     };
 
     /**
@@ -45,6 +58,27 @@ namespace cu_utils
         int maxDepth = 1;
         Vector3 bgCol = Vector3(0.5, 0.5, 0.5);
 
+        // Trace paths breadth-first through the WavefrontIntegrator. Only MATTE_REFLECT supports this.
+        bool wavefront = false;
+
+        // Wavefront only: sort bounce rays by origin/direction before tracing them
+        bool sortRays = false;
+
+        // Trace primary rays in PACKET_WIDTH x PACKET_WIDTH packets instead of one at a time
+        bool packets = false;
+
+        // Built hierarchies get saved here and reloaded when the geometry matches. Empty builds every time.
+        std::filesystem::path bvhCacheDir;
+
+        // How long the last render(img, scene, root) took, not counting scene loading
+        Real renderSeconds = 0;
+
+        // Traversal and shading totals from the last render. All zero unless built with TORREY_STATS.
+        RenderStats stats;
+
+        // Print how much memory each part of the scene takes once it's set up
+        bool memReport = false;
+
         Renderer(Mode mode) : mode(mode)
         {
         }
@@ -59,19 +93,119 @@ namespace cu_utils
             std::cout << "bgCol overriden to " << bgCol << std::endl;
 
             Image3 img(parsed.camera.width, parsed.camera.height);
-            Scene scene(parsed);
+            Timer timer;
+            tick(timer);
+            Scene scene(parsed, true);
+            std::cout << "Built scene in " << tick(timer) << " seconds." << std::endl;
+
+            // The hierarchy only needs the shapes, so build it on the side while the pool decodes textures.
+            // A future instead of a bare thread: if a texture fails to load, unwinding waits for the build
+            // rather than terminating, and get() passes on anything the build itself throws.
+            Real bvhSeconds = 0;
+            std::future<BVHNode> bvhBuild = std::async(std::launch::async, [&]()
+                                  {
+                                    // Started after perf_enable, so it needs counters of its own
+                                    perf_attach_thread();
+                                    Timer bvhTimer;
+                                    tick(bvhTimer);
+                                    BVHNode built = buildHierarchy(scene);
+                                    bvhSeconds = tick(bvhTimer);
+                                    return built; });
+
+            scene.loadTextures();
 
             // Retrieve skybox
             // Just hardcode it, I don't care anymore
             scene.skybox = imread3("../custom_scenes/steel-groupers/textures/skybox.png");
             std::cout << "Loaded skybox" << std::endl;
 
-            render(img, scene, seed);
+            BVHNode root = bvhBuild.get();
+            std::cout << "Built object hierarchy in " << bvhSeconds << " seconds, " << tick(timer) << " seconds until first pixel." << std::endl;
+
+            if (memReport)
+                printMemoryReport(parsed, scene, root, img);
+
+            render(img, scene, root, seed);
+
+            if (scene.textureCache)
+                scene.textureCache->printStats(std::cout);
+#ifdef TORREY_STATS
+            stats.print(std::cout);
+#endif
 
             return img;
         }
 
+        void printMemoryReport(const ParsedScene &parsed, const Scene &scene, const BVHNode &root, const Image3 &img) const
+        {
+            MemoryReport report;
+            report.addParsedScene(parsed);
+            report.addScene(scene);
+            report.addBVH(root);
+            report.addFramebuffer(img);
+            if (wavefront && mode == Mode::MATTE_REFLECT)
+            {
+                WavefrontIntegrator integrator(*this);
+                integrator.sortRays = sortRays;
+                report.addPathState(integrator.pathStateBytes(img.width * img.height));
+            }
+            report.peakRss = peakRssBytes();
+            report.print(std::cout);
+        }
+
         void render(Image3 &img, const Scene &scene, int seed = 0)
+        {
+            // Build object hierarchy
+            BVHNode root = buildHierarchy(scene);
+            std::cout << "Built object hierarchy" << std::endl;
+
+            render(img, scene, root, seed);
+        }
+
+        BVHNode buildHierarchy(const Scene &scene) const
+        {
+            TraceScope trace("bvh build");
+            PerfScope perf("bvh build");
+            if (bvhCacheDir.empty())
+                return BVHNode::buildTree(scene.shapes);
+
+            return loadOrBuildBVH(scene.shapes, bvhCacheDir);
+        }
+
+        void render(Image3 &img, const Scene &scene, const BVHNode &root, int seed = 0)
+        {
+            TraceScope trace("render");
+            PerfScope perf("render");
+            Timer timer;
+            tick(timer);
+            resetRayCount();
+            RenderStats::reset();
+            renderImage(img, scene, root, seed);
+            renderSeconds = tick(timer);
+            stats = RenderStats::merge();
+        }
+
+        // Rays traced since the last render started, camera and bounce rays alike
+        uint64_t raysTraced() const
+        {
+            uint64_t total = 0;
+            for (const RayCounter &counter : rayCounters)
+                total += counter.rays.load(std::memory_order_relaxed);
+            return total;
+        }
+
+        void resetRayCount()
+        {
+            for (RayCounter &counter : rayCounters)
+                counter.rays.store(0, std::memory_order_relaxed);
+        }
+
+        void countRays(uint64_t count) const
+        {
+            rayCounters[ThreadIndex % RAY_COUNTER_SLOTS].rays.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        void renderImage(Image3 &img, const Scene &scene, const BVHNode &root, int seed)
         {
             // Build better camera with scene data
             Camera cam = CameraBuilder(img.width, img.height)
@@ -81,18 +215,29 @@ namespace cu_utils
                              .setFov(scene.camera.vfov)
                              .build();
 
-            // Build object hierarchy
-            BVHNode root = BVHNode::buildTree(scene.shapes);
-            std::cout << "Built object hierarchy" << std::endl;
+            if (mode == Mode::HEATMAP)
+            {
+                renderHeatmap(img, cam, root);
+                return;
+            }
+
+            if (wavefront && mode == Mode::MATTE_REFLECT)
+            {
+                WavefrontIntegrator integrator(*this);
+                integrator.sortRays = sortRays;
+                integrator.render(img, scene, root, seed);
+                return;
+            }
 
             constexpr int tile_size = 16;
             int num_tiles_x = (img.width + tile_size - 1) / tile_size;
             int num_tiles_y = (img.height + tile_size - 1) / tile_size;
 
-            ProgressReporter reporter(num_tiles_x * num_tiles_y);
+            ProgressReporter reporter(num_tiles_x * num_tiles_y, [this]() { return raysTraced(); });
 
             parallel_for([&](const Vector2i &tile)
                          {
+                            TraceScope trace("tile", "render", tile[0], tile[1]);
                             int seed = tile[1] * num_tiles_x + tile[0];
 
                             // Clamping
@@ -105,6 +250,12 @@ namespace cu_utils
                             pcg32_state rng = init_pcg32(1, seed);
 
                             // Render step
+                            if (packets && mode != Mode::AABB) {
+                                renderTilePackets(img, scene, cam, root, x0, x1, y0, y1, rng);
+                                reporter.update(1, (x1 - x0) * (y1 - y0) * spp);
+                                return;
+                            }
+
                             for (int y = y0; y < y1; y++) {
                             for (int x = x0; x < x1; x++) {
                                 
@@ -112,13 +263,64 @@ namespace cu_utils
                             }
                             } 
                             
-                            reporter.update(1); },
+                            reporter.update(1, (x1 - x0) * (y1 - y0) * spp); },
                          Vector2i(num_tiles_x, num_tiles_y));
 
             reporter.done();
         }
 
-        Vector3 renderPixel(Image3 &img, const Scene &scene, BVHNode &objRoot, int x, int y, pcg32_state &rng)
+        // One ray through each pixel center, spp doesn't matter here
+        void renderHeatmap(Image3 &img, const Camera &cam, const BVHNode &root) const
+        {
+            std::vector<TraversalCost> costs(img.width * img.height);
+            parallel_for([&](int64_t y)
+                         {
+                            for (int x = 0; x < img.width; x++) {
+                                Ray ray = cam.ScToWRayDifferential(x + 0.5, y + 0.5);
+                                root.checkHitCost(ray, 0, std::numeric_limits<Real>::max(), costs[y * img.width + x]);
+                            } },
+                         img.height);
+            countRays(costs.size());
+
+            int worst = 0;
+            uint64_t totalNodes = 0, totalPrimitives = 0;
+            for (int i = 0; i < (int)costs.size(); i++)
+            {
+                totalNodes += costs[i].nodesVisited;
+                totalPrimitives += costs[i].primitivesTested;
+                if (heatmapCost(costs[i]) > heatmapCost(costs[worst]))
+                    worst = i;
+            }
+
+            // Log scale, otherwise a handful of terrible pixels wash the rest of the image out
+            Real logMax = std::log(1 + (Real)std::max(heatmapCost(costs[worst]), 1));
+            for (int i = 0; i < (int)costs.size(); i++)
+                img.data[i] = heatmapColor(std::log(1 + (Real)heatmapCost(costs[i])) / logMax);
+
+            std::cout << "Heatmap, nodes visited + primitives tested per camera ray:" << std::endl;
+            const char *names[] = {"blue", "cyan", "green", "yellow", "red"};
+            for (int k = 0; k < 5; k++)
+                std::cout << "  " << names[k] << ": " << (int)std::round(std::exp(logMax * k / 4) - 1) << std::endl;
+            std::cout << "  Mean " << (Real)totalNodes / costs.size() << " nodes, " << (Real)totalPrimitives / costs.size()
+                      << " primitives. Worst pixel (" << worst % img.width << ", " << worst / img.width << ") with "
+                      << costs[worst].nodesVisited << " nodes, " << costs[worst].primitivesTested << " primitives" << std::endl;
+        }
+
+        static int heatmapCost(const TraversalCost &cost)
+        {
+            return cost.nodesVisited + cost.primitivesTested;
+        }
+
+        // Blue -> cyan -> green -> yellow -> red over [0, 1]
+        static Vector3 heatmapColor(Real t)
+        {
+            const Vector3 ramp[] = {Vector3{0, 0, 1}, Vector3{0, 1, 1}, Vector3{0, 1, 0}, Vector3{1, 1, 0}, Vector3{1, 0, 0}};
+            Real x = std::clamp(t, (Real)0, (Real)1) * 4;
+            int k = std::min((int)x, 3);
+            return ramp[k] + (ramp[k + 1] - ramp[k]) * (x - k);
+        }
+
+        Vector3 renderPixel(Image3 &img, const Scene &scene, const BVHNode &objRoot, int x, int y, pcg32_state &rng)
         {
             // Build better camera with scene data
             Camera cam = CameraBuilder(img.width, img.height)
@@ -131,7 +333,7 @@ namespace cu_utils
             // Just shoot through the center so it's deterministic if we have 1 spp
             if (spp == 1)
             {
-                Ray ray = cam.ScToWRay(x + 0.5, y + 0.5);
+                Ray ray = cam.ScToWRayDifferential(x + 0.5, y + 0.5);
                 return getPixelColor(ray, scene, objRoot, rng, maxDepth);
             }
 
@@ -145,17 +347,79 @@ namespace cu_utils
                     // Shoot a ray through a random point in the pixel
                     Real offX = next_pcg32_real<Real>(rng);
                     Real offY = next_pcg32_real<Real>(rng);
-                    Ray ray = cam.ScToWRay(x + offX, y + offY);
+                    Ray ray = cam.ScToWRayDifferential(x + offX, y + offY, differentialScale());
                     color += getPixelColor(ray, scene, objRoot, rng, maxDepth);
                 }
                 return color / (Real)spp;
             }
         }
 
+        // With more samples per pixel each one only needs to filter over a fraction of the pixel
+        Real differentialScale() const
+        {
+            return std::max((Real)0.125, 1 / std::sqrt((Real)spp));
+        }
+
+        // Same as calling renderPixel on every pixel of the tile, but camera rays are traced as packets
+        void renderTilePackets(Image3 &img, const Scene &scene, const Camera &cam, const BVHNode &objRoot, int x0, int x1, int y0, int y1, pcg32_state &rng) const
+        {
+            for (int by = y0; by < y1; by += PACKET_WIDTH) {
+            for (int bx = x0; bx < x1; bx += PACKET_WIDTH) {
+                int bx1 = std::min(bx + PACKET_WIDTH, x1);
+                int by1 = std::min(by + PACKET_WIDTH, y1);
+
+                Vector3 colors[PACKET_SIZE];
+                for (int k = 0; k < PACKET_SIZE; k++)
+                    colors[k] = Vector3{0, 0, 0};
+
+                for (int i = 0; i < spp; i++)
+                {
+                    RayPacket packet;
+                    for (int y = by; y < by1; y++) {
+                    for (int x = bx; x < bx1; x++) {
+                        Real offX = 0.5, offY = 0.5;
+                        if (spp != 1)
+                        {
+                            offX = next_pcg32_real<Real>(rng);
+                            offY = next_pcg32_real<Real>(rng);
+                        }
+                        packet.add(cam.ScToWRayDifferential(x + offX, y + offY, differentialScale()));
+                    }
+                    }
+
+                    objRoot.checkHitPacket(packet);
+                    countRays(packet.size);
+                    STAT_ADD(CameraRays, packet.size);
+
+                    for (int k = 0; k < packet.size; k++)
+                        colors[k] += shadeHit(packet.rays[k], packet.hits[k], scene, objRoot, rng, maxDepth);
+                }
+
+                int k = 0;
+                for (int y = by; y < by1; y++) {
+                for (int x = bx; x < bx1; x++) {
+                    img(x, y) = colors[k++] / (Real)spp;
+                }
+                }
+            }
+            }
+        }
+
         Vector3 getPixelColor(const Ray &ray, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth = 0) const
         {
+            if (depth == maxDepth)
+                STAT_INC(CameraRays);
+            else
+                STAT_INC(BounceRays);
+
             auto bestHit = castRay(ray, scene.shapes, objRoot);
+            return shadeHit(ray, bestHit, scene, objRoot, rng, depth);
+        }
 
+        // Colors a ray given whatever it hit (or didn't)
+        Vector3 shadeHit(const Ray &ray, const RayHit &bestHit, const Scene &scene, const BVHNode &objRoot, pcg32_state &rng, int depth) const
+        {
+            STAT_INC(ShadingCalls);
             Vector3 color = bgCol;
 
             // Sample the skybox if we hit nothing (this is dangerous, but oh well.)
@@ -165,6 +429,7 @@ namespace cu_utils
 
                 if (depth < maxDepth) // This is a reflect ray, lets us light the fish up more :3
                     color = color + Vector3{0.2, 0.2, 0.5};
+                endPath(depth);
             }
 
             else
@@ -211,6 +476,7 @@ namespace cu_utils
                         if (bestHit.sphere->areaLight != nullptr) {
                             color = bestHit.sphere->areaLight->intensity;
                         }
+                        endPath(depth);
                         break;
                     }
 
@@ -240,7 +506,15 @@ namespace cu_utils
                     // Collision should be with a bounding box, just mark as white
                     color = Vector3{1, 1, 1};
                 }
+                break;
+                case Mode::HEATMAP:
+                    // Handled in renderHeatmap, never shades anything
+                    break;
                 }
+
+                // The other modes end the path here, matte and the materials do it themselves
+                if (mode != Mode::MATTE_REFLECT && mode != Mode::LAMBERT)
+                    endPath(depth);
             }
 
             return color;
@@ -270,15 +544,14 @@ namespace cu_utils
             }
 
             // What it's supposed to do: Check the object tree and render
-            BVHNode::boxesHit = 0;
-            BVHNode::scansMade = 0;
-            RayHit bestHit = objRoot.checkHit(ray, 0, std::numeric_limits<Real>::max());
-
-            // std::cout << "Boxes hit: " << BBNode::boxesHit << std::endl;
-            // std::cout << "Scans made: " << BBNode::scansMade << std::endl;
-            // std::cout << "Cull ratio: " << (Real)BBNode::boxesHit / (Real)BBNode::scansMade << std::endl;
+            countRays(1);
+            return objRoot.checkHit(ray, 0, std::numeric_limits<Real>::max());
+        }
 
-            return bestHit;
+        // Records a path that stopped at this depth. Depth counts down from maxDepth.
+        void endPath(int depth) const
+        {
+            STAT_PATH_LENGTH(maxDepth - depth + 1);
         }
 
         // Sample the skybox given a ray and skybox texture
@@ -332,6 +605,16 @@ namespace cu_utils
 
             return col;
         }
+
+    private:
+        // Per-thread, padded so threads don't share cache lines
+        struct alignas(64) RayCounter
+        {
+            std::atomic<uint64_t> rays{0};
+        };
+
+        static constexpr int RAY_COUNTER_SLOTS = 64;
+        mutable RayCounter rayCounters[RAY_COUNTER_SLOTS];
     };
 
     class RendererBuilder
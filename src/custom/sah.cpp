@@ -48,7 +48,7 @@ void cu_utils::computeBuckets(const std::vector<BVHPrimitiveInfo>& primitiveInfo
     }
 };
 
-Real cu_utils::computeBucketCost(const BucketInfo buckets[], int splitBucket, const BoundingBox& bounds, const int NUM_BUCKETS) {
+Real cu_utils::computeBucketCost(const BucketInfo buckets[], int splitBucket, const BoundingBox& bounds, const int NUM_BUCKETS, Real traversal, Real intersect) {
     BoundingBox b0, b1;
     Real count0 = 0, count1 = 0;
 
@@ -84,7 +84,7 @@ Real cu_utils::computeBucketCost(const BucketInfo buckets[], int splitBucket, co
         b1 = b1 + buckets[j].bounds;
         count1 += buckets[j].count;
     }
-    Real cost = traversalCost() + (intersectCost() * count0 * surfaceArea(b0) + intersectCost() * count1 * surfaceArea(b1)) / surfaceArea(bounds);
+    Real cost = traversal + (intersect * count0 * surfaceArea(b0) + intersect * count1 * surfaceArea(b1)) / surfaceArea(bounds);
 
     return cost;
 };
@@ -14,10 +14,34 @@ namespace cu_utils {
 
     const static int DEF_NUM_BUCKETS = 12;
 
+    // Ranges this small become leaves, sized so triangles fill one TriangleBlock
+    const static int MAX_LEAF_SIZE = 4;
+
+    // Bucket arrays live on the stack, builds can ask for up to this many
+    const static int MAX_NUM_BUCKETS = 64;
+
     Real surfaceArea(const BoundingBox& box);
     Real intersectCost();
     Real traversalCost();
 
+    enum class BVHSplit {
+        SAH,    // Cheapest bucket boundary on the longest axis
+        Median  // Equal counts on both sides of the longest axis, no cost model at all
+    };
+
+    // Knobs for BVHNode::buildTree. The defaults are what the renderer builds with,
+    // the rest is for comparing trees (see torrey_bvh_analyze).
+    struct BVHBuildSettings {
+        BVHSplit split = BVHSplit::SAH;
+        int numBuckets = DEF_NUM_BUCKETS;
+        int maxLeafSize = MAX_LEAF_SIZE;
+        Real traversalCost = cu_utils::traversalCost();
+        Real intersectCost = cu_utils::intersectCost();
+        // Ranges up to maxLeafSize normally always become leaves. This lets SAH weigh splitting them
+        // against the leaf cost (pbrt's rule), which is the only place the cost ratio changes the tree.
+        bool leafByCost = false;
+    };
+
     bool compareCentroid(const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b, int dim);
 
     /**
@@ -25,7 +49,8 @@ namespace cu_utils {
     */
     void computeBuckets(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const BoundingBox& bounds, int dim, BucketInfo* buckets, const int NUM_BUCKETS=DEF_NUM_BUCKETS);
 
-    Real computeBucketCost(const BucketInfo buckets[], int splitBucket, const BoundingBox& bounds, const int NUM_BUCKETS=DEF_NUM_BUCKETS);
+    Real computeBucketCost(const BucketInfo buckets[], int splitBucket, const BoundingBox& bounds, const int NUM_BUCKETS=DEF_NUM_BUCKETS,
+                           Real traversal=traversalCost(), Real intersect=intersectCost());
 
     int partitionPrimitives(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const BoundingBox& bounds, int dim, int minCostSplitBucket, const int NUM_BUCKETS=DEF_NUM_BUCKETS);
 
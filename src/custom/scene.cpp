@@ -2,9 +2,16 @@
 #include <filesystem>
 #include "scene.h"
 #include "../vector.h"
+#include "../parallel.h"
+#include "../timer.h"
+#include "../perf_counters.h"
+#include "../trace.h"
 
 using namespace cu_utils;
 
+size_t Scene::textureCacheBytes = 0;
+fs::path Scene::textureCacheDir = fs::temp_directory_path() / "torrey_textures";
+
 Scene Scene::defaultScene()
 {
     // Create a scene with a single sphere
@@ -28,13 +35,14 @@ Scene::Scene()
     camera = AbstractCamera{Vector3{0, 0, 0}, Vector3{0, 0, 1}, Vector3{0, -1, 0}, (Real)90.0};
     shapes = std::vector<Shape *>();
     materials = std::vector<Material *>();
-    textures = std::map<std::filesystem::path, Image3>();
 
     areaLights = std::vector<AreaLight *>();
 }
 
-Scene::Scene(const ParsedScene &parsed)
+Scene::Scene(const ParsedScene &parsed, bool deferTextures)
 {
+    TraceScope trace("scene build");
+    PerfScope perf("scene build");
     // Invoke base constructor
     Scene();
 
@@ -160,6 +168,9 @@ Scene::Scene(const ParsedScene &parsed)
         materials.push_back(material);
     }
 
+    if (!deferTextures)
+        loadTextures();
+
     // Copy lights
     for (int i = 0; i < (int)parsed.lights.size(); i++)
     {
@@ -194,167 +205,154 @@ Scene::Scene(const ParsedScene &parsed)
     }
 }
 
-void Scene::addTexture(ParsedImageTexture *image_texture, bool loadUnbiased)
+int Scene::addTexture(const fs::path &filename, bool loadUnbiased)
 {
+    auto it = textureHandles.find(filename);
+    if (it != textureHandles.end())
+        return it->second;
+
+    if (textureCacheBytes > 0 && !textureCache)
+        textureCache = std::make_shared<TextureCache>(textureCacheBytes, textureCacheDir);
+
+    // Handles are given out in order, so the cache's own handles line up with these
+    int handle = (int)textureHandles.size();
+    textureHandles[filename] = handle;
+    pendingTextures.push_back(PendingTexture{filename, loadUnbiased, handle});
+    if (!textureCache)
+        textures.emplace_back();
+
+    return handle;
+}
 
-    // If the texture is not already loaded, load it
-    if (textures.find(image_texture->filename) == textures.end())
+void Scene::loadTextures()
+{
+    if (pendingTextures.empty())
+        return;
+
+    TraceScope trace("texture load");
+    PerfScope perf("texture load");
+    Timer timer;
+    tick(timer);
+
+    std::vector<fs::path> tiledPaths(pendingTextures.size());
+    parallel_for_rethrow([&](int64_t i)
+                         {
+                            // Mip pyramid gets built here, at load time. The cache only converts, tiles come in as they're sampled.
+                            const PendingTexture &pending = pendingTextures[i];
+                            if (textureCache)
+                                tiledPaths[i] = textureCache->convert(pending.filename, pending.linear);
+                            else
+                                textures[pending.handle] = loadMipMap(pending.filename, pending.linear); },
+                         pendingTextures.size());
+
+    for (int i = 0; i < (int)pendingTextures.size(); i++)
     {
-        Image3 image;
+        const PendingTexture &pending = pendingTextures[i];
+        if (textureCache)
+        {
+            textureCache->addTiled(tiledPaths[i]);
+            continue;
+        }
 
-        if (loadUnbiased)
-            image = loadUnbiasedImage(image_texture->filename);
-        else
-            image = imread3(image_texture->filename);
+        const MipMap &texture = textures[pending.handle];
+        std::cout << "Loaded texture " << pending.filename.filename().string() << " (" << texture.width() << "x" << texture.height()
+                  << ", " << texture.memoryBytes() / 1024 << " KB with mips)" << std::endl;
+    }
+
+    std::cout << "Loaded " << pendingTextures.size() << " textures in " << tick(timer) << " seconds." << std::endl;
+    pendingTextures.clear();
+}
+
+// Filter width in base texels, from the uv derivatives of the hit
+static Real texelFootprint(int width, int height, const TextureRef &ref, const RayHit *hit)
+{
+    if (hit == nullptr)
+        return 0;
+
+    Real dsdx = hit->dudx * ref.uscale * width;
+    Real dtdx = hit->dvdx * ref.vscale * height;
+    Real dsdy = hit->dudy * ref.uscale * width;
+    Real dtdy = hit->dvdy * ref.vscale * height;
+
+    return std::max(std::sqrt(dsdx * dsdx + dtdx * dtdx), std::sqrt(dsdy * dsdy + dtdy * dtdy));
+}
 
-        textures[image_texture->filename] = image;
+Vector3 Scene::sampleTexture(const TextureRef &ref, Real u, Real v, const RayHit *hit) const
+{
+    if (!ref.valid())
+        return Vector3{0, 0, 0};
+
+    Real su = ref.uscale * u + ref.uoffset;
+    Real sv = ref.vscale * v + ref.voffset;
+
+    if (textureCache)
+    {
+        int w = textureCache->width(ref.handle), h = textureCache->height(ref.handle);
+        return textureCache->sample(ref.handle, su, sv, texelFootprint(w, h, ref, hit));
     }
+
+    const MipMap &map = textures[ref.handle];
+    return map.sample(su, sv, texelFootprint(map.width(), map.height(), ref, hit));
 }
 
-// TODO: Move this to the material src probably
 Vector3 Material::getTexColor(Real u, Real v) const
 {
-    if (texMeta == nullptr)
+    if (!colorTex.valid())
+        return flatColor;
+
+    return scene->sampleTexture(colorTex, u, v);
+}
+
+Vector3 Material::getTexColor(const RayHit &hit) const
+{
+    if (!colorTex.valid())
         return flatColor;
 
-    // Get the image texture
-    Image3 *image = &(scene->textures[texMeta->filename]);
-
-    // Get the pixel coordinates
-    Real rx = (image->width * modulo(texMeta->uscale * u + texMeta->uoffset, 1.0));
-    Real ry = (image->height * modulo(texMeta->vscale * v + texMeta->voffset, 1.0));
-
-    // Bilinear interpolation
-    int x = (int)rx;
-    int y = (int)ry;
-    int nx = (x + 1) % image->width;
-    int ny = (y + 1) % image->height;
-
-    // Get the four surrounding pixels
-    Vector3 c00 = (*image)(x, y);
-    Vector3 c01 = (*image)(x, ny);
-    Vector3 c10 = (*image)(nx, y);
-    Vector3 c11 = (*image)(nx, ny);
-
-    // Interpolate
-    Real dx = rx - x;
-    Real dy = ry - y;
-    Vector3 c0 = c00 * (1 - dx) + c10 * dx;
-    Vector3 c1 = c01 * (1 - dx) + c11 * dx;
-    Vector3 c = c0 * (1 - dy) + c1 * dy;
-
-    // Get the pixel color
-    return c;
+    return scene->sampleTexture(colorTex, hit.u, hit.v, &hit);
 }
 
 Vector3 Material::getNormalOffset(Real u, Real v) const {
-    if (normalMeta == nullptr)
+    if (!normalTex.valid())
         return Vector3{0.5, 0.5, 1.0};
 
-    // Get the image texture
-    Image3 *image = &(scene->textures[normalMeta->filename]);
-
-    // Get the pixel coordinates
-    Real rx = (image->width * modulo(normalMeta->uscale * u + normalMeta->uoffset, 1.0));
-    Real ry = (image->height * modulo(normalMeta->vscale * v + normalMeta->voffset, 1.0));
-
-    // Bilinear interpolation
-    int x = (int)rx;
-    int y = (int)ry;
-    int nx = (x + 1) % image->width;
-    int ny = (y + 1) % image->height;
-
-    // Get the four surrounding pixels
-    Vector3 c00 = (*image)(x, y);
-    Vector3 c01 = (*image)(x, ny);
-    Vector3 c10 = (*image)(nx, y);
-    Vector3 c11 = (*image)(nx, ny);
-
-    // Interpolate
-    Real dx = rx - x;
-    Real dy = ry - y;
-    Vector3 c0 = c00 * (1 - dx) + c10 * dx;
-    Vector3 c1 = c01 * (1 - dx) + c11 * dx;
-    Vector3 c = c0 * (1 - dy) + c1 * dy;
-
-    // Get the pixel color
-    return c;
+    // Normals aren't prefiltered, averaging them just flattens the surface
+    return scene->sampleTexture(normalTex, u, v);
 }
 
 Vector3 Material::getEmission(Real u, Real v) const {
-    // if (normalMeta == nullptr)
-    //     return Vector3{0.5, 0.5, 1.0};
-
-    // Get the image texture
-    Image3 *image = &(scene->textures[emissiveMeta->filename]);
-
-    // Get the pixel coordinates
-    Real rx = (image->width * modulo(emissiveMeta->uscale * u + emissiveMeta->uoffset, 1.0));
-    Real ry = (image->height * modulo(emissiveMeta->vscale * v + emissiveMeta->voffset, 1.0));
-
-    // Bilinear interpolation
-    int x = (int)rx;
-    int y = (int)ry;
-    int nx = (x + 1) % image->width;
-    int ny = (y + 1) % image->height;
-
-    // Get the four surrounding pixels
-    Vector3 c00 = (*image)(x, y);
-    Vector3 c01 = (*image)(x, ny);
-    Vector3 c10 = (*image)(nx, y);
-    Vector3 c11 = (*image)(nx, ny);
-
-    // Interpolate
-    Real dx = rx - x;
-    Real dy = ry - y;
-    Vector3 c0 = c00 * (1 - dx) + c10 * dx;
-    Vector3 c1 = c01 * (1 - dx) + c11 * dx;
-    Vector3 c = c0 * (1 - dy) + c1 * dy;
-
-    // Get the pixel color
-    return c;
+    return scene->sampleTexture(emissiveTex, u, v);
+}
+
+Vector3 Material::getEmission(const RayHit &hit) const {
+    return scene->sampleTexture(emissiveTex, hit.u, hit.v, &hit);
 }
 
 
 void Material::loadTexture(ParsedImageTexture *image_texture)
 {
-    // Load the image texture and create a texture object
-    // ...
-
-    // Clone to heapsince it's getting deallocated later or something
-    texMeta = new ParsedImageTexture(*image_texture);
-    scene->addTexture(image_texture);
+    // Resolve the file to a handle now so shading never touches paths
+    colorTex.handle = scene->addTexture(image_texture->filename);
+    colorTex.uscale = image_texture->uscale;
+    colorTex.vscale = image_texture->vscale;
+    colorTex.uoffset = image_texture->uoffset;
+    colorTex.voffset = image_texture->voffset;
 
     // Also try to find a normal map
     std::string normal_filename = image_texture->filename.string();
     size_t dot_pos = normal_filename.find_last_of(".");
     if (dot_pos != std::string::npos) {
-        // normal_filename.insert(dot_pos, "_normal");
-
         // Change from .* to .png
         normal_filename.replace(normal_filename.begin() + dot_pos, normal_filename.end(), "_normal.png");
 
-        if (fs::exists(normal_filename)) {
-            // Load the normal map and create a texture object
-            ParsedImageTexture *normal_texture = new ParsedImageTexture();
-            normal_texture->filename = normal_filename;
-
-            scene->addTexture(normal_texture, true);
-
-            normalMeta = normal_texture;
-        }
-
-        // Just copy it whatever
-        std::string em_fname = image_texture->filename.string();
-        normal_filename.replace(normal_filename.begin() + dot_pos, normal_filename.end(), "_emissive.jpg");
-        
-        // Load the normal map and create a texture object
-        ParsedImageTexture *em_tex = new ParsedImageTexture();
-        em_tex->filename = normal_filename;
+        // Companion maps use the default uv transform
+        if (fs::exists(normal_filename))
+            normalTex.handle = scene->addTexture(normal_filename, true);
 
-        scene->addTexture(em_tex);
+        std::string em_filename = image_texture->filename.string();
+        em_filename.replace(em_filename.begin() + dot_pos, em_filename.end(), "_emissive.jpg");
 
-        emissiveMeta = em_tex;
+        if (fs::exists(em_filename))
+            emissiveTex.handle = scene->addTexture(em_filename);
     }
 }
 
@@ -7,6 +7,9 @@
 #include "shapes.h"
 #include "../parse_scene.h"
 #include "materials.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include <memory>
 
 namespace cu_utils
 {
@@ -43,16 +46,43 @@ namespace cu_utils
         std::vector<PointLight> lights;
         std::vector<AreaLight *> areaLights;
 
-        std::map<std::filesystem::path, Image3> textures;
+        // Dense so materials can index straight in, the map is only used to dedupe while loading
+        std::vector<MipMap> textures;
+        std::map<std::filesystem::path, int> textureHandles;
+
+        // Set when textures are paged in through a TextureCache, handles then index into it instead of textures
+        std::shared_ptr<TextureCache> textureCache;
+
+        // Nonzero switches scenes to the tiled texture cache with this many bytes of resident tiles
+        static size_t textureCacheBytes;
+        static std::filesystem::path textureCacheDir;
+
+        // Added but not decoded yet
+        struct PendingTexture
+        {
+            std::filesystem::path filename;
+            bool linear;
+            int handle;
+        };
+        std::vector<PendingTexture> pendingTextures;
 
         Image3 skybox;
 
         Scene();
-        Scene(const ParsedScene &parsedScene);
+
+        // deferTextures leaves the decoding to a later loadTextures() call, so it can overlap other work
+        Scene(const ParsedScene &parsedScene, bool deferTextures = false);
 
         static Scene defaultScene();
 
-        void addTexture(ParsedImageTexture *texMeta, bool loadUnbiased = false);
+        // Hands out the file's handle right away, the decode itself waits for loadTextures()
+        int addTexture(const std::filesystem::path &filename, bool loadUnbiased = false);
+
+        // Decodes (or converts for the cache) every texture added since the last call, in parallel
+        void loadTextures();
+
+        // The one texture lookup everything goes through. hit gives the uv footprint, nullptr samples the base level.
+        Vector3 sampleTexture(const TextureRef &ref, Real u, Real v, const RayHit *hit = nullptr) const;
     };
 
     void assignParsedColor(Material *material, ParsedColor color);
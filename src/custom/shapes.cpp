@@ -7,6 +7,7 @@
 #include <cmath>
 #include <vector.h>
 #include "onb.h"
+#include "triangle_block.h"
 
 using namespace cu_utils;
 // using namespace std;
@@ -67,6 +68,7 @@ Sphere::Sphere(Vector3 center, Real radius, int material_id)
     this->radius = radius;
     this->material_id = material_id;
     this->areaLight = nullptr;
+    this->scene = nullptr;
 }
 
 BoundingBox Sphere::getBoundingBox() const
@@ -105,6 +107,7 @@ Triangle::Triangle(Vector3 v0, Vector3 v1, Vector3 v2, int material_id)
     this->v2 = v2;
     this->material_id = material_id;
     this->areaLight = nullptr;
+    this->scene = nullptr;
 
     // Set uvs so the uv of a hit is just the barycentric coordinates
     uv0 = Vector2(0, 0);
@@ -119,82 +122,144 @@ Triangle::Triangle(Vector3 v0, Vector3 v1, Vector3 v2, int material_id)
 
 RayHit Triangle::checkHit(const Ray &ray, const Real mint, const Real maxt) const
 {
+    Real t, u, v;
+    if (!intersect(ray, mint, maxt, t, u, v))
+        return RayHit();
+
+    return finishHit(ray, t, u, v);
+}
+
+bool Triangle::watertight = false;
+
+bool Triangle::intersect(const Ray &ray, Real mint, Real maxt, Real &t, Real &u, Real &v) const
+{
+    if (watertight)
+        return WatertightRay(ray).intersect(v0, v1, v2, mint, maxt, t, u, v);
+
     // Borrowed from RT in One Weekend
     Vector3 e1 = v1 - v0; // v0 -> v1
     Vector3 e2 = v2 - v0; // v0 -> v2
     Vector3 h = cross(ray.dir, e2);
     Real a = dot(e1, h);
 
-    // This code was causing bugs for some reason idk why
-    // if (a > -0.00001 && a < 0.00001)
-    //     return RayHit(); // Ray is parallel to triangle
+    // Ray is parallel to the triangle or the triangle has no area.
+    // An epsilon here used to throw away hits on small triangles, only exact zero is safe.
+    if (a == 0)
+        return false;
 
     Real f = 1 / a;
     Vector3 s = ray.origin - v0;
-    Real u = f * dot(s, h);
+    u = f * dot(s, h);
 
-    if (u < 0.0 || u > 1.0)
-        return RayHit(); // Ray misses triangle
+    // Written so NaNs count as misses
+    if (!(u >= 0.0 && u <= 1.0))
+        return false; // Ray misses triangle
 
     Vector3 q = cross(s, e1);
-    Real v = f * dot(ray.dir, q);
+    v = f * dot(ray.dir, q);
 
-    if (v < 0.0 || u + v > 1.0)
-        return RayHit(); // Ray misses triangle
+    if (!(v >= 0.0 && u + v <= 1.0))
+        return false; // Ray misses triangle
 
     // At this point, the ray hits the triangle
-    Real t = f * dot(e2, q);
+    t = f * dot(e2, q);
+
+    if (!(t >= mint && t <= maxt))
+        return false; // Triangle is out of bounds for the raycast
 
-    if (t < mint || t > maxt)
-        return RayHit(); // Triangle is out of bounds for the raycast
+    return true;
+}
 
+RayHit Triangle::finishHit(const Ray &ray, Real t, Real u, Real v) const
+{
     // n is the weighted average of the triangle's normals
     Vector3 n = normalize(n0 + u * (n1 - n0) + v * (n2 - n0));
 
-    // Get material
-    int material_id = this->material_id;
-    Material *mat = scene->materials[material_id];
+    // Loose triangles (not part of a scene) don't have materials to normal map with
+    if (scene != nullptr)
+    {
+        // Get material
+        Material *mat = scene->materials[material_id];
 
-    Vector3 normMapVal = mat->getNormalOffset(u, v);
+        Vector3 normMapVal = mat->getNormalOffset(u, v);
 
-    // Build orthonormal basis from uv
-    Vector2 duv1 = uv1 - uv0;
-    Vector2 duv2 = uv2 - uv0;
+        // Build orthonormal basis from uv
+        Vector3 e1 = v1 - v0;
+        Vector3 e2 = v2 - v0;
+        Vector2 duv1 = uv1 - uv0;
+        Vector2 duv2 = uv2 - uv0;
 
-    Real uvf = 1.0 / (duv1.x * duv2.y - duv2.x * duv1.y);
+        Real uvf = 1.0 / (duv1.x * duv2.y - duv2.x * duv1.y);
 
-    Vector3 tan = normalize(uvf * (duv2.y * e1 - duv1.y * e2));
-    Vector3 bitan = normalize(uvf * (-duv2.x * e1 + duv1.x * e2));
-    
-    // Build orthonormal basis from normal
-    onb basis = onb();
-    basis.axis[0] = tan;
-    basis.axis[1] = bitan;
-    basis.axis[2] = n;
-
-    // Map x and y to [-1, 1]
-    normMapVal.x = (normMapVal.x - 0.5) * 2;
-    normMapVal.y = (normMapVal.y - 0.5) * 2;
-    normMapVal.z = (normMapVal.z - 0.5) * 2;
-
-    // if (normMapVal.z < 0)
-    //     std::cout << "Negative z value: " << normMapVal.z << std::endl;
-    
-    
-    if (normMapVal.z > 1)
-        std::cout << "overcapped z value: " << normMapVal.z << std::endl;
+        Vector3 tan = normalize(uvf * (duv2.y * e1 - duv1.y * e2));
+        Vector3 bitan = normalize(uvf * (-duv2.x * e1 + duv1.x * e2));
+
+        // Build orthonormal basis from normal
+        onb basis = onb();
+        basis.axis[0] = tan;
+        basis.axis[1] = bitan;
+        basis.axis[2] = n;
 
-    // normMapVal = Vector3{0, 0, 1};
-    n = normalize(basis.local(normMapVal));
+        // Map x and y to [-1, 1]
+        normMapVal.x = (normMapVal.x - 0.5) * 2;
+        normMapVal.y = (normMapVal.y - 0.5) * 2;
+        normMapVal.z = (normMapVal.z - 0.5) * 2;
+
+        if (normMapVal.z > 1)
+            std::cout << "overcapped z value: " << normMapVal.z << std::endl;
+
+        n = normalize(basis.local(normMapVal));
+    }
 
     bool backface = dot(n, ray.dir) > 0;
     n = backface ? -n : n;
 
-    // Use barycentric
-    Vector3 bary = getBarycentric(ray * t);
-    Vector2 uv = bary.x * uv0 + bary.y * uv1 + bary.z * uv2;
+    // u and v already are the barycentrics of v1 and v2
+    Vector2 uv = (1 - u - v) * uv0 + u * uv1 + v * uv2;
+
+    RayHit hit = RayHit(true, t, this, n, uv.x, uv.y, backface);
+    if (ray.hasDifferentials)
+        uvDifferentials(ray, ray * t, hit);
+
+    return hit;
+}
+
+void Triangle::uvDifferentials(const Ray &ray, const Vector3 &p, RayHit &hit) const
+{
+    // Where the neighbouring pixels' rays cross the triangle's plane
+    Vector3 e1 = v1 - v0;
+    Vector3 e2 = v2 - v0;
+    Vector3 ng = cross(e1, e2);
+
+    Real rxDot = dot(ng, ray.rxDir);
+    Real ryDot = dot(ng, ray.ryDir);
+    if (rxDot == 0 || ryDot == 0)
+        return;
 
-    return RayHit(true, t, this, n, uv.x, uv.y, backface);
+    Real planeDist = dot(ng, p - ray.origin);
+    Vector3 dpdx = ray.origin + ray.rxDir * (planeDist / rxDot) - p;
+    Vector3 dpdy = ray.origin + ray.ryDir * (planeDist / ryDot) - p;
+
+    // Position derivatives along u and v, same as the tangents used for normal mapping
+    Vector2 duv1 = uv1 - uv0;
+    Vector2 duv2 = uv2 - uv0;
+    Real uvDet = duv1.x * duv2.y - duv2.x * duv1.y;
+    if (uvDet == 0)
+        return;
+
+    Vector3 dpdu = (duv2.y * e1 - duv1.y * e2) / uvDet;
+    Vector3 dpdv = (-duv2.x * e1 + duv1.x * e2) / uvDet;
+
+    // Least squares fit of dpdx = dudx * dpdu + dvdx * dpdv
+    Real a = dot(dpdu, dpdu), b = dot(dpdu, dpdv), c = dot(dpdv, dpdv);
+    Real det = a * c - b * b;
+    if (det == 0)
+        return;
+
+    hit.dudx = (c * dot(dpdu, dpdx) - b * dot(dpdv, dpdx)) / det;
+    hit.dvdx = (a * dot(dpdv, dpdx) - b * dot(dpdu, dpdx)) / det;
+    hit.dudy = (c * dot(dpdu, dpdy) - b * dot(dpdv, dpdy)) / det;
+    hit.dvdy = (a * dot(dpdv, dpdy) - b * dot(dpdu, dpdy)) / det;
 }
 
 Vector3 Triangle::getBarycentric(const Vector3 p) const
@@ -20,6 +20,8 @@ namespace cu_utils
         const Scene *scene; // The scene that this shape is in
         const AreaLight *areaLight; // The area light that this shape is
 
+        virtual ~Shape() = default;
+
         virtual RayHit checkHit(const Ray &ray, const Real mint, const Real maxt) const = 0;
         virtual BoundingBox getBoundingBox() const = 0;
         virtual Ray sampleSurface(int samples, Real &jacobian, pcg32_state &rng) const;
@@ -46,6 +48,9 @@ namespace cu_utils
         Vector2 uv0, uv1, uv2;
         Vector3 n0, n1, n2;
 
+        // Use the watertight test (Woop et al. 2013) instead of Moller-Trumbore, for every triangle
+        static bool watertight;
+
         Triangle(Vector3 v0, Vector3 v1, Vector3 v2, int material_id);
         RayHit checkHit(const Ray &ray, const Real mint, const Real maxt) const override;
         BoundingBox getBoundingBox() const override;
@@ -56,5 +61,14 @@ namespace cu_utils
         Vector3 getBarycentric(const Vector3 p) const;
 
         void setUVs(Vector2 uv0, Vector2 uv1, Vector2 uv2);
+
+        // Geometric part of checkHit, gives the distance and barycentrics. Degenerate triangles never hit.
+        bool intersect(const Ray &ray, Real mint, Real maxt, Real &t, Real &u, Real &v) const;
+
+        // Builds the full RayHit (shading normal, normal map, uvs) out of an intersection
+        RayHit finishHit(const Ray &ray, Real t, Real u, Real v) const;
+
+        // Fills in the hit's uv derivatives from the ray differentials
+        void uvDifferentials(const Ray &ray, const Vector3 &p, RayHit &hit) const;
     };
 }
\ No newline at end of file
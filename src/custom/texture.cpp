@@ -0,0 +1,332 @@
+#include "texture.h"
+#include "../3rdparty/stb_image.h"
+#include "../flexception.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace cu_utils;
+
+// 8-bit decode tables, index is the stored byte
+static const std::vector<float> &decodeLUT(TexelFormat format)
+{
+    static const std::vector<float> gamma = []()
+    {
+        std::vector<float> lut(256);
+        for (int i = 0; i < 256; i++)
+            lut[i] = std::pow(i / 255.0f, 2.2f);
+        return lut;
+    }();
+
+    static const std::vector<float> linear = []()
+    {
+        std::vector<float> lut(256);
+        for (int i = 0; i < 256; i++)
+            lut[i] = i / 255.0f;
+        return lut;
+    }();
+
+    return format == TexelFormat::GAMMA8 ? gamma : linear;
+}
+
+static uint8_t encode8(float value, TexelFormat format)
+{
+    value = std::clamp(value, 0.0f, 1.0f);
+    if (format == TexelFormat::GAMMA8)
+        value = std::pow(value, 1 / 2.2f);
+
+    return (uint8_t)std::lround(value * 255);
+}
+
+uint16_t cu_utils::floatToHalf(float f)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    // NaN and infinity
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+    // Too big, clamp to infinity
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    // Too small for a normal half, make a denormal (or zero)
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+
+        // Round to nearest even
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+
+    // Round to nearest even, carrying into the exponent is fine
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return half;
+}
+
+float cu_utils::halfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0)
+    {
+        if (mantissa == 0)
+            bits = sign;
+        else
+        {
+            // Denormal, shift until it's normalized
+            exponent = 127 - 15 + 1;
+            while ((mantissa & 0x400) == 0)
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    }
+    else if (exponent == 31)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+TextureLevel::TextureLevel() : fmt(TexelFormat::HALF)
+{
+}
+
+TextureLevel::TextureLevel(int width, int height, TexelFormat format) : width(width), height(height), fmt(format)
+{
+    if (format == TexelFormat::HALF)
+        rgb16.resize(3 * width * height);
+    else
+        rgb8.resize(3 * width * height);
+}
+
+Vector3f TextureLevel::texel(int x, int y) const
+{
+    int i = 3 * (y * width + x);
+    if (fmt == TexelFormat::HALF)
+        return Vector3f{halfToFloat(rgb16[i]), halfToFloat(rgb16[i + 1]), halfToFloat(rgb16[i + 2])};
+
+    const std::vector<float> &lut = decodeLUT(fmt);
+    return Vector3f{lut[rgb8[i]], lut[rgb8[i + 1]], lut[rgb8[i + 2]]};
+}
+
+void TextureLevel::texelQuad(int x0, int x1, int y0, int y1, Vector3f out[4]) const
+{
+    int idx[4] = {3 * (y0 * width + x0), 3 * (y0 * width + x1), 3 * (y1 * width + x0), 3 * (y1 * width + x1)};
+
+    if (fmt == TexelFormat::HALF)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            const uint16_t *t = &rgb16[idx[k]];
+            out[k] = Vector3f{halfToFloat(t[0]), halfToFloat(t[1]), halfToFloat(t[2])};
+        }
+        return;
+    }
+
+    const float *lut = decodeLUT(fmt).data();
+    for (int k = 0; k < 4; k++)
+    {
+        const uint8_t *t = &rgb8[idx[k]];
+        out[k] = Vector3f{lut[t[0]], lut[t[1]], lut[t[2]]};
+    }
+}
+
+void TextureLevel::setTexel(int x, int y, const Vector3f &color)
+{
+    int i = 3 * (y * width + x);
+    for (int c = 0; c < 3; c++)
+    {
+        if (fmt == TexelFormat::HALF)
+            rgb16[i + c] = floatToHalf(color[c]);
+        else
+            rgb8[i + c] = encode8(color[c], fmt);
+    }
+}
+
+size_t TextureLevel::memoryBytes() const
+{
+    return rgb8.size() * sizeof(uint8_t) + rgb16.size() * sizeof(uint16_t);
+}
+
+MipMap::MipMap()
+{
+}
+
+MipMap::MipMap(const Image3 &base, TexelFormat format)
+{
+    if (base.data.empty())
+        return;
+
+    TextureLevel level(base.width, base.height, format);
+    for (int y = 0; y < base.height; y++)
+    {
+        for (int x = 0; x < base.width; x++)
+            level.setTexel(x, y, Vector3f(base(x, y)));
+    }
+
+    pyramid.push_back(std::move(level));
+    buildPyramid();
+}
+
+MipMap::MipMap(TextureLevel base)
+{
+    if (base.width == 0 || base.height == 0)
+        return;
+
+    pyramid.push_back(std::move(base));
+    buildPyramid();
+}
+
+void MipMap::buildPyramid()
+{
+    while (pyramid.back().width > 1 || pyramid.back().height > 1)
+        pyramid.push_back(downsample(pyramid.back()));
+}
+
+size_t MipMap::memoryBytes() const
+{
+    size_t total = 0;
+    for (const TextureLevel &level : pyramid)
+        total += level.memoryBytes();
+    return total;
+}
+
+TextureLevel cu_utils::downsample(const TextureLevel &level)
+{
+    TextureLevel out(std::max(1, level.width / 2), std::max(1, level.height / 2), level.format());
+
+    for (int y = 0; y < out.height; y++)
+    {
+        for (int x = 0; x < out.width; x++)
+        {
+            // Clamp so 1 texel wide images still work
+            int x0 = std::min(2 * x, level.width - 1);
+            int x1 = std::min(2 * x + 1, level.width - 1);
+            int y0 = std::min(2 * y, level.height - 1);
+            int y1 = std::min(2 * y + 1, level.height - 1);
+
+            // Average in linear space, then re-encode
+            Vector3f sum = level.texel(x0, y0) + level.texel(x1, y0) + level.texel(x0, y1) + level.texel(x1, y1);
+            out.setTexel(x, y, sum / 4.0f);
+        }
+    }
+
+    return out;
+}
+
+BilinearTaps cu_utils::bilinearTaps(int width, int height, Real u, Real v)
+{
+    // Get the pixel coordinates
+    Real rx = width * modulo(u, 1.0);
+    Real ry = height * modulo(v, 1.0);
+
+    BilinearTaps taps;
+    taps.x0 = std::min((int)rx, width - 1);
+    taps.y0 = std::min((int)ry, height - 1);
+    taps.x1 = (taps.x0 + 1) % width;
+    taps.y1 = (taps.y0 + 1) % height;
+    taps.dx = rx - taps.x0;
+    taps.dy = ry - taps.y0;
+    return taps;
+}
+
+Vector3 cu_utils::blendTaps(const Vector3f c[4], const BilinearTaps &taps)
+{
+    // Interpolate, floats are plenty for 8 and 16 bit texels
+    Vector3f c0 = c[0] * (1 - taps.dx) + c[1] * taps.dx;
+    Vector3f c1 = c[2] * (1 - taps.dx) + c[3] * taps.dx;
+    return Vector3(c0 * (1 - taps.dy) + c1 * taps.dy);
+}
+
+Real cu_utils::pickLevels(Real footprint, int numLevels, int &lo, int &hi)
+{
+    // Level where one texel covers the footprint
+    Real level = footprint > 1 ? std::log2(footprint) : 0;
+    int maxLevel = numLevels - 1;
+
+    if (level <= 0 || level >= maxLevel)
+    {
+        lo = hi = level <= 0 ? 0 : maxLevel;
+        return 0;
+    }
+
+    lo = (int)level;
+    hi = lo + 1;
+    return level - lo;
+}
+
+Vector3 MipMap::bilinear(int level, Real u, Real v) const
+{
+    const TextureLevel &image = pyramid[level];
+    BilinearTaps taps = bilinearTaps(image.width, image.height, u, v);
+
+    // Get the four surrounding pixels, ordered c00 c10 c01 c11
+    Vector3f c[4];
+    image.texelQuad(taps.x0, taps.x1, taps.y0, taps.y1, c);
+    return blendTaps(c, taps);
+}
+
+Vector3 MipMap::sample(Real u, Real v, Real footprint) const
+{
+    if (pyramid.empty())
+        return Vector3{0, 0, 0};
+
+    int lo, hi;
+    Real t = pickLevels(footprint, numLevels(), lo, hi);
+    if (lo == hi)
+        return bilinear(lo, u, v);
+
+    return bilinear(lo, u, v) * (1 - t) + bilinear(hi, u, v) * t;
+}
+
+MipMap cu_utils::loadMipMap(const fs::path &filename, bool linear)
+{
+    std::string extension = to_lowercase(filename.extension().string());
+
+    // Float sources go through the usual loader and get stored as halves
+    if (extension == ".exr" || extension == ".hdr")
+        return MipMap(imread3(filename), TexelFormat::HALF);
+
+    int w, h, n;
+#ifdef _WINDOWS
+    stbi_uc *data = stbi_load(filename.string().c_str(), &w, &h, &n, 3);
+#else
+    stbi_uc *data = stbi_load(filename.c_str(), &w, &h, &n, 3);
+#endif
+    if (data == nullptr)
+        Error(std::string("Failure when loading image: ") + filename.string());
+
+    TextureLevel base(w, h, linear ? TexelFormat::LINEAR8 : TexelFormat::GAMMA8);
+    std::memcpy(base.bytes(), data, 3 * w * h);
+    stbi_image_free(data);
+
+    return MipMap(std::move(base));
+}
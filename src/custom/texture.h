@@ -0,0 +1,121 @@
+/**
+ * @file texture.h
+ * Mip-mapped image textures.
+ * The pyramid is built once when the texture is loaded, lookups pick (and blend) the levels whose texels
+ * are about the size of the ray footprint so distant surfaces don't alias.
+ * Texels are kept compact (8 bits or half floats per channel) and only widened to floats for filtering.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "../image.h"
+
+namespace cu_utils
+{
+    enum class TexelFormat
+    {
+        GAMMA8,  // 8-bit LDR images, decoded with the same 2.2 gamma imread3 uses
+        LINEAR8, // 8-bit data that isn't color, like normal maps
+        HALF,    // 16-bit floats for HDR sources
+    };
+
+    uint16_t floatToHalf(float f);
+    float halfToFloat(uint16_t h);
+
+    // One level of the pyramid, RGB texels in one of the compact formats
+    class TextureLevel
+    {
+    public:
+        int width = 0;
+        int height = 0;
+
+        TextureLevel();
+        TextureLevel(int width, int height, TexelFormat format);
+
+        TexelFormat format() const { return fmt; }
+
+        Vector3f texel(int x, int y) const;
+
+        // The 2x2 block a bilinear lookup needs, decoding with one format check instead of four
+        void texelQuad(int x0, int x1, int y0, int y1, Vector3f out[4]) const;
+        void setTexel(int x, int y, const Vector3f &color);
+
+        // Raw channel storage (8-bit channels or halves, depending on the format), memoryBytes() long
+        uint8_t *bytes() { return fmt == TexelFormat::HALF ? (uint8_t *)rgb16.data() : rgb8.data(); }
+        const uint8_t *bytes() const { return fmt == TexelFormat::HALF ? (const uint8_t *)rgb16.data() : rgb8.data(); }
+        int bytesPerTexel() const { return fmt == TexelFormat::HALF ? 6 : 3; }
+
+        size_t memoryBytes() const;
+
+    private:
+        TexelFormat fmt;
+        std::vector<uint8_t> rgb8;
+        std::vector<uint16_t> rgb16;
+    };
+
+    class MipMap
+    {
+    public:
+        MipMap();
+        MipMap(const Image3 &base, TexelFormat format = TexelFormat::HALF);
+        MipMap(TextureLevel base);
+
+        int numLevels() const { return (int)pyramid.size(); }
+        const TextureLevel &level(int i) const { return pyramid[i]; }
+
+        int width() const { return pyramid.empty() ? 0 : pyramid[0].width; }
+        int height() const { return pyramid.empty() ? 0 : pyramid[0].height; }
+
+        // Bilinear lookup on a single level. u and v wrap around.
+        Vector3 bilinear(int level, Real u, Real v) const;
+
+        // Trilinear lookup. footprint is the filter width in base level texels, 0 or less gives the base level.
+        Vector3 sample(Real u, Real v, Real footprint) const;
+
+        // Storage for every level
+        size_t memoryBytes() const;
+
+    private:
+        std::vector<TextureLevel> pyramid;
+
+        void buildPyramid();
+    };
+
+    // What a material holds onto: an index into Scene::textures (resolved once at load) plus the uv transform.
+    // handle < 0 means no texture.
+    struct TextureRef
+    {
+        int handle = -1;
+        Real uscale = 1;
+        Real vscale = 1;
+        Real uoffset = 0;
+        Real voffset = 0;
+
+        bool valid() const { return handle >= 0; }
+    };
+
+    // Filtering math shared by MipMap and the tiled cache so both filter identically
+    struct BilinearTaps
+    {
+        int x0, x1, y0, y1;
+        float dx, dy;
+    };
+
+    // Texels around (u, v) on a width x height level, wrapping at the edges
+    BilinearTaps bilinearTaps(int width, int height, Real u, Real v);
+
+    // Blends texels ordered c00 c10 c01 c11
+    Vector3 blendTaps(const Vector3f c[4], const BilinearTaps &taps);
+
+    // Picks the two levels to blend for a footprint (in base texels), returns the weight of the upper one
+    Real pickLevels(Real footprint, int numLevels, int &lo, int &hi);
+
+    // Halves the level in both dimensions (rounding down, min 1) with a box filter
+    TextureLevel downsample(const TextureLevel &level);
+
+    // Loads an image file straight into compact storage. HDR files become HALF, everything else 8-bit.
+    // linear skips the gamma decode, for normal maps.
+    MipMap loadMipMap(const fs::path &filename, bool linear = false);
+}
@@ -0,0 +1,423 @@
+#include "texture_cache.h"
+#include "../flexception.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <mutex>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace cu_utils;
+
+static const char TILED_MAGIC[8] = {'T', 'O', 'R', 'R', 'E', 'Y', 'T', 'X'};
+static const int32_t TILED_VERSION = 1;
+
+struct cu_utils::TextureCacheCounters
+{
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<size_t> liveBytes{0}; // Every tile read and not yet freed, evicted or not
+};
+
+// pread has no file position to share, so tile reads from any number of threads go straight to the OS.
+// Elsewhere one stream per texture, each behind its own lock.
+struct TextureCache::TileFile
+{
+#ifdef _WIN32
+    std::ifstream in;
+    std::mutex lock;
+
+    explicit TileFile(const fs::path &path) : in(path, std::ios::binary) {}
+    bool isOpen() const { return (bool)in; }
+
+    bool read(void *dst, size_t bytes, size_t offset)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        in.seekg(offset);
+        in.read((char *)dst, bytes);
+        return (bool)in;
+    }
+#else
+    int fd;
+
+    explicit TileFile(const fs::path &path) : fd(open(path.c_str(), O_RDONLY)) {}
+    ~TileFile()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+    bool isOpen() const { return fd >= 0; }
+
+    bool read(void *dst, size_t bytes, size_t offset)
+    {
+        // pread can come back short, keep going until the whole tile is in
+        char *out = (char *)dst;
+        while (bytes > 0)
+        {
+            ssize_t n = pread(fd, out, bytes, (off_t)offset);
+            if (n <= 0)
+                return false;
+            out += n;
+            bytes -= n;
+            offset += n;
+        }
+        return true;
+    }
+#endif
+};
+
+namespace
+{
+    struct LocalTile
+    {
+        uint64_t owner = 0;
+        uint64_t key = 0;
+        std::shared_ptr<const TextureLevel> tile;
+    };
+
+    // Holding the shared_ptr keeps an evicted tile alive until this thread moves on from it
+    thread_local LocalTile localTiles[LOCAL_TILE_SLOTS];
+
+    // Lookup counts pile up here and reach the shared counter once per batch or tile miss
+    struct LocalLookups
+    {
+        std::shared_ptr<TextureCacheCounters> target;
+        uint64_t pending = 0;
+
+        void flush()
+        {
+            if (pending > 0)
+                target->lookups.fetch_add(pending, std::memory_order_relaxed);
+            pending = 0;
+        }
+
+        ~LocalLookups() { flush(); }
+    };
+
+    thread_local LocalLookups localLookups;
+
+    std::atomic<uint64_t> nextCacheId{1};
+}
+
+static uint64_t tileKey(int handle, int level, int tile)
+{
+    return ((uint64_t)handle << 40) | ((uint64_t)level << 32) | (uint32_t)tile;
+}
+
+template <typename T>
+static void writeValue(std::ofstream &out, T value)
+{
+    out.write((const char *)&value, sizeof(T));
+}
+
+template <typename T>
+static T readValue(std::ifstream &in)
+{
+    T value;
+    in.read((char *)&value, sizeof(T));
+    return value;
+}
+
+void cu_utils::writeTiledTexture(const MipMap &map, const fs::path &path, int tileSize)
+{
+    // Unique name, two renders can be converting the same texture at once
+    fs::path tmp = path;
+    tmp += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out)
+        Error(std::string("Can't write tiled texture: ") + path.string());
+
+    TexelFormat format = map.level(0).format();
+    out.write(TILED_MAGIC, sizeof(TILED_MAGIC));
+    writeValue<int32_t>(out, TILED_VERSION);
+    writeValue<int32_t>(out, (int32_t)format);
+    writeValue<int32_t>(out, tileSize);
+    writeValue<int32_t>(out, map.numLevels());
+    for (int i = 0; i < map.numLevels(); i++)
+    {
+        writeValue<int32_t>(out, map.level(i).width);
+        writeValue<int32_t>(out, map.level(i).height);
+    }
+
+    TextureLevel tile(tileSize, tileSize, format);
+    int texelBytes = tile.bytesPerTexel();
+
+    for (int i = 0; i < map.numLevels(); i++)
+    {
+        const TextureLevel &level = map.level(i);
+        int tilesX = (level.width + tileSize - 1) / tileSize;
+        int tilesY = (level.height + tileSize - 1) / tileSize;
+
+        for (int ty = 0; ty < tilesY; ty++)
+        {
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                // Copy the raw rows over, the padding never gets read
+                std::memset(tile.bytes(), 0, tile.memoryBytes());
+                int w = std::min(tileSize, level.width - tx * tileSize);
+                int h = std::min(tileSize, level.height - ty * tileSize);
+                for (int y = 0; y < h; y++)
+                {
+                    const uint8_t *src = level.bytes() + ((size_t)(ty * tileSize + y) * level.width + tx * tileSize) * texelBytes;
+                    std::memcpy(tile.bytes() + (size_t)y * tileSize * texelBytes, src, (size_t)w * texelBytes);
+                }
+
+                out.write((const char *)tile.bytes(), tile.memoryBytes());
+            }
+        }
+    }
+
+    out.close();
+    if (!out)
+    {
+        fs::remove(tmp);
+        Error(std::string("Failed writing tiled texture: ") + path.string());
+    }
+    fs::rename(tmp, path);
+}
+
+TextureCache::TextureCache(size_t maxBytes, const fs::path &cacheDir)
+    : id(nextCacheId++), maxBytes(maxBytes), cacheDir(cacheDir), counters(std::make_shared<TextureCacheCounters>())
+{
+}
+
+int TextureCache::addTexture(const fs::path &source, bool linear)
+{
+    return addTiled(convert(source, linear));
+}
+
+fs::path TextureCache::convert(const fs::path &source, bool linear) const
+{
+    // Name the tiled copy after the full source path so same-named files in different folders don't collide
+    size_t pathHash = std::hash<std::string>()(fs::absolute(source).string() + (linear ? ":linear" : ""));
+    fs::path tiledPath = cacheDir / (source.stem().string() + "_" + std::to_string(pathHash) + ".torreytex");
+
+    if (!fs::exists(source))
+        Error(std::string("Failure when loading image: ") + source.string());
+
+    // A file left short by a crash from before writes went through a temporary gets redone too
+    TiledTexture existing;
+    bool stale = !fs::exists(tiledPath) || fs::last_write_time(tiledPath) < fs::last_write_time(source) ||
+                 !readHeader(tiledPath, existing);
+    if (stale)
+    {
+        // Conversion is the only time the whole texture is in memory
+        fs::create_directories(cacheDir);
+        writeTiledTexture(loadMipMap(source, linear), tiledPath);
+        std::cout << "Converted texture " << source.filename().string() << " to " << tiledPath.filename().string() << std::endl;
+    }
+
+    return tiledPath;
+}
+
+bool TextureCache::readHeader(const fs::path &path, TiledTexture &tex)
+{
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(TILED_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, TILED_MAGIC, sizeof(magic)) != 0 || readValue<int32_t>(in) != TILED_VERSION)
+        return false;
+
+    tex.path = path;
+    tex.format = (TexelFormat)readValue<int32_t>(in);
+    tex.tileSize = readValue<int32_t>(in);
+    tex.tileBytes = (size_t)tex.tileSize * tex.tileSize * (tex.format == TexelFormat::HALF ? 6 : 3);
+
+    int numLevels = readValue<int32_t>(in);
+    if (!in || numLevels <= 0 || tex.tileSize <= 0)
+        return false;
+
+    for (int i = 0; i < numLevels; i++)
+    {
+        LevelInfo level;
+        level.width = readValue<int32_t>(in);
+        level.height = readValue<int32_t>(in);
+        level.tilesX = (level.width + tex.tileSize - 1) / tex.tileSize;
+        level.tilesY = (level.height + tex.tileSize - 1) / tex.tileSize;
+        tex.levels.push_back(level);
+    }
+
+    if (!in)
+        return false;
+
+    // Tiles start right after the header
+    size_t offset = in.tellg();
+    for (LevelInfo &level : tex.levels)
+    {
+        level.offset = offset;
+        offset += (size_t)level.tilesX * level.tilesY * tex.tileBytes;
+    }
+
+    // A truncated file has a perfectly good header, only its length gives it away
+    return fs::file_size(path) == offset;
+}
+
+int TextureCache::addTiled(const fs::path &tiledPath)
+{
+    TiledTexture tex;
+    if (!readHeader(tiledPath, tex))
+        Error(std::string("Not a complete tiled texture: ") + tiledPath.string());
+
+    tex.file = std::make_shared<TileFile>(tiledPath);
+    if (!tex.file->isOpen())
+        Error(std::string("Can't open tiled texture: ") + tiledPath.string());
+
+    textures.push_back(std::move(tex));
+    return (int)textures.size() - 1;
+}
+
+Vector3f TextureCache::texel(int handle, int level, int x, int y) const
+{
+    const TiledTexture &tex = textures[handle];
+    const LevelInfo &info = tex.levels[level];
+    int tx = x / tex.tileSize;
+    int ty = y / tex.tileSize;
+
+    const TextureLevel *tile = findTile(tileKey(handle, level, ty * info.tilesX + tx));
+    return tile->texel(x - tx * tex.tileSize, y - ty * tex.tileSize);
+}
+
+const TextureLevel *TextureCache::findTile(uint64_t key) const
+{
+    LocalLookups &batch = localLookups;
+    if (batch.target != counters)
+    {
+        if (batch.target)
+            batch.flush();
+        batch.target = counters;
+    }
+    if (++batch.pending == LOOKUP_BATCH)
+        batch.flush();
+
+    // Thread local first, no locking or refcounting on a hit
+    LocalTile &local = localTiles[(key * 0x9E3779B97F4A7C15ull) >> 58];
+    if (local.owner == id && local.key == key)
+        return local.tile.get();
+
+    // Going to the lock anyway, so bring the count up to date while we're at it
+    batch.flush();
+    local.tile = fetchTile(key);
+    local.owner = id;
+    local.key = key;
+    return local.tile.get();
+}
+
+std::shared_ptr<const TextureLevel> TextureCache::fetchTile(uint64_t key) const
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = resident.find(key);
+        if (it != resident.end())
+        {
+            lru.splice(lru.begin(), lru, it->second.lruPos);
+            return it->second.tile;
+        }
+    }
+
+    // Read outside the lock so other threads keep going. Two threads missing on the same tile both read it,
+    // the second one just uses the copy that got in first.
+    std::shared_ptr<const TextureLevel> tile = readTile(key);
+
+    std::lock_guard<std::mutex> guard(lock);
+    misses++;
+
+    auto it = resident.find(key);
+    if (it != resident.end())
+        return it->second.tile;
+
+    lru.push_front(key);
+    resident[key] = ResidentTile{tile, lru.begin()};
+    residentBytes += tile->memoryBytes();
+
+    // Evict from the back, but always keep the tile we're about to hand out
+    while (residentBytes > maxBytes && lru.size() > 1)
+    {
+        auto victim = resident.find(lru.back());
+        residentBytes -= victim->second.tile->memoryBytes();
+        resident.erase(victim);
+        lru.pop_back();
+        evictions++;
+    }
+
+    peakBytes = std::max(peakBytes, residentBytes);
+    return tile;
+}
+
+std::shared_ptr<const TextureLevel> TextureCache::readTile(uint64_t key) const
+{
+    int handle = (int)(key >> 40);
+    int level = (int)((key >> 32) & 0xff);
+    int index = (int)(key & 0xffffffff);
+
+    const TiledTexture &tex = textures[handle];
+
+    // The deleter keeps liveBytes honest for tiles that were evicted but are still held somewhere
+    TextureLevel *raw = new TextureLevel(tex.tileSize, tex.tileSize, tex.format);
+    size_t bytes = raw->memoryBytes();
+    std::shared_ptr<TextureCacheCounters> live = counters;
+    std::shared_ptr<const TextureLevel> tile(raw, [live, bytes](const TextureLevel *t)
+    {
+        live->liveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        delete t;
+    });
+    counters->liveBytes.fetch_add(bytes, std::memory_order_relaxed);
+
+    if (!tex.file->read(raw->bytes(), tex.tileBytes, tex.levels[level].offset + (size_t)index * tex.tileBytes))
+        Error(std::string("Failed reading tile from ") + tex.path.string());
+
+    return tile;
+}
+
+Vector3 TextureCache::bilinear(int handle, int level, Real u, Real v) const
+{
+    const LevelInfo &info = textures[handle].levels[level];
+    BilinearTaps taps = bilinearTaps(info.width, info.height, u, v);
+
+    // Taps can straddle tiles, so fetch them one at a time
+    Vector3f c[4] = {
+        texel(handle, level, taps.x0, taps.y0),
+        texel(handle, level, taps.x1, taps.y0),
+        texel(handle, level, taps.x0, taps.y1),
+        texel(handle, level, taps.x1, taps.y1),
+    };
+    return blendTaps(c, taps);
+}
+
+Vector3 TextureCache::sample(int handle, Real u, Real v, Real footprint) const
+{
+    int lo, hi;
+    Real t = pickLevels(footprint, numLevels(handle), lo, hi);
+    if (lo == hi)
+        return bilinear(handle, lo, u, v);
+
+    return bilinear(handle, lo, u, v) * (1 - t) + bilinear(handle, hi, u, v) * t;
+}
+
+TextureCacheStats TextureCache::stats() const
+{
+    TextureCacheStats out;
+    out.lookups = counters->lookups.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(lock);
+    out.misses = misses;
+    out.evictions = evictions;
+    out.residentBytes = residentBytes;
+    out.peakBytes = peakBytes;
+
+    // Every resident tile is live, a tile still being read counts as held for the moment
+    out.heldBytes = counters->liveBytes.load(std::memory_order_relaxed) - residentBytes;
+    return out;
+}
+
+void TextureCache::printStats(std::ostream &os) const
+{
+    TextureCacheStats s = stats();
+    os << "Texture cache: " << s.lookups << " lookups, " << 100 * s.hitRate() << "% hits, " << s.misses << " tiles read, "
+       << s.evictions << " evicted, " << s.residentBytes / 1024 << " KB resident (peak " << s.peakBytes / 1024 << " KB of "
+       << maxBytes / 1024 << " KB), " << s.heldBytes / 1024 << " KB evicted but still held" << std::endl;
+}
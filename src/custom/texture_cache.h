@@ -0,0 +1,127 @@
+/**
+ * @file texture_cache.h
+ * Tiled, lazily loaded textures for scenes whose textures don't fit in memory.
+ * Each texture is converted once into a tiled mip pyramid on disk (.torreytex), and tiles get paged in the
+ * first time a lookup touches them. Resident tiles share a global memory cap and the least recently used
+ * ones are evicted past it. Every thread also keeps a few tiles of its own so repeat lookups skip the lock.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "texture.h"
+
+namespace cu_utils
+{
+    constexpr int TEXTURE_TILE_SIZE = 64;
+
+    // Tiles a thread holds onto without locking, direct mapped
+    constexpr int LOCAL_TILE_SLOTS = 64;
+
+    // Lookups a thread counts on its own before adding them to the cache's total
+    constexpr int LOOKUP_BATCH = 1024;
+
+    struct TextureCacheCounters;
+
+    // Writes the whole pyramid as a .torreytex file. Edge tiles are padded out to full size.
+    // Goes through a temporary file, so an interrupted write never leaves a partial file at path.
+    void writeTiledTexture(const MipMap &map, const fs::path &path, int tileSize = TEXTURE_TILE_SIZE);
+
+    struct TextureCacheStats
+    {
+        uint64_t lookups = 0;   // texel fetches, lags by up to LOOKUP_BATCH per thread
+        uint64_t misses = 0;    // tiles read from disk
+        uint64_t evictions = 0;
+        size_t residentBytes = 0;
+        size_t peakBytes = 0;
+        size_t heldBytes = 0;   // evicted tiles that threads still hold in their local slots
+
+        Real hitRate() const { return lookups == 0 ? 1 : 1 - (Real)misses / lookups; }
+    };
+
+    class TextureCache
+    {
+    public:
+        // Tiled files for converted textures go in cacheDir
+        TextureCache(size_t maxBytes, const fs::path &cacheDir);
+
+        // Converts the image if there's no up to date tiled copy yet, returns the handle
+        int addTexture(const fs::path &source, bool linear = false);
+
+        // Just the conversion half of addTexture, returns the tiled path. Safe to run for several textures at once.
+        fs::path convert(const fs::path &source, bool linear = false) const;
+
+        // Registers an already tiled file
+        int addTiled(const fs::path &tiledPath);
+
+        int numTextures() const { return (int)textures.size(); }
+        int width(int handle) const { return textures[handle].levels[0].width; }
+        int height(int handle) const { return textures[handle].levels[0].height; }
+        int numLevels(int handle) const { return (int)textures[handle].levels.size(); }
+
+        // Same filtering as MipMap::bilinear and MipMap::sample
+        Vector3 bilinear(int handle, int level, Real u, Real v) const;
+        Vector3 sample(int handle, Real u, Real v, Real footprint) const;
+
+        TextureCacheStats stats() const;
+        void printStats(std::ostream &os) const;
+
+    private:
+        // Read-only handle to a tiled file that any number of threads can read tiles through at once
+        struct TileFile;
+
+        struct LevelInfo
+        {
+            int width, height;
+            int tilesX, tilesY;
+            size_t offset; // Of the level's first tile in the file
+        };
+
+        struct TiledTexture
+        {
+            fs::path path;
+            TexelFormat format;
+            int tileSize;
+            size_t tileBytes;
+            std::vector<LevelInfo> levels;
+            std::shared_ptr<TileFile> file; // Open for the cache's lifetime
+        };
+
+        struct ResidentTile
+        {
+            std::shared_ptr<const TextureLevel> tile;
+            std::list<uint64_t>::iterator lruPos;
+        };
+
+        uint64_t id; // Tells apart caches in the thread local slots
+        size_t maxBytes;
+        fs::path cacheDir;
+        std::vector<TiledTexture> textures;
+
+        // Everything below is guarded by lock
+        mutable std::mutex lock;
+        mutable std::unordered_map<uint64_t, ResidentTile> resident;
+        mutable std::list<uint64_t> lru; // Most recently used at the front
+        mutable size_t residentBytes = 0;
+        mutable size_t peakBytes = 0;
+        mutable uint64_t misses = 0;
+        mutable uint64_t evictions = 0;
+
+        // Shared with the tiles and the thread local batches, either can outlive the cache
+        std::shared_ptr<TextureCacheCounters> counters;
+
+        // Fills in everything but file, false if path isn't a complete tiled texture
+        static bool readHeader(const fs::path &path, TiledTexture &tex);
+
+        Vector3f texel(int handle, int level, int x, int y) const;
+        const TextureLevel *findTile(uint64_t key) const;
+        std::shared_ptr<const TextureLevel> fetchTile(uint64_t key) const;
+        std::shared_ptr<const TextureLevel> readTile(uint64_t key) const;
+    };
+}
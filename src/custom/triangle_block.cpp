@@ -0,0 +1,201 @@
+#include "triangle_block.h"
+#include "shapes.h"
+#include <cmath>
+#include <algorithm>
+
+using namespace cu_utils;
+
+TriangleBlock::TriangleBlock() : count(0)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++)
+        {
+            v0[a][lane] = 0;
+            e1[a][lane] = 0;
+            e2[a][lane] = 0;
+            v1[a][lane] = 0;
+            v2[a][lane] = 0;
+        }
+    }
+
+    for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++)
+        tris[lane] = nullptr;
+}
+
+void TriangleBlock::add(const Triangle *tri)
+{
+    int lane = count++;
+    tris[lane] = tri;
+
+    Vector3 edge1 = tri->v1 - tri->v0;
+    Vector3 edge2 = tri->v2 - tri->v0;
+
+    // Zero area, leave the edges zeroed so the lane can never hit
+    if (length_squared(cross(edge1, edge2)) == 0)
+        return;
+
+    for (int a = 0; a < 3; a++)
+    {
+        v0[a][lane] = tri->v0[a];
+        e1[a][lane] = edge1[a];
+        e2[a][lane] = edge2[a];
+        v1[a][lane] = tri->v1[a];
+        v2[a][lane] = tri->v2[a];
+    }
+}
+
+int TriangleBlock::intersect(const Ray &ray, Real mint, Real maxt, Real &tOut, Real &uOut, Real &vOut) const
+{
+    if (Triangle::watertight)
+        return intersectWatertight(ray, mint, maxt, tOut, uOut, vOut);
+
+    const Real dx = ray.dir.x, dy = ray.dir.y, dz = ray.dir.z;
+    const Real ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+
+    Real ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+    bool valid[TRI_BLOCK_SIZE];
+
+    // Same math as Triangle::intersect but branchless across lanes so it vectorizes
+    for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++)
+    {
+        Real hx = dy * e2[2][lane] - dz * e2[1][lane];
+        Real hy = dz * e2[0][lane] - dx * e2[2][lane];
+        Real hz = dx * e2[1][lane] - dy * e2[0][lane];
+        Real a = e1[0][lane] * hx + e1[1][lane] * hy + e1[2][lane] * hz;
+        Real f = 1 / a;
+
+        Real sx = ox - v0[0][lane];
+        Real sy = oy - v0[1][lane];
+        Real sz = oz - v0[2][lane];
+        Real u = f * (sx * hx + sy * hy + sz * hz);
+
+        Real qx = sy * e1[2][lane] - sz * e1[1][lane];
+        Real qy = sz * e1[0][lane] - sx * e1[2][lane];
+        Real qz = sx * e1[1][lane] - sy * e1[0][lane];
+        Real v = f * (dx * qx + dy * qy + dz * qz);
+        Real t = f * (e2[0][lane] * qx + e2[1][lane] * qy + e2[2][lane] * qz);
+
+        // NaNs from zeroed lanes fail every comparison
+        valid[lane] = a != 0 && u >= 0 && v >= 0 && u + v <= 1 && t >= mint && t <= maxt;
+        ts[lane] = t;
+        us[lane] = u;
+        vs[lane] = v;
+    }
+
+    return closestLane(valid, ts, us, vs, tOut, uOut, vOut);
+}
+
+int TriangleBlock::closestLane(const bool *valid, const Real *ts, const Real *us, const Real *vs, Real &tOut, Real &uOut, Real &vOut) const
+{
+    int best = -1;
+    for (int lane = 0; lane < count; lane++)
+    {
+        if (valid[lane] && (best < 0 || ts[lane] < ts[best]))
+            best = lane;
+    }
+
+    if (best >= 0)
+    {
+        tOut = ts[best];
+        uOut = us[best];
+        vOut = vs[best];
+    }
+
+    return best;
+}
+
+WatertightRay::WatertightRay(const Ray &ray) : origin(ray.origin)
+{
+    // Largest component of the direction becomes z, swap x and y to keep the winding
+    Vector3 absDir = Vector3{std::abs(ray.dir.x), std::abs(ray.dir.y), std::abs(ray.dir.z)};
+    kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (ray.dir[kz] < 0)
+        std::swap(kx, ky);
+
+    sx = ray.dir[kx] / ray.dir[kz];
+    sy = ray.dir[ky] / ray.dir[kz];
+    sz = 1.0 / ray.dir[kz];
+}
+
+bool WatertightRay::intersect(const Vector3 &p0, const Vector3 &p1, const Vector3 &p2, Real mint, Real maxt, Real &t, Real &u, Real &v) const
+{
+    Vector3 a = p0 - origin;
+    Vector3 b = p1 - origin;
+    Vector3 c = p2 - origin;
+
+    // Shear so the ray runs down z
+    Real ax = a[kx] - sx * a[kz];
+    Real ay = a[ky] - sy * a[kz];
+    Real bx = b[kx] - sx * b[kz];
+    Real by = b[ky] - sy * b[kz];
+    Real cx = c[kx] - sx * c[kz];
+    Real cy = c[ky] - sy * c[kz];
+
+    // Scaled barycentrics, each one is the edge function of the opposite edge
+    Real U = cx * by - cy * bx;
+    Real V = ax * cy - ay * cx;
+    Real W = bx * ay - by * ax;
+
+    // Has to be inside all three edges, either winding. Zero counts as inside.
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+        return false;
+
+    Real det = U + V + W;
+    if (det == 0)
+        return false;
+
+    Real T = U * sz * a[kz] + V * sz * b[kz] + W * sz * c[kz];
+    Real invDet = 1.0 / det;
+    t = T * invDet;
+    if (!(t >= mint && t <= maxt))
+        return false;
+
+    u = V * invDet;
+    v = W * invDet;
+    return true;
+}
+
+int TriangleBlock::intersectWatertight(const Ray &ray, Real mint, Real maxt, Real &tOut, Real &uOut, Real &vOut) const
+{
+    WatertightRay wray(ray);
+    const int kx = wray.kx, ky = wray.ky, kz = wray.kz;
+    const Real sx = wray.sx, sy = wray.sy, sz = wray.sz;
+    const Real ox = ray.origin[kx], oy = ray.origin[ky], oz = ray.origin[kz];
+
+    Real ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+    bool valid[TRI_BLOCK_SIZE];
+
+    // WatertightRay::intersect, lane by lane without branches. Has to be the exact same arithmetic.
+    for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++)
+    {
+        Real az = v0[kz][lane] - oz;
+        Real bz = v1[kz][lane] - oz;
+        Real cz = v2[kz][lane] - oz;
+        Real ax = (v0[kx][lane] - ox) - sx * az;
+        Real ay = (v0[ky][lane] - oy) - sy * az;
+        Real bx = (v1[kx][lane] - ox) - sx * bz;
+        Real by = (v1[ky][lane] - oy) - sy * bz;
+        Real cx = (v2[kx][lane] - ox) - sx * cz;
+        Real cy = (v2[ky][lane] - oy) - sy * cz;
+
+        Real U = cx * by - cy * bx;
+        Real V = ax * cy - ay * cx;
+        Real W = bx * ay - by * ax;
+        Real det = U + V + W;
+
+        Real T = U * sz * az + V * sz * bz + W * sz * cz;
+        Real invDet = 1.0 / det;
+        Real t = T * invDet;
+
+        bool inside = (U >= 0 && V >= 0 && W >= 0) || (U <= 0 && V <= 0 && W <= 0);
+        valid[lane] = inside && det != 0 && t >= mint && t <= maxt;
+        ts[lane] = t;
+        us[lane] = V * invDet;
+        vs[lane] = W * invDet;
+    }
+
+    return closestLane(valid, ts, us, vs, tOut, uOut, vOut);
+}
@@ -0,0 +1,61 @@
+/**
+ * @file triangle_block.h
+ * Triangle data laid out for the BVH leaf kernel.
+ */
+
+#pragma once
+
+#include "ray.h"
+
+namespace cu_utils
+{
+    struct Triangle;
+
+    /**
+     * @brief Per-ray setup for the watertight test (Woop et al. 2013).
+     * Vertices are moved into a space where the ray starts at the origin and runs down +z, so a hit is decided
+     * by 2D edge functions that come out exactly negated for the two triangles sharing an edge. No cracks.
+     *
+     */
+    struct WatertightRay
+    {
+        Vector3 origin;
+        int kx, ky, kz;
+        Real sx, sy, sz;
+
+        WatertightRay(const Ray &ray);
+
+        bool intersect(const Vector3 &p0, const Vector3 &p1, const Vector3 &p2, Real mint, Real maxt, Real &t, Real &u, Real &v) const;
+    };
+
+    constexpr int TRI_BLOCK_SIZE = 4;
+
+    /**
+     * @brief Precomputed Moller-Trumbore data (v0 and both edges) for up to TRI_BLOCK_SIZE triangles.
+     * One lane per triangle so the leaf kernel can test the whole block at once.
+     * The watertight kernel needs the exact vertices, rebuilding them from the edges would reintroduce cracks,
+     * so v1 and v2 are kept as well.
+     * Unused lanes and degenerate triangles are all zeros and never report a hit.
+     *
+     */
+    struct TriangleBlock
+    {
+        Real v0[3][TRI_BLOCK_SIZE];
+        Real e1[3][TRI_BLOCK_SIZE];
+        Real e2[3][TRI_BLOCK_SIZE];
+        Real v1[3][TRI_BLOCK_SIZE];
+        Real v2[3][TRI_BLOCK_SIZE];
+        const Triangle *tris[TRI_BLOCK_SIZE];
+        int count;
+
+        TriangleBlock();
+        void add(const Triangle *tri);
+
+        // Closest hit in [mint, maxt] among the block. Returns the lane that was hit, or -1.
+        int intersect(const Ray &ray, Real mint, Real maxt, Real &t, Real &u, Real &v) const;
+
+    private:
+        int intersectWatertight(const Ray &ray, Real mint, Real maxt, Real &t, Real &u, Real &v) const;
+        int closestLane(const bool *valid, const Real *ts, const Real *us, const Real *vs, Real &t, Real &u, Real &v) const;
+    };
+}
@@ -0,0 +1,290 @@
+#include "wavefront.h"
+#include "renderer.h"
+#include "camera.h"
+#include "scene.h"
+#include "materials.h"
+#include "bounding_box.h"
+#include <algorithm>
+#include "../parallel.h"
+#include "../progressreporter.h"
+#include "../trace.h"
+
+using namespace cu_utils;
+
+// Work per parallel_for task. Kernels are tiny per path so hand them out in batches.
+static const int64_t KERNEL_CHUNK = 1024;
+
+void PathQueue::resize(int size)
+{
+    origin.resize(size);
+    dir.resize(size);
+    rxDir.resize(size);
+    ryDir.resize(size);
+    throughput.resize(size);
+    radiance.resize(size);
+    depth.resize(size);
+    alive.resize(size);
+    rng.resize(size);
+    hit.resize(size);
+}
+
+size_t WavefrontIntegrator::pathStateBytes(int numPixels) const
+{
+    size_t perPath = 6 * sizeof(Vector3) + sizeof(int) + sizeof(uint8_t) + sizeof(pcg32_state) + sizeof(RayHit);
+    // active, sorted and the sort keys
+    perPath += 2 * sizeof(int) + (sortRays ? sizeof(std::pair<uint64_t, int>) : 0);
+    return perPath * std::min(numPixels, maxWaveSize);
+}
+
+WavefrontIntegrator::WavefrontIntegrator(const Renderer &renderer) : renderer(renderer)
+{
+}
+
+void WavefrontIntegrator::render(Image3 &img, const Scene &scene, const BVHNode &objRoot, int seed)
+{
+    Camera cam = CameraBuilder(img.width, img.height)
+                     .setLookFrom(scene.camera.lookfrom)
+                     .setLookAt(scene.camera.lookat)
+                     .setUp(scene.camera.up)
+                     .setFov(scene.camera.vfov)
+                     .build();
+
+    int numPixels = img.width * img.height;
+    int waveSize = std::min(numPixels, maxWaveSize);
+    int numWaves = (numPixels + waveSize - 1) / waveSize;
+    paths.resize(waveSize);
+
+    ProgressReporter reporter(numWaves * renderer.spp, [this]() { return renderer.raysTraced(); });
+
+    for (int wave = 0; wave < numWaves; wave++)
+    {
+        int pixelStart = wave * waveSize;
+        int count = std::min(waveSize, numPixels - pixelStart);
+
+        // One rng stream per pixel, carried over between samples
+        for (int i = 0; i < count; i++)
+            paths.rng[i] = init_pcg32(pixelStart + i, seed);
+
+        for (int sample = 0; sample < renderer.spp; sample++)
+        {
+            generate(cam, img.width, pixelStart, count, sample);
+
+            bool primary = true;
+            while (!active.empty())
+            {
+                {
+                    TraceScope trace("intersect", "render");
+                    intersect(scene, objRoot, primary);
+                }
+                {
+                    TraceScope trace("shade", "render");
+                    shade(scene);
+                }
+                primary = false;
+            }
+
+            accumulate(img, pixelStart, count, sample);
+            reporter.update(1, count);
+        }
+    }
+
+    reporter.done();
+}
+
+void WavefrontIntegrator::generate(const Camera &cam, int width, int pixelStart, int count, int sample)
+{
+    parallel_for([&](int64_t i)
+                 {
+                    int pixel = pixelStart + (int)i;
+                    int x = pixel % width;
+                    int y = pixel / width;
+
+                    // Same as Renderer::renderPixel, shoot through the center if we have 1 spp
+                    Real offX = 0.5, offY = 0.5;
+                    if (renderer.spp != 1)
+                    {
+                        offX = next_pcg32_real<Real>(paths.rng[i]);
+                        offY = next_pcg32_real<Real>(paths.rng[i]);
+                    }
+
+                    Ray ray = cam.ScToWRayDifferential(x + offX, y + offY, renderer.differentialScale());
+                    paths.origin[i] = ray.origin;
+                    paths.dir[i] = ray.dir;
+                    paths.rxDir[i] = ray.rxDir;
+                    paths.ryDir[i] = ray.ryDir;
+                    paths.throughput[i] = Vector3{1, 1, 1};
+                    paths.radiance[i] = Vector3{0, 0, 0};
+                    paths.depth[i] = renderer.maxDepth;
+                    paths.alive[i] = 1; },
+                 count, KERNEL_CHUNK);
+
+    active.resize(count);
+    for (int i = 0; i < count; i++)
+        active[i] = i;
+}
+
+void WavefrontIntegrator::intersect(const Scene &scene, const BVHNode &objRoot, bool primary)
+{
+    // Camera rays come out of generate already coherent
+    if (sortRays && !primary)
+        sortByRayKey(objRoot.box);
+
+    parallel_for([&](int64_t k)
+                 {
+                    int i = active[k];
+
+                    // Directions are already normalized, skip the Ray constructor
+                    Ray ray;
+                    ray.origin = paths.origin[i];
+                    ray.dir = paths.dir[i];
+                    if (primary)
+                    {
+                        ray.hasDifferentials = true;
+                        ray.rxDir = paths.rxDir[i];
+                        ray.ryDir = paths.ryDir[i];
+                    }
+                    if (primary)
+                        STAT_INC(CameraRays);
+                    else
+                        STAT_INC(BounceRays);
+                    paths.hit[i] = renderer.castRay(ray, scene.shapes, objRoot); },
+                 active.size(), KERNEL_CHUNK);
+}
+
+// Spreads the low 10 bits of x out so there are two zero bits between each
+static uint64_t expandBits(uint64_t x)
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+void WavefrontIntegrator::sortByRayKey(const BoundingBox &bounds)
+{
+    Vector3 extent = bounds.maxc - bounds.minc;
+
+    rayKeys.resize(active.size());
+    parallel_for([&](int64_t k)
+                 {
+                    int i = active[k];
+                    const Vector3 &o = paths.origin[i];
+                    const Vector3 &d = paths.dir[i];
+
+                    // Quantize the origin to a 1024^3 grid over the scene
+                    uint64_t morton = 0;
+                    for (int a = 0; a < 3; a++)
+                    {
+                        Real rel = extent[a] > 0 ? (o[a] - bounds.minc[a]) / extent[a] : 0;
+                        uint64_t q = (uint64_t)std::clamp(rel * 1024, Real(0), Real(1023));
+                        morton |= expandBits(q) << a;
+                    }
+
+                    uint64_t octant = (d.x < 0) | ((d.y < 0) << 1) | ((d.z < 0) << 2);
+                    rayKeys[k] = {(octant << 30) | morton, i}; },
+                 active.size(), KERNEL_CHUNK);
+
+    std::sort(rayKeys.begin(), rayKeys.end());
+
+    for (int k = 0; k < (int)active.size(); k++)
+        active[k] = rayKeys[k].second;
+}
+
+void WavefrontIntegrator::sortByMaterial(const Scene &scene)
+{
+    // Counting sort, key 0 is a miss, key 1 is a shape without material
+    int numKeys = scene.materials.size() + 2;
+    std::vector<int> offsets(numKeys + 1, 0);
+
+    auto key = [&](int i)
+    {
+        const RayHit &hit = paths.hit[i];
+        return hit.hit ? hit.sphere->material_id + 2 : 0;
+    };
+
+    for (int i : active)
+        offsets[key(i) + 1]++;
+    for (int k = 0; k < numKeys; k++)
+        offsets[k + 1] += offsets[k];
+
+    sorted.resize(active.size());
+    for (int i : active)
+        sorted[offsets[key(i)]++] = i;
+}
+
+void WavefrontIntegrator::shade(const Scene &scene)
+{
+    sortByMaterial(scene);
+
+    parallel_for([&](int64_t k)
+                 {
+                    int i = sorted[k];
+                    const RayHit &hit = paths.hit[i];
+                    STAT_INC(ShadingCalls);
+
+                    Ray ray;
+                    ray.origin = paths.origin[i];
+                    ray.dir = paths.dir[i];
+
+                    // Mirrors the MATTE_REFLECT branch of Renderer::getPixelColor
+                    if (!hit.hit)
+                    {
+                        Vector3 color = renderer.sampleSkybox(ray.dir, scene.skybox);
+                        if (paths.depth[i] < renderer.maxDepth)
+                            color = color + Vector3{0.2, 0.2, 0.5};
+
+                        paths.radiance[i] += paths.throughput[i] * color;
+                        renderer.endPath(paths.depth[i]);
+                        paths.alive[i] = 0;
+                        return;
+                    }
+
+                    if (hit.sphere->material_id < 0)
+                    {
+                        Vector3 color = hit.sphere->areaLight != nullptr ? hit.sphere->areaLight->intensity : Vector3{1, 0, 0};
+                        paths.radiance[i] += paths.throughput[i] * color;
+                        renderer.endPath(paths.depth[i]);
+                        paths.alive[i] = 0;
+                        return;
+                    }
+
+                    Material *material = scene.materials[hit.sphere->material_id];
+                    Vector3 emitted, weight;
+                    Ray next;
+                    bool bounced = material->sampleBounce(ray, hit, scene, paths.rng[i], paths.depth[i], emitted, weight, next);
+
+                    paths.radiance[i] += paths.throughput[i] * emitted;
+                    if (!bounced)
+                    {
+                        renderer.endPath(paths.depth[i]);
+                        paths.alive[i] = 0;
+                        return;
+                    }
+
+                    paths.throughput[i] *= weight;
+                    paths.origin[i] = next.origin;
+                    paths.dir[i] = next.dir;
+                    paths.depth[i]--; },
+                 sorted.size(), KERNEL_CHUNK);
+
+    // Compact the queue down to the paths that keep going
+    active.clear();
+    for (int i : sorted)
+    {
+        if (paths.alive[i])
+            active.push_back(i);
+    }
+}
+
+void WavefrontIntegrator::accumulate(Image3 &img, int pixelStart, int count, int sample)
+{
+    parallel_for([&](int64_t i)
+                 {
+                    Vector3 &pixel = img(pixelStart + (int)i);
+                    if (sample == 0)
+                        pixel = Vector3{0, 0, 0};
+
+                    pixel += paths.radiance[i] / (Real)renderer.spp; },
+                 count, KERNEL_CHUNK);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file wavefront.h
+ * Wavefront (streaming) path tracer.
+ * Instead of following one path depth-first through Renderer::getPixelColor, every path in flight
+ * lives in flat queues and all of them are advanced one bounce at a time by separate parallel kernels:
+ * generate -> (intersect -> shade)* -> accumulate.
+ */
+
+#pragma once
+
+#include <vector>
+#include "ray.h"
+#include "pcg.h"
+#include "../image.h"
+
+namespace cu_utils
+{
+    class Renderer;
+    class Camera;
+    struct Scene;
+    struct BVHNode;
+    struct BoundingBox;
+
+    /**
+     * @brief Structure-of-arrays state for every path of a wave, indexed by path slot.
+     *
+     */
+    struct PathQueue
+    {
+        std::vector<Vector3> origin;
+        std::vector<Vector3> dir;
+        std::vector<Vector3> rxDir; // Ray differentials, only used by camera rays
+        std::vector<Vector3> ryDir;
+        std::vector<Vector3> throughput;
+        std::vector<Vector3> radiance;
+        std::vector<int> depth;
+        std::vector<uint8_t> alive;
+        std::vector<pcg32_state> rng;
+        std::vector<RayHit> hit;
+
+        void resize(int size);
+        int size() const { return (int)origin.size(); }
+    };
+
+    class WavefrontIntegrator
+    {
+    public:
+        // Max paths in flight, bigger images get rendered over several waves
+        int maxWaveSize = 1 << 20;
+
+        // Sort secondary rays by origin and direction before tracing them so neighbours share BVH nodes
+        bool sortRays = false;
+
+        WavefrontIntegrator(const Renderer &renderer);
+
+        void render(Image3 &img, const Scene &scene, const BVHNode &objRoot, int seed = 0);
+
+        // What the path queues will take for an image this big, for the memory report
+        size_t pathStateBytes(int numPixels) const;
+
+    private:
+        const Renderer &renderer;
+        PathQueue paths;
+
+        // Slots of paths that are still bouncing, and the same slots sorted by material
+        std::vector<int> active;
+        std::vector<int> sorted;
+        std::vector<std::pair<uint64_t, int>> rayKeys;
+
+        void generate(const Camera &cam, int width, int pixelStart, int count, int sample);
+        void intersect(const Scene &scene, const BVHNode &objRoot, bool primary);
+        void shade(const Scene &scene);
+        void accumulate(Image3 &img, int pixelStart, int count, int sample);
+
+        // Groups active paths by the material they hit so shading runs one material at a time
+        void sortByMaterial(const Scene &scene);
+
+        // Reorders the active queue by direction octant, then by Morton code of the origin within bounds
+        void sortByRayKey(const BoundingBox &bounds);
+    };
+}
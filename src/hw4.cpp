@@ -1,28 +1,73 @@
 #include "hw4.h"
 #include "parse_scene.h"
+#include "mesh_cache.h"
 
 #include "custom/scene.h"
 #include "custom/renderer.h"
 
-Image3 hw_4_1(const std::vector<std::string> &params) {
-    // Homework 4.1: diffuse interreflection
-    if (params.size() < 1) {
-        return Image3(0, 0);
-    }
-
+// Flags shared by all of hw4, applied to renderer. Returns the scene filename.
+static std::string setup_renderer(const std::vector<std::string> &params, cu_utils::Renderer &renderer) {
     int max_depth = 50;
+    bool wavefront = false;
+    bool packets = false;
+    bool sort_rays = false;
+    bool watertight = false;
+    bool heatmap = false;
+    bool mem_report = false;
+    int texture_cache_mb = 0;
+    std::string mesh_cache;
+    std::string bvh_cache;
     std::string filename;
     for (int i = 0; i < (int)params.size(); i++) {
         if (params[i] == "-max_depth") {
             max_depth = std::stoi(params[++i]);
+        } else if (params[i] == "-wavefront") {
+            wavefront = true;
+        } else if (params[i] == "-packets") {
+            packets = true;
+        } else if (params[i] == "-sort_rays") {
+            sort_rays = true;
+        } else if (params[i] == "-watertight") {
+            watertight = true;
+        } else if (params[i] == "-heatmap") {
+            heatmap = true;
+        } else if (params[i] == "-mem_report") {
+            mem_report = true;
+        } else if (params[i] == "-texture_cache") {
+            texture_cache_mb = std::stoi(params[++i]);
+        } else if (params[i] == "-mesh_cache") {
+            mesh_cache = params[++i];
+        } else if (params[i] == "-bvh_cache") {
+            bvh_cache = params[++i];
         } else if (filename.empty()) {
             filename = params[i];
         }
     }
 
-    ParsedScene scene = parse_scene(filename);
-    cu_utils::Renderer renderer(cu_utils::Mode::MATTE_REFLECT);
+    mesh_cache_dir = mesh_cache.empty() ? fs::path() : fs::absolute(mesh_cache);
+    if (heatmap) {
+        renderer.mode = cu_utils::Mode::HEATMAP;
+    }
     renderer.maxDepth = max_depth;
+    renderer.wavefront = wavefront;
+    renderer.packets = packets;
+    renderer.sortRays = sort_rays;
+    renderer.memReport = mem_report;
+    renderer.bvhCacheDir = bvh_cache.empty() ? fs::path() : fs::absolute(bvh_cache);
+    cu_utils::Triangle::watertight = watertight;
+    cu_utils::Scene::textureCacheBytes = (size_t)texture_cache_mb << 20;
+    return filename;
+}
+
+Image3 hw_4_1(const std::vector<std::string> &params) {
+    // Homework 4.1: diffuse interreflection
+    if (params.size() < 1) {
+        return Image3(0, 0);
+    }
+
+    cu_utils::Renderer renderer(cu_utils::Mode::MATTE_REFLECT);
+    std::string filename = setup_renderer(params, renderer);
+    ParsedScene scene = parse_scene(filename);
 
     // scene.samples_per_pixel = 5;
     // renderer.maxDepth = 10;
@@ -36,19 +81,9 @@ Image3 hw_4_2(const std::vector<std::string> &params) {
         return Image3(0, 0);
     }
 
-    int max_depth = 50;
-    std::string filename;
-    for (int i = 0; i < (int)params.size(); i++) {
-        if (params[i] == "-max_depth") {
-            max_depth = std::stoi(params[++i]);
-        } else if (filename.empty()) {
-            filename = params[i];
-        }
-    }
-
-    ParsedScene scene = parse_scene(filename);
     cu_utils::Renderer renderer(cu_utils::Mode::MATTE_REFLECT);
-    renderer.maxDepth = max_depth;
+    std::string filename = setup_renderer(params, renderer);
+    ParsedScene scene = parse_scene(filename);
 
     return renderer.render(scene);
 }
@@ -59,19 +94,9 @@ Image3 hw_4_3(const std::vector<std::string> &params) {
         return Image3(0, 0);
     }
 
-    int max_depth = 50;
-    std::string filename;
-    for (int i = 0; i < (int)params.size(); i++) {
-        if (params[i] == "-max_depth") {
-            max_depth = std::stoi(params[++i]);
-        } else if (filename.empty()) {
-            filename = params[i];
-        }
-    }
-
-    ParsedScene scene = parse_scene(filename);
     cu_utils::Renderer renderer(cu_utils::Mode::MATTE_REFLECT);
-    renderer.maxDepth = max_depth;
+    std::string filename = setup_renderer(params, renderer);
+    ParsedScene scene = parse_scene(filename);
 
     return renderer.render(scene);
 }
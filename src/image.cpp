@@ -5,6 +5,7 @@
 #define TINYEXR_IMPLEMENTATION
 #include "3rdparty/tinyexr.h"
 #include "flexception.h"
+#include "trace.h"
 #include <algorithm>
 #include <fstream>
 
@@ -133,6 +134,7 @@ Image3 imread3(const fs::path &filename) {
 }
 
 void imwrite(const fs::path &filename, const Image3 &image) {
+    TraceScope trace("image write");
     if (image.data.empty()) {
         return;
     }
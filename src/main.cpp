@@ -4,6 +4,10 @@
 #include "hw4.h"
 #include "image.h"
 #include "parallel.h"
+#include "perf_counters.h"
+#include "profiler.h"
+#include "trace.h"
+#include <iostream>
 #include <vector>
 #include <string>
 #include <thread>
@@ -12,6 +16,9 @@ int main(int argc, char *argv[])
 {
     std::vector<std::string> parameters;
     std::string hw_num;
+    std::string trace_file;
+    bool perf = false;
+    bool profile = false;
     int num_threads = std::thread::hardware_concurrency();
     for (int i = 1; i < argc; ++i)
     {
@@ -23,6 +30,22 @@ int main(int argc, char *argv[])
         {
             hw_num = std::string(argv[++i]);
         }
+        else if (std::string(argv[i]) == "-trace")
+        {
+            // Chrome trace json of the phases and tiles, open in chrome://tracing or ui.perfetto.dev
+            trace_file = std::string(argv[++i]);
+            trace_enable();
+        }
+        else if (std::string(argv[i]) == "-perf")
+        {
+            // Hardware counters per phase, Linux only
+            perf = true;
+        }
+        else if (std::string(argv[i]) == "-profile")
+        {
+            // Sampling profiler, prints the hottest functions at the end
+            profile = true;
+        }
         else
         {
             parameters.push_back(std::string(argv[i]));
@@ -31,6 +54,12 @@ int main(int argc, char *argv[])
 
     parallel_init(num_threads);
 
+    // After parallel_init so the pool's threads get counters too
+    if (perf)
+        perf_enable();
+    if (profile)
+        profiler_start();
+
     if (hw_num == "1_1")
     {
         Image3 img = hw_1_1(parameters);
@@ -132,6 +161,15 @@ int main(int argc, char *argv[])
         imwrite("hw_4_3.exr", img);
     }
 
+    perf_report(std::cout);
+    profiler_report(std::cout);
+
+    if (!trace_file.empty())
+    {
+        trace_write(trace_file);
+        std::cout << "Wrote trace to " << trace_file << std::endl;
+    }
+
     parallel_cleanup();
 
     return 0;
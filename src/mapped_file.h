@@ -0,0 +1,76 @@
+#pragma once
+
+#include "torrey.h"
+#include "flexception.h"
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// The whole file, read only. Memory mapped where we can, read in one go otherwise.
+class MappedFile {
+public:
+    MappedFile(const fs::path &filename) {
+#ifndef _WINDOWS
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            Error(std::string("Unable to open ") + filename.string());
+        }
+        struct stat st;
+        fstat(fd, &st);
+        size = st.st_size;
+        if (size > 0) {
+            void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                Error(std::string("Unable to map ") + filename.string());
+            }
+            madvise(ptr, size, MADV_SEQUENTIAL);
+            mapped = (const char *)ptr;
+        }
+        close(fd);
+#else
+        std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+        if (!ifs.is_open()) {
+            Error(std::string("Unable to open ") + filename.string());
+        }
+        size = ifs.tellg();
+        buffer.resize(size);
+        ifs.seekg(0);
+        ifs.read(buffer.data(), size);
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WINDOWS
+        if (mapped != nullptr) {
+            munmap((void *)mapped, size);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+#ifndef _WINDOWS
+    const char *data() const { return mapped; }
+#else
+    const char *data() const { return buffer.data(); }
+#endif
+
+    size_t size = 0;
+
+private:
+#ifndef _WINDOWS
+    const char *mapped = nullptr;
+#else
+    std::vector<char> buffer;
+#endif
+};
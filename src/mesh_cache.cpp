@@ -0,0 +1,165 @@
+#include "mesh_cache.h"
+#include "mapped_file.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+fs::path mesh_cache_dir;
+
+static const char c_mesh_cache_magic[8] = {'T', 'O', 'R', 'R', 'E', 'Y', 'M', 'C'};
+static const uint32_t c_mesh_cache_version = 1;
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size; // Caches written with a different Real don't load
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t num_positions;
+    uint64_t num_indices;
+    uint64_t num_normals;
+    uint64_t num_uvs;
+};
+
+// FNV-1a, stable across runs and builds unlike std::hash
+static uint64_t hash_string(const std::string &s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (char c : s) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static bool source_stamp(const fs::path &source, uint64_t &size, int64_t &mtime) {
+    std::error_code ec;
+    size = fs::file_size(source, ec);
+    if (ec) {
+        return false;
+    }
+    mtime = fs::last_write_time(source, ec).time_since_epoch().count();
+    return !ec;
+}
+
+// Buffers start 8 byte aligned so the copies out of the map are aligned too
+static size_t padded(size_t bytes) {
+    return (bytes + 7) & ~size_t(7);
+}
+
+fs::path mesh_cache_path(const fs::path &source, const std::string &variant) {
+    std::string key = fs::absolute(source).lexically_normal().string() + "\n" + variant;
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash_string(key));
+    return mesh_cache_dir / (source.stem().string() + "_" + name + ".torreycache");
+}
+
+template <typename T>
+static const char *copy_buffer(const char *p, uint64_t count, std::vector<T> &out) {
+    out.resize(count);
+    std::memcpy((void *)out.data(), p, count * sizeof(T));
+    return p + padded(count * sizeof(T));
+}
+
+bool load_mesh_cache(const fs::path &cache, const fs::path &source, ParsedTriangleMesh &mesh) {
+    uint64_t size;
+    int64_t mtime;
+    if (!fs::exists(cache) || !source_stamp(source, size, mtime)) {
+        return false;
+    }
+
+    MappedFile file(cache);
+    if (file.size < sizeof(MeshCacheHeader)) {
+        return false;
+    }
+    MeshCacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, c_mesh_cache_magic, sizeof(header.magic)) != 0 ||
+            header.version != c_mesh_cache_version || header.real_size != sizeof(Real) ||
+            header.source_size != size || header.source_mtime != mtime) {
+        return false;
+    }
+
+    // Bound every count by the file size first, so the byte sizes below can't overflow
+    if (header.num_positions > file.size / sizeof(Vector3) || header.num_indices > file.size / sizeof(Vector3i) ||
+            header.num_normals > file.size / sizeof(Vector3) || header.num_uvs > file.size / sizeof(Vector2)) {
+        return false;
+    }
+    size_t expected = padded(sizeof(MeshCacheHeader)) +
+        padded(header.num_positions * sizeof(Vector3)) + padded(header.num_indices * sizeof(Vector3i)) +
+        padded(header.num_normals * sizeof(Vector3)) + padded(header.num_uvs * sizeof(Vector2));
+    if (file.size != expected) {
+        return false;
+    }
+
+    const char *p = file.data() + padded(sizeof(MeshCacheHeader));
+    p = copy_buffer(p, header.num_positions, mesh.positions);
+    p = copy_buffer(p, header.num_indices, mesh.indices);
+    p = copy_buffer(p, header.num_normals, mesh.normals);
+    copy_buffer(p, header.num_uvs, mesh.uvs);
+
+    // Scene indexes positions without checking, so a corrupt index would read past the buffer.
+    // Normals and uvs can legitimately be shorter (corners without vn/vt), so they stay as parsed
+    int64_t num_positions = (int64_t)header.num_positions;
+    for (const Vector3i &index : mesh.indices) {
+        for (int c = 0; c < 3; c++) {
+            if (index[c] < 0 || index[c] >= num_positions) {
+                mesh = ParsedTriangleMesh();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename T>
+static void write_buffer(std::ofstream &out, const std::vector<T> &buffer) {
+    size_t bytes = buffer.size() * sizeof(T);
+    out.write((const char *)buffer.data(), bytes);
+    static const char zeros[8] = {};
+    out.write(zeros, padded(bytes) - bytes);
+}
+
+void save_mesh_cache(const fs::path &cache, const fs::path &source, const ParsedTriangleMesh &mesh) {
+    MeshCacheHeader header = {};
+    std::memcpy(header.magic, c_mesh_cache_magic, sizeof(header.magic));
+    header.version = c_mesh_cache_version;
+    header.real_size = sizeof(Real);
+    if (!source_stamp(source, header.source_size, header.source_mtime)) {
+        return;
+    }
+    header.num_positions = mesh.positions.size();
+    header.num_indices = mesh.indices.size();
+    header.num_normals = mesh.normals.size();
+    header.num_uvs = mesh.uvs.size();
+
+    // The cache is optional, so an unwritable folder or a full disk just means no cache this time
+    std::error_code ec;
+    fs::create_directories(cache.parent_path(), ec);
+    if (ec) {
+        return;
+    }
+    fs::path tmp = cache;
+    tmp += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out) {
+            return;
+        }
+        out.write((const char *)&header, sizeof(header));
+        static const char zeros[8] = {};
+        out.write(zeros, padded(sizeof(header)) - sizeof(header));
+        write_buffer(out, mesh.positions);
+        write_buffer(out, mesh.indices);
+        write_buffer(out, mesh.normals);
+        write_buffer(out, mesh.uvs);
+        out.close();
+        if (!out) {
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+    fs::rename(tmp, cache, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+    }
+}
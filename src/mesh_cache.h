@@ -0,0 +1,23 @@
+#pragma once
+
+#include "torrey.h"
+#include "parse_scene.h"
+#include <filesystem>
+#include <string>
+
+/// Binary cache of loaded meshes (.torreycache files), so repeat renders skip parsing and normal generation.
+/// A cache file holds the final, post-transform mesh buffers and gets reused as long as the source file's
+/// size and modification time still match what's recorded in it.
+
+/// Where cache files go. Empty (the default) turns the cache off.
+extern fs::path mesh_cache_dir;
+
+/// Cache file for a source mesh. variant tells apart different loads of the same file (transform,
+/// shape index, normal settings), anything that changes the resulting buffers has to be in it.
+fs::path mesh_cache_path(const fs::path &source, const std::string &variant);
+
+/// Maps the cache file and copies the buffers out. False if it's missing, stale or not a cache file.
+bool load_mesh_cache(const fs::path &cache, const fs::path &source, ParsedTriangleMesh &mesh);
+
+/// Writes through a temporary file and a rename, so concurrent renders never see half a cache file
+void save_mesh_cache(const fs::path &cache, const fs::path &source, const ParsedTriangleMesh &mesh);
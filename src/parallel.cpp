@@ -4,6 +4,7 @@
 #include <condition_variable>
 #include <vector>
 #include <cassert>
+#include <exception>
 
 // From https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.cpp
 
@@ -26,7 +27,7 @@ static ParallelForLoop *workList = nullptr;
 static std::mutex workListMutex;
 
 struct ParallelForLoop {
-    ParallelForLoop(std::function<void(int)> func1D, int64_t maxIndex, int64_t chunkSize)
+    ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex, int64_t chunkSize)
         : func1D(std::move(func1D)), maxIndex(maxIndex), chunkSize(chunkSize) {
     }
     ParallelForLoop(const std::function<void(Vector2i)> &f, const Vector2i count)
@@ -34,7 +35,7 @@ struct ParallelForLoop {
         nX = count[0];
     }
 
-    std::function<void(int)> func1D;
+    std::function<void(int64_t)> func1D;
     std::function<void(Vector2i)> func2D;
     const int64_t maxIndex;
     const int64_t chunkSize;
@@ -101,7 +102,7 @@ static void worker_thread_func(const int tIndex, std::shared_ptr<Barrier> barrie
             lock.unlock();
             for (int64_t index = indexStart; index < indexEnd; ++index) {
                 if (loop.func1D) {
-                    loop.func1D((int)index);
+                    loop.func1D(index);
                 }
                 // Handle other types of loops
                 else {
@@ -121,12 +122,12 @@ static void worker_thread_func(const int tIndex, std::shared_ptr<Barrier> barrie
     }
 }
 
-void parallel_for(const std::function<void(int)> &func,
+void parallel_for(const std::function<void(int64_t)> &func,
                   int64_t count,
                   int64_t chunkSize) {
     // Run iterations immediately if not using threads or if _count_ is small
     if (threads.empty() || count < chunkSize) {
-        for (int i = 0; i < (int)count; i++) {
+        for (int64_t i = 0; i < count; i++) {
             func(i);
         }
         return;
@@ -162,7 +163,7 @@ void parallel_for(const std::function<void(int)> &func,
         lock.unlock();
         for (int64_t index = indexStart; index < indexEnd; ++index) {
             if (loop.func1D) {
-                loop.func1D((int)index);
+                loop.func1D(index);
             }
             // Handle other types of loops
             else {
@@ -178,6 +179,28 @@ void parallel_for(const std::function<void(int)> &func,
     }
 }
 
+void parallel_for_rethrow(const std::function<void(int64_t)> &func,
+                          int64_t count,
+                          int64_t chunkSize) {
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    parallel_for([&](int64_t i) {
+        try {
+            func(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }, count, chunkSize);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
 thread_local int ThreadIndex;
 
 void parallel_for(std::function<void(Vector2i)> func, const Vector2i count) {
@@ -220,7 +243,7 @@ void parallel_for(std::function<void(Vector2i)> func, const Vector2i count) {
         lock.unlock();
         for (int64_t index = indexStart; index < indexEnd; ++index) {
             if (loop.func1D) {
-                loop.func1D((int)index);
+                loop.func1D(index);
             }
             // Handle other types of loops
             else {
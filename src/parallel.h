@@ -12,5 +12,8 @@ extern thread_local int ThreadIndex;
 void parallel_for(const std::function<void(int64_t)> &func, int64_t count, int64_t chunk_size = 1);
 void parallel_for(std::function<void(Vector2i)> func, const Vector2i count);
 
+// Exceptions can't leave a worker thread, so this one catches them and rethrows the first on the calling thread
+void parallel_for_rethrow(const std::function<void(int64_t)> &func, int64_t count, int64_t chunk_size = 1);
+
 void parallel_init(int num_threads);
 void parallel_cleanup();
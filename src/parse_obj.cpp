@@ -1,203 +1,325 @@
 #include "parse_obj.h"
 #include "flexception.h"
+#include "mapped_file.h"
+#include "parallel.h"
 #include "transform.h"
 
-#include <fstream>
-#include <functional>
-#include <map>
-#include <regex>
+#include <charconv>
+#include <cstring>
 #include <string>
 
-// https://stackoverflow.com/questions/216823/how-to-trim-a-stdstring
-// trim from start
-static inline std::string& ltrim(std::string &s) {
-    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-        return !std::isspace(ch);
-    }));
-    return s;
+// Files get cut into chunks about this big (at line breaks), parsed in parallel, then merged in file order
+static const size_t c_obj_chunk_bytes = 4 << 20;
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
 }
-// trim from end
-static inline std::string& rtrim(std::string &s) {
-    s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
-        return !std::isspace(ch);
-    }).base(), s.end());
-    return s;
+
+static inline const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && is_space(*p)) {
+        p++;
+    }
+    return p;
 }
-// trim from both ends
-static inline std::string &trim(std::string &s) {
-    return ltrim(rtrim(s));
+
+static inline const char *next_line(const char *p, const char *end) {
+    const char *nl = (const char *)std::memchr(p, '\n', end - p);
+    return nl == nullptr ? end : nl + 1;
 }
 
-static std::vector<int> split_face_str(const std::string &s) {
-    std::regex rgx("/");
-    std::sregex_token_iterator first{begin(s), end(s), rgx, -1}, last;
-    std::vector<std::string> list{first, last};
-    std::vector<int> result;
-    for (auto &i : list) {
-        if (i != "")
-            result.push_back(std::stoi(i));
-        else
-            result.push_back(0);
-    }
-    while (result.size() < 3)
-        result.push_back(0);
-
-    return result;
+// from_chars doesn't take a leading '+', obj exporters occasionally write one
+template <typename T>
+static inline bool parse_number(const char *&p, const char *end, T &value) {
+    p = skip_spaces(p, end);
+    if (p < end && *p == '+') {
+        p++;
+    }
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) {
+        return false;
+    }
+    p = result.ptr;
+    return true;
 }
 
-struct ObjVertex {
-    ObjVertex(const std::vector<int> &id) : v(id[0]), vt(id[1]), vn(id[2]) {}
+/// One corner of a face, 0-based pool indices. -1 when the corner leaves out uv or normal.
+struct ObjCorner {
+    int v, vt, vn;
 
-    bool operator<(const ObjVertex &vertex) const {
-        if (v != vertex.v) {
-            return v < vertex.v;
-        }
-        if (vt != vertex.vt) {
-            return vt < vertex.vt;
+    bool operator==(const ObjCorner &c) const {
+        return v == c.v && vt == c.vt && vn == c.vn;
+    }
+};
+
+/// What a chunk of the file parsed into. Pools are local to the chunk until the merge.
+struct ObjChunk {
+    std::vector<Vector3> pos;
+    std::vector<Vector2> st;
+    std::vector<Vector3> nor;
+    std::vector<ObjCorner> corners; // 3 per triangle, quads are already split
+
+    // Negative obj indices point back from wherever the face is, so until we know how many vertices came
+    // before the chunk they're stored relative to its start. Bit 0/1/2 for v/vt/vn.
+    std::vector<std::pair<size_t, uint8_t>> relative;
+};
+
+// Obj indices are 1-based, negative ones count back from the end of the pool so far
+static inline int resolve_index(int raw, size_t pool_size, uint8_t bit, uint8_t &relative) {
+    if (raw > 0) {
+        return raw - 1;
+    }
+    if (raw < 0) {
+        relative |= bit;
+        return (int)pool_size + raw;
+    }
+    return -1;
+}
+
+static ObjCorner parse_corner(const char *&p, const char *end, const ObjChunk &chunk, uint8_t &relative) {
+    int v = 0, vt = 0, vn = 0;
+    if (!parse_number(p, end, v)) {
+        Error("Bad face in the obj file");
+    }
+    if (p < end && *p == '/') {
+        p++;
+        if (p < end && *p != '/') {
+            parse_number(p, end, vt);
         }
-        if (vn != vertex.vn) {
-            return vn < vertex.vn;
+        if (p < end && *p == '/') {
+            p++;
+            parse_number(p, end, vn);
         }
-        return false;
+    }
+    if (v == 0) {
+        Error("Face with a zero vertex index in the obj file");
     }
 
-    int v, vt, vn;
-};
+    relative = 0;
+    return ObjCorner{resolve_index(v, chunk.pos.size(), 1, relative),
+                     resolve_index(vt, chunk.st.size(), 2, relative),
+                     resolve_index(vn, chunk.nor.size(), 4, relative)};
+}
+
+static void parse_chunk(const char *p, const char *end, ObjChunk &chunk) {
+    while (p < end) {
+        const char *line_end = next_line(p, end);
+        const char *q = skip_spaces(p, line_end);
+        p = line_end;
+
+        if (q + 1 >= line_end) {
+            continue;
+        }
+
+        if (q[0] == 'v' && is_space(q[1])) { // vertices
+            q += 2;
+            Real x = 0, y = 0, z = 0, w = 1;
+            parse_number(q, line_end, x);
+            parse_number(q, line_end, y);
+            parse_number(q, line_end, z);
+            parse_number(q, line_end, w);
+            chunk.pos.push_back(Vector3{x, y, z} / w);
+        } else if (q[0] == 'v' && q[1] == 't') {
+            q += 2;
+            Real s = 0, t = 0;
+            parse_number(q, line_end, s);
+            parse_number(q, line_end, t);
+            chunk.st.push_back(Vector2{s, 1 - t});
+        } else if (q[0] == 'v' && q[1] == 'n') {
+            q += 2;
+            Real x = 0, y = 0, z = 0;
+            parse_number(q, line_end, x);
+            parse_number(q, line_end, y);
+            parse_number(q, line_end, z);
+            chunk.nor.push_back(normalize(Vector3{x, y, z}));
+        } else if (q[0] == 'f' && is_space(q[1])) {
+            q++;
+            ObjCorner face[4];
+            uint8_t relative[4];
+            int count = 0;
+            while (true) {
+                q = skip_spaces(q, line_end);
+                if (q >= line_end || *q == '\n' || *q == '#') {
+                    break;
+                }
+                if (count == 4) {
+                    Error("The object file contains n-gon (n>4) that we do not support.");
+                }
+                face[count] = parse_corner(q, line_end, chunk, relative[count]);
+                count++;
+            }
+            if (count < 3) {
+                Error("The object file contains a face with less than 3 vertices.");
+            }
 
-size_t get_vertex_id(const ObjVertex &vertex,
-                     const std::vector<Vector3> &pos_pool,
-                     const std::vector<Vector2> &st_pool,
-                     const std::vector<Vector3> &nor_pool,
-                     const Matrix4x4 &to_world,
-                     std::vector<Vector3> &pos,
-                     std::vector<Vector2> &st,
-                     std::vector<Vector3> &nor,
-                     std::map<ObjVertex, size_t> &vertex_map) {
-    auto it = vertex_map.find(vertex);
-    if (it != vertex_map.end()) {
-        return it->second;
-    }
-    size_t id = pos.size();
-    if (vertex.v > 0) {
-        // 1-based indexing to 0-based
-        pos.push_back(xform_point(to_world, pos_pool[vertex.v - 1]));
-    } else {
-        // From Wikipedia (https://en.wikipedia.org/wiki/Wavefront_.obj_file):
-        // "If an index is negative then it relatively refers to the end of the vertex list, -1 referring to the last element."
-        int v = pos_pool.size() + vertex.v;
-        pos.push_back(xform_point(to_world, pos_pool[v]));
-    }
-    
-    if (vertex.vt > 0) {
-        st.push_back(st_pool[vertex.vt - 1]);
-    } else if (vertex.vt < 0) {
-        int vt = st_pool.size() + vertex.vt;
-        st.push_back(st_pool[vt - 1]);
-    }
-    if (vertex.vn > 0) {
-        nor.push_back(xform_normal(
-            inverse(to_world), nor_pool[vertex.vn - 1]));
-    } else if (vertex.vn < 0) {
-        int vn = nor_pool.size() + vertex.vn;
-        nor.push_back(xform_normal(
-            inverse(to_world), nor_pool[vn]));
-    }
-    vertex_map[vertex] = id;
-    return id;
+            // Quads get split along 0-2
+            const int tris[2][3] = {{0, 1, 2}, {0, 2, 3}};
+            for (int t = 0; t < count - 2; t++) {
+                for (int c : tris[t]) {
+                    if (relative[c] != 0) {
+                        chunk.relative.emplace_back(chunk.corners.size(), relative[c]);
+                    }
+                    chunk.corners.push_back(face[c]);
+                }
+            }
+        } // Currently ignore other tokens
+    }
 }
 
-ParsedTriangleMesh parse_obj(const fs::path &filename, const Matrix4x4 &to_world) {
-    std::vector<Vector3> pos_pool;
-    std::vector<Vector3> nor_pool;
-    std::vector<Vector2> st_pool;
-    std::map<ObjVertex, size_t> vertex_map;
-    ParsedTriangleMesh mesh;
+/// Open addressing table from corner to output vertex id, way cheaper than a std::map per corner
+class VertexTable {
+public:
+    VertexTable(size_t expected) {
+        size_t capacity = 16;
+        while (capacity < expected * 2) {
+            capacity *= 2;
+        }
+        slots.resize(capacity);
+    }
+
+    // Returns the id of the corner, inserting it as next_id if it's new
+    int find_or_insert(const ObjCorner &corner, int next_id) {
+        if ((count + 1) * 2 > slots.size()) {
+            grow();
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(corner) & mask;; i = (i + 1) & mask) {
+            Slot &slot = slots[i];
+            if (slot.id < 0) {
+                slot.corner = corner;
+                slot.id = next_id;
+                count++;
+                return next_id;
+            }
+            if (slot.corner == corner) {
+                return slot.id;
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        ObjCorner corner;
+        int id = -1;
+    };
 
-    std::ifstream ifs(filename.c_str(), std::ifstream::in);
-    if (!ifs.is_open()) {
-        Error("Unable to open the obj file");
+    std::vector<Slot> slots;
+    size_t count = 0;
+
+    static size_t hash(const ObjCorner &c) {
+        uint64_t h = (uint64_t)(uint32_t)c.v * 0x9E3779B97F4A7C15ull;
+        h ^= (uint64_t)(uint32_t)c.vt * 0xC2B2AE3D27D4EB4Full;
+        h ^= (uint64_t)(uint32_t)c.vn * 0x165667B19E3779F9ull;
+        return h ^ (h >> 29);
     }
-    while (ifs.good()) {
-        std::string line;
-        std::getline(ifs, line);
-        line = trim(line);
-        if (line.size() == 0 || line[0] == '#') { // comment
-            continue;
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot &slot : old) {
+            if (slot.id < 0) {
+                continue;
+            }
+            size_t i = hash(slot.corner) & mask;
+            while (slots[i].id >= 0) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = slot;
         }
+    }
+};
 
-        std::stringstream ss(line);
-        std::string token;
-        ss >> token;
-        if (token == "v") {  // vertices
-            Real x, y, z, w = 1;
-            ss >> x >> y >> z >> w;
-            pos_pool.push_back(Vector3{x, y, z} / w);
-        } else if (token == "vt") {
-            Real s, t, w;
-            ss >> s >> t >> w;
-            st_pool.push_back(Vector2{s, 1 - t});
-        } else if (token == "vn") {
-            Real x, y, z;
-            ss >> x >> y >> z;
-            nor_pool.push_back(normalize(Vector3{x, y, z}));
-        } else if (token == "f") {
-            std::string i0, i1, i2;
-            ss >> i0 >> i1 >> i2;
-            std::vector<int> i0f = split_face_str(i0);
-            std::vector<int> i1f = split_face_str(i1);
-            std::vector<int> i2f = split_face_str(i2);
-
-            ObjVertex v0(i0f), v1(i1f), v2(i2f);
-            size_t v0id = get_vertex_id(v0,
-                                        pos_pool,
-                                        st_pool,
-                                        nor_pool,
-                                        to_world,
-                                        mesh.positions,
-                                        mesh.uvs,
-                                        mesh.normals,
-                                        vertex_map);
-            size_t v1id = get_vertex_id(v1,
-                                        pos_pool,
-                                        st_pool,
-                                        nor_pool,
-                                        to_world,
-                                        mesh.positions,
-                                        mesh.uvs,
-                                        mesh.normals,
-                                        vertex_map);
-            size_t v2id = get_vertex_id(v2,
-                                        pos_pool,
-                                        st_pool,
-                                        nor_pool,
-                                        to_world,
-                                        mesh.positions,
-                                        mesh.uvs,
-                                        mesh.normals,
-                                        vertex_map);
-            mesh.indices.push_back(Vector3i{v0id, v1id, v2id});
-
-            std::string i3;
-            if (ss >> i3) {
-                std::vector<int> i3f = split_face_str(i3);
-                ObjVertex v3(i3f);
-                size_t v3id = get_vertex_id(v3,
-                                            pos_pool,
-                                            st_pool,
-                                            nor_pool,
-	                                        to_world,
-	                                        mesh.positions,
-	                                        mesh.uvs,
-	                                        mesh.normals,
-	                                        vertex_map);
-                mesh.indices.push_back(Vector3i{v0id, v2id, v3id});
+ParsedTriangleMesh parse_obj(const char *data, size_t size, const Matrix4x4 &to_world, size_t chunk_bytes) {
+    // Cut at line breaks so no line straddles two chunks
+    std::vector<const char *> cuts{data};
+    const char *end = data + size;
+    while (end - cuts.back() > (std::ptrdiff_t)chunk_bytes) {
+        cuts.push_back(next_line(cuts.back() + chunk_bytes, end));
+    }
+    if (cuts.back() != end) {
+        cuts.push_back(end);
+    }
+
+    int num_chunks = (int)cuts.size() - 1;
+    std::vector<ObjChunk> chunks(std::max(num_chunks, 0));
+    parallel_for_rethrow([&](int64_t i) {
+        parse_chunk(cuts[i], cuts[i + 1], chunks[i]);
+    }, num_chunks);
+
+    // Merge the pools in file order, then rebase the relative indices with what came before each chunk
+    std::vector<Vector3> pos_pool;
+    std::vector<Vector2> st_pool;
+    std::vector<Vector3> nor_pool;
+    std::vector<size_t> corner_start(num_chunks + 1, 0);
+    for (int i = 0; i < num_chunks; i++) {
+        ObjChunk &chunk = chunks[i];
+        for (const auto &[corner, bits] : chunk.relative) {
+            ObjCorner &c = chunk.corners[corner];
+            if (bits & 1) {
+                c.v += (int)pos_pool.size();
+            }
+            if (bits & 2) {
+                c.vt += (int)st_pool.size();
             }
-            std::string i4;
-            if (ss >> i4) {
-                Error("The object file contains n-gon (n>4) that we do not support.");
+            if (bits & 4) {
+                c.vn += (int)nor_pool.size();
+            }
+        }
+        pos_pool.insert(pos_pool.end(), chunk.pos.begin(), chunk.pos.end());
+        st_pool.insert(st_pool.end(), chunk.st.begin(), chunk.st.end());
+        nor_pool.insert(nor_pool.end(), chunk.nor.begin(), chunk.nor.end());
+        corner_start[i + 1] = corner_start[i] + chunk.corners.size();
+        chunk.pos = {};
+        chunk.st = {};
+        chunk.nor = {};
+    }
+
+    // Dedup in file order so vertex ids come out in order of first use
+    VertexTable table(pos_pool.size());
+    std::vector<ObjCorner> vertices;
+    std::vector<int> ids(corner_start.back());
+    for (int i = 0; i < num_chunks; i++) {
+        const std::vector<ObjCorner> &corners = chunks[i].corners;
+        for (size_t j = 0; j < corners.size(); j++) {
+            const ObjCorner &c = corners[j];
+            int id = table.find_or_insert(c, (int)vertices.size());
+            if (id == (int)vertices.size()) {
+                if (c.v < 0 || c.v >= (int)pos_pool.size() ||
+                        c.vt >= (int)st_pool.size() || c.vn >= (int)nor_pool.size() ||
+                        (c.vt < -1) || (c.vn < -1)) {
+                    Error("Face index out of range in the obj file");
+                }
+                vertices.push_back(c);
             }
-        }  // Currently ignore other tokens
+            ids[corner_start[i] + j] = id;
+        }
+    }
+
+    ParsedTriangleMesh mesh;
+    mesh.indices.resize(ids.size() / 3);
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        mesh.indices[i] = Vector3i{ids[3 * i], ids[3 * i + 1], ids[3 * i + 2]};
+    }
+
+    Matrix4x4 normal_xform = inverse(to_world);
+    mesh.positions.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        const ObjCorner &c = vertices[i];
+        mesh.positions[i] = xform_point(to_world, pos_pool[c.v]);
+
+        // Corners without uvs or normals just don't get one
+        if (c.vt >= 0) {
+            mesh.uvs.push_back(st_pool[c.vt]);
+        }
+        if (c.vn >= 0) {
+            mesh.normals.push_back(xform_normal(normal_xform, nor_pool[c.vn]));
+        }
     }
 
     return mesh;
 }
+
+ParsedTriangleMesh parse_obj(const fs::path &filename, const Matrix4x4 &to_world) {
+    MappedFile file(filename);
+    return parse_obj(file.data(), file.size, to_world, c_obj_chunk_bytes);
+}
@@ -8,3 +8,6 @@
 /// Parse Wavefront obj files. Currently only supports triangles and quads.
 /// Throw errors if encountered general polygons.
 ParsedTriangleMesh parse_obj(const fs::path &filename, const Matrix4x4 &to_world);
+
+/// Same, from obj text already in memory. The text is cut into chunk_bytes pieces that get parsed in parallel.
+ParsedTriangleMesh parse_obj(const char *data, size_t size, const Matrix4x4 &to_world, size_t chunk_bytes);
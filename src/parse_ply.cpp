@@ -1,26 +1,107 @@
 #include "parse_ply.h"
 #include "flexception.h"
+#include "mapped_file.h"
+#include "parallel.h"
 #include "transform.h"
 #define TINYPLY_IMPLEMENTATION
 #include "3rdparty/tinyply.h"
 
-#include <fstream>
+#include <istream>
+#include <streambuf>
+
+// Vertices and faces get converted in blocks this big, one block per task
+static const int64_t c_ply_block_size = 64 * 1024;
+
+/// Lets tinyply read straight out of the mapped file instead of copying through an ifstream
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const char *data, size_t size) {
+        char *begin = const_cast<char *>(data);
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+        char *target = dir == std::ios_base::beg ? eback() + off : dir == std::ios_base::cur ? gptr() + off : egptr() + off;
+        if (target < eback() || target > egptr()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), target, egptr());
+        return pos_type(target - eback());
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode mode) override {
+        return seekoff(off_type(pos), std::ios_base::beg, mode);
+    }
+};
+
+// Runs func(begin, end) over [0, count) in blocks, in parallel
+template <typename Func>
+static void parallel_blocks(size_t count, Func func) {
+    int64_t num_blocks = ((int64_t)count + c_ply_block_size - 1) / c_ply_block_size;
+    parallel_for([&](int64_t block) {
+        size_t begin = block * c_ply_block_size;
+        size_t end = std::min(count, (size_t)(begin + c_ply_block_size));
+        func(begin, end);
+    }, num_blocks);
+}
+
+template <typename T>
+static void convert_points(const T *data, std::vector<Vector3> &out, const Matrix4x4 &xform, bool is_normal) {
+    parallel_blocks(out.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            Vector3 v{data[3 * i], data[3 * i + 1], data[3 * i + 2]};
+            out[i] = is_normal ? xform_normal(xform, v) : xform_point(xform, v);
+        }
+    });
+}
+
+template <typename T>
+static void convert_uvs(const T *data, std::vector<Vector2> &out) {
+    parallel_blocks(out.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            out[i] = Vector2{data[2 * i], data[2 * i + 1]};
+        }
+    });
+}
+
+template <typename T>
+static void convert_indices(const T *data, std::vector<Vector3i> &out) {
+    parallel_blocks(out.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            out[i] = Vector3i{data[3 * i], data[3 * i + 1], data[3 * i + 2]};
+        }
+    });
+}
+
+// Positions and normals share the dispatch on the stored type
+static void convert_vectors(tinyply::PlyData &ply, std::vector<Vector3> &out, const Matrix4x4 &xform, bool is_normal) {
+    out.resize(ply.count);
+    if (ply.t == tinyply::Type::FLOAT32) {
+        convert_points((const float *)ply.buffer.get_const(), out, xform, is_normal);
+    } else if (ply.t == tinyply::Type::FLOAT64) {
+        convert_points((const double *)ply.buffer.get_const(), out, xform, is_normal);
+    }
+}
 
 ParsedTriangleMesh parse_ply(const fs::path &filename, const Matrix4x4 &to_world) {
-    std::ifstream ifs(filename, std::ios::binary);
+    MappedFile file(filename);
+    MemoryStreamBuf buf(file.data(), file.size);
+    std::istream is(&buf);
+
     tinyply::PlyFile ply_file;
-    ply_file.parse_header(ifs);
+    ply_file.parse_header(is);
 
     std::shared_ptr<tinyply::PlyData> vertices, uvs, normals, faces;
     try {
-        vertices = ply_file.request_properties_from_element("vertex", { "x", "y", "z" }); 
-    } catch (const std::exception & e) { 
+        vertices = ply_file.request_properties_from_element("vertex", { "x", "y", "z" });
+    } catch (const std::exception & e) {
         Error(std::string("Vertex positions not found in ") + filename.string());
     }
     try {
         uvs = ply_file.request_properties_from_element("vertex", { "u", "v" });
     } catch (const std::exception & e) {
-        // It's fine to not have UVs    
+        // It's fine to not have UVs
     }
     try {
         normals = ply_file.request_properties_from_element("vertex", { "nx", "ny", "nz" });
@@ -28,95 +109,48 @@ ParsedTriangleMesh parse_ply(const fs::path &filename, const Matrix4x4 &to_world
         // It's fine to not have shading normals
     }
     try {
-        faces = ply_file.request_properties_from_element("face", { "vertex_indices" }); 
-    } catch (const std::exception & e) { 
+        // Only triangles are supported anyways. Saying so up front lets tinyply size the buffer
+        // and skip its first pass over the file counting list lengths.
+        faces = ply_file.request_properties_from_element("face", { "vertex_indices" }, 3);
+    } catch (const std::exception & e) {
         Error(std::string("Vertex indices not found in ") + filename.string());
     }
 
-    ply_file.read(ifs);
+    try {
+        ply_file.read(is);
+    } catch (const std::exception &e) {
+        Error(std::string("Failed reading ") + filename.string() + " (only triangle meshes are supported): " + e.what());
+    }
 
     ParsedTriangleMesh mesh;
-    mesh.positions.resize(vertices->count);
-    if (vertices->t == tinyply::Type::FLOAT32) {
-        float *data = (float*)vertices->buffer.get();
-        for (size_t i = 0; i < vertices->count; i++) {
-            mesh.positions[i] = xform_point(to_world,
-                Vector3{data[3 * i], data[3 * i + 1], data[3 * i + 2]});
-        }
-    } else if (vertices->t == tinyply::Type::FLOAT64) {
-        double *data = (double*)vertices->buffer.get();
-        for (size_t i = 0; i < vertices->count; i++) {
-            mesh.positions[i] = xform_point(to_world,
-                Vector3{data[3 * i], data[3 * i + 1], data[3 * i + 2]});
-        }
-    }
+    convert_vectors(*vertices, mesh.positions, to_world, false);
     if (uvs) {
         mesh.uvs.resize(uvs->count);
         if (uvs->t == tinyply::Type::FLOAT32) {
-            float *data = (float*)uvs->buffer.get();
-            for (size_t i = 0; i < uvs->count; i++) {
-                mesh.uvs[i] = Vector2{data[2 * i], data[2 * i + 1]};
-            }
+            convert_uvs((const float *)uvs->buffer.get_const(), mesh.uvs);
         } else if (uvs->t == tinyply::Type::FLOAT64) {
-            double *data = (double*)uvs->buffer.get();
-            for (size_t i = 0; i < uvs->count; i++) {
-                mesh.uvs[i] = Vector2{data[2 * i], data[2 * i + 1]};
-            }
+            convert_uvs((const double *)uvs->buffer.get_const(), mesh.uvs);
         }
     }
     if (normals) {
-        mesh.normals.resize(normals->count);
-        if (normals->t == tinyply::Type::FLOAT32) {
-            float *data = (float*)normals->buffer.get();
-            for (size_t i = 0; i < normals->count; i++) {
-                mesh.normals[i] = xform_normal(inverse(to_world),
-                    Vector3{data[3 * i], data[3 * i + 1], data[3 * i + 2]});
-            }
-        } else if (normals->t == tinyply::Type::FLOAT64) {
-            double *data = (double*)normals->buffer.get();
-            for (size_t i = 0; i < normals->count; i++) {
-                mesh.normals[i] = xform_normal(inverse(to_world),
-                    Vector3{data[3 * i], data[3 * i + 1], data[3 * i + 2]});
-            }
-        }
+        // Inverse once for the whole mesh, not per normal
+        convert_vectors(*normals, mesh.normals, inverse(to_world), true);
     }
+
     mesh.indices.resize(faces->count);
+    const uint8_t *index_data = faces->buffer.get_const();
     if (faces->t == tinyply::Type::INT8) {
-        int8_t *data = (int8_t*)faces->buffer.get();
-        for (size_t i = 0; i < faces->count; i++) {
-            mesh.indices[i] = Vector3i{
-                data[3 * i], data[3 * i + 1], data[3 * i + 2]};
-        }
+        convert_indices((const int8_t *)index_data, mesh.indices);
     } else if (faces->t == tinyply::Type::UINT8) {
-        uint8_t *data = (uint8_t*)faces->buffer.get();
-        for (size_t i = 0; i < faces->count; i++) {
-            mesh.indices[i] = Vector3i{
-                data[3 * i], data[3 * i + 1], data[3 * i + 2]};
-        }
+        convert_indices((const uint8_t *)index_data, mesh.indices);
     } else if (faces->t == tinyply::Type::INT16) {
-        int16_t *data = (int16_t*)faces->buffer.get();
-        for (size_t i = 0; i < faces->count; i++) {
-            mesh.indices[i] = Vector3i{
-                data[3 * i], data[3 * i + 1], data[3 * i + 2]};
-        }
+        convert_indices((const int16_t *)index_data, mesh.indices);
     } else if (faces->t == tinyply::Type::UINT16) {
-        uint16_t *data = (uint16_t*)faces->buffer.get();
-        for (size_t i = 0; i < faces->count; i++) {
-            mesh.indices[i] = Vector3i{
-                data[3 * i], data[3 * i + 1], data[3 * i + 2]};
-        }
+        convert_indices((const uint16_t *)index_data, mesh.indices);
     } else if (faces->t == tinyply::Type::INT32) {
-        int32_t *data = (int32_t*)faces->buffer.get();
-        for (size_t i = 0; i < faces->count; i++) {
-            mesh.indices[i] = Vector3i{
-                data[3 * i], data[3 * i + 1], data[3 * i + 2]};
-        }
+        convert_indices((const int32_t *)index_data, mesh.indices);
     } else if (faces->t == tinyply::Type::UINT32) {
-        uint32_t *data = (uint32_t*)faces->buffer.get();
-        for (size_t i = 0; i < faces->count; i++) {
-            mesh.indices[i] = Vector3i{
-                data[3 * i], data[3 * i + 1], data[3 * i + 2]};
-        }
+        convert_indices((const uint32_t *)index_data, mesh.indices);
     }
 
     return mesh;
@@ -2,11 +2,18 @@
 #include "3rdparty/pugixml.hpp"
 #include "compute_normals.h"
 #include "flexception.h"
+#include "mesh_cache.h"
 #include "parse_obj.h"
 #include "parse_ply.h"
 #include "parse_serialized.h"
+#include "perf_counters.h"
+#include "parallel.h"
+#include "timer.h"
+#include "trace.h"
 #include "transform.h"
+#include <algorithm>
 #include <map>
+#include <memory>
 #include <regex>
 #include <vector>
 
@@ -590,12 +597,136 @@ ParsedLight parse_emitter(pugi::xml_node node,
     }
 }
 
+// Mesh files only get recorded while walking the XML, and are loaded in parallel once the walk is done
+struct MeshLoad {
+    std::string type; // obj, ply or serialized
+    fs::path filename;
+    int shape_index;
+    Matrix4x4 to_world;
+    bool face_normals;
+    int shape_id; // Where the mesh goes in the scene's shapes
+};
+
+// Everything that changes the resulting buffers goes in the cache key
+fs::path mesh_load_cache_path(const MeshLoad &load) {
+    if (mesh_cache_dir.empty()) {
+        return fs::path();
+    }
+    std::string variant = load.type + " " + std::to_string(load.shape_index) + " " + std::to_string(load.face_normals);
+    variant.append((const char *)&load.to_world, sizeof(load.to_world));
+    return mesh_cache_path(load.filename, variant);
+}
+
+// Serialized shapes come in already decompressed, in object space. One that no other load
+// uses is moved out instead of copied.
+ParsedTriangleMesh load_mesh(const MeshLoad &load, ParsedTriangleMesh *serialized_shape, bool shared) {
+    ParsedTriangleMesh mesh;
+    if (load.type == "obj") {
+        mesh = parse_obj(load.filename, load.to_world);
+    } else if (load.type == "ply") {
+        mesh = parse_ply(load.filename, load.to_world);
+    } else {
+        if (shared) {
+            mesh = *serialized_shape;
+        } else {
+            mesh = std::move(*serialized_shape);
+        }
+        transform_serialized(mesh, load.to_world);
+    }
+    if (load.face_normals) {
+        mesh.normals = std::vector<Vector3>{};
+    } else {
+        if (mesh.normals.size() == 0) {
+            mesh.normals = compute_normals(mesh.positions, mesh.indices);
+        }
+    }
+
+    fs::path cache_path = mesh_load_cache_path(load);
+    if (!cache_path.empty()) {
+        save_mesh_cache(cache_path, load.filename, mesh);
+    }
+    return mesh;
+}
+
+void load_meshes(const std::vector<MeshLoad> &mesh_loads, std::vector<ParsedShape> &shapes) {
+    TraceScope trace("load meshes");
+    // The placeholder already has the material and light ids
+    auto place = [&](const MeshLoad &load, ParsedTriangleMesh &&mesh) {
+        ParsedTriangleMesh &placeholder = std::get<ParsedTriangleMesh>(shapes[load.shape_id]);
+        mesh.material_id = placeholder.material_id;
+        mesh.area_light_id = placeholder.area_light_id;
+        placeholder = std::move(mesh);
+    };
+
+    std::vector<char> loaded(mesh_loads.size(), 0);
+    if (!mesh_cache_dir.empty()) {
+        parallel_for_rethrow([&](int64_t i) {
+            ParsedTriangleMesh mesh;
+            if (load_mesh_cache(mesh_load_cache_path(mesh_loads[i]), mesh_loads[i].filename, mesh)) {
+                place(mesh_loads[i], std::move(mesh));
+                loaded[i] = 1;
+            }
+        }, mesh_loads.size());
+    }
+
+    // Scenes tend to pull many shapes out of one serialized file. Each file is opened once and
+    // each shape in it decompressed once, all at the same time, no matter how many entries use it.
+    std::map<fs::path, std::vector<int>> serialized_indices;
+    std::map<std::pair<fs::path, int>, int> serialized_users;
+    for (size_t i = 0; i < mesh_loads.size(); i++) {
+        if (!loaded[i] && mesh_loads[i].type == "serialized") {
+            serialized_users[{mesh_loads[i].filename, mesh_loads[i].shape_index}]++;
+            std::vector<int> &indices = serialized_indices[mesh_loads[i].filename];
+            if (std::find(indices.begin(), indices.end(), mesh_loads[i].shape_index) == indices.end()) {
+                indices.push_back(mesh_loads[i].shape_index);
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<SerializedFile>> serialized_files;
+    std::vector<std::pair<const SerializedFile *, int>> serialized_jobs;
+    for (const auto &[filename, indices] : serialized_indices) {
+        serialized_files.push_back(std::make_unique<SerializedFile>(filename));
+        for (int index : indices) {
+            serialized_jobs.emplace_back(serialized_files.back().get(), index);
+        }
+    }
+
+    std::vector<ParsedTriangleMesh> serialized_shapes(serialized_jobs.size());
+    parallel_for_rethrow([&](int64_t i) {
+        serialized_shapes[i] = serialized_jobs[i].first->load_shape(serialized_jobs[i].second);
+    }, serialized_jobs.size());
+
+    std::map<std::pair<fs::path, int>, ParsedTriangleMesh *> serialized_lookup;
+    size_t job = 0;
+    for (const auto &[filename, indices] : serialized_indices) {
+        for (int index : indices) {
+            serialized_lookup[{filename, index}] = &serialized_shapes[job++];
+        }
+    }
+
+    parallel_for_rethrow([&](int64_t i) {
+        const MeshLoad &load = mesh_loads[i];
+        if (loaded[i]) {
+            return;
+        }
+        ParsedTriangleMesh *serialized_shape = nullptr;
+        bool shared = false;
+        if (load.type == "serialized") {
+            serialized_shape = serialized_lookup.at({load.filename, load.shape_index});
+            shared = serialized_users.at({load.filename, load.shape_index}) > 1;
+        }
+        place(load, load_mesh(load, serialized_shape, shared));
+    }, mesh_loads.size());
+}
+
 ParsedShape parse_shape(pugi::xml_node node,
                         std::vector<ParsedMaterial> &materials,
                         std::map<std::string /* name id */, int /* index id */> &material_map,
                         std::map<std::string /* name id */, ParsedColor> &texture_map,
                         std::vector<ParsedLight> &lights,
                         const std::vector<ParsedShape> &shapes,
+                        std::vector<MeshLoad> &mesh_loads,
                         const std::map<std::string, std::string> &default_map) {
     // First, parse the material inside the shape and get the material ID.
     int material_id = -1;
@@ -630,6 +761,7 @@ ParsedShape parse_shape(pugi::xml_node node,
     std::string type = node.attribute("type").value();
     if (type == "obj") {
         std::string filename;
+        int shape_index = 0;
         Matrix4x4 to_world = Matrix4x4::identity();
         bool face_normals = false;
         for (auto child : node.children()) {
@@ -645,15 +777,8 @@ ParsedShape parse_shape(pugi::xml_node node,
                     child.attribute("value").value(), default_map);
             }
         }
-        shape = parse_obj(filename, to_world);
-        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shape);
-        if (face_normals) {
-            mesh.normals = std::vector<Vector3>{};
-        } else {
-            if (mesh.normals.size() == 0) {
-                mesh.normals = compute_normals(mesh.positions, mesh.indices);
-            }
-        }
+        mesh_loads.push_back(MeshLoad{type, filename, shape_index, to_world, face_normals, (int)shapes.size()});
+        shape = ParsedTriangleMesh{};
     } else if (type == "ply") {
         std::string filename;
         int shape_index = 0;
@@ -674,15 +799,8 @@ ParsedShape parse_shape(pugi::xml_node node,
                     child.attribute("value").value(), default_map);
             }
         }
-        shape = parse_ply(filename, to_world);
-        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shape);
-        if (face_normals) {
-            mesh.normals = std::vector<Vector3>{};
-        } else {
-            if (mesh.normals.size() == 0) {
-                mesh.normals = compute_normals(mesh.positions, mesh.indices);
-            }
-        }
+        mesh_loads.push_back(MeshLoad{type, filename, shape_index, to_world, face_normals, (int)shapes.size()});
+        shape = ParsedTriangleMesh{};
     } else if (type == "serialized") {
         std::string filename;
         int shape_index = 0;
@@ -703,15 +821,8 @@ ParsedShape parse_shape(pugi::xml_node node,
                     child.attribute("value").value(), default_map);
             }
         }
-        shape = parse_serialized(filename, shape_index, to_world);
-        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shape);
-        if (face_normals) {
-            mesh.normals = std::vector<Vector3>{};
-        } else {
-            if (mesh.normals.size() == 0) {
-                mesh.normals = compute_normals(mesh.positions, mesh.indices);
-            }
-        }
+        mesh_loads.push_back(MeshLoad{type, filename, shape_index, to_world, face_normals, (int)shapes.size()});
+        shape = ParsedTriangleMesh{};
     } else if (type == "sphere") {
         Vector3 center{0, 0, 0};
         Real radius = 1;
@@ -810,7 +921,10 @@ ParsedScene parse_scene(pugi::xml_node node) {
     std::map<std::string /* name id */, int /* index id */> material_map;
     Vector3 background_color = Vector3{0.5, 0.5, 0.5};
     int sample_count = 16;
+    std::vector<MeshLoad> mesh_loads;
 
+    Timer timer;
+    tick(timer);
     for (auto child : node.children()) {
         std::string name = child.name();
         if (name == "default") {
@@ -837,6 +951,7 @@ ParsedScene parse_scene(pugi::xml_node node) {
                             texture_map,
                             lights,
                             shapes,
+                            mesh_loads,
                             default_map));
         } else if (name == "texture") {
             std::string id = child.attribute("id").value();
@@ -853,6 +968,13 @@ ParsedScene parse_scene(pugi::xml_node node) {
             }
         }
     }
+    std::cout << "Parsed scene XML in " << tick(timer) << " seconds." << std::endl;
+
+    load_meshes(mesh_loads, shapes);
+    if (mesh_loads.size() > 0) {
+        std::cout << "Loaded " << mesh_loads.size() << " meshes in " << tick(timer) << " seconds." << std::endl;
+    }
+
     return ParsedScene{camera,
                        materials,
                        lights,
@@ -862,6 +984,8 @@ ParsedScene parse_scene(pugi::xml_node node) {
 }
 
 ParsedScene parse_scene(const fs::path &filename) {
+    TraceScope trace("parse scene");
+    PerfScope perf("parse scene");
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(filename.c_str());
     if (!result) {
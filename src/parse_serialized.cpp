@@ -2,14 +2,12 @@
 #include "3rdparty/miniz.h"
 #include "flexception.h"
 #include "transform.h"
-#include <fstream>
+#include <cstring>
 #include <iostream>
 
 #define MTS_FILEFORMAT_VERSION_V3 0x0003
 #define MTS_FILEFORMAT_VERSION_V4 0x0004
 
-#define ZSTREAM_BUFSIZE 32768
-
 enum ETriMeshFlags {
     EHasNormals = 0x0001,
     EHasTexcoords = 0x0002,
@@ -20,32 +18,25 @@ enum ETriMeshFlags {
     EDoublePrecision = 0x2000
 };
 
+/// Inflates one shape's zlib stream. The whole compressed span is already in memory (mapped),
+/// so zlib gets all of it as input at once and writes straight into the caller's buffers.
 class ZStream {
     public:
-    /// Create a new compression stream
-    ZStream(std::fstream &fs);
+    ZStream(const char *begin, const char *end);
     void read(void *ptr, size_t size);
     virtual ~ZStream();
 
     private:
-    std::fstream &fs;
-    size_t fsize;
     z_stream m_inflateStream;
-    uint8_t m_inflateBuffer[ZSTREAM_BUFSIZE];
 };
 
-ZStream::ZStream(std::fstream &fs) : fs(fs) {
-    std::streampos pos = fs.tellg();
-    fs.seekg(0, fs.end);
-    fsize = (size_t)fs.tellg();
-    fs.seekg(pos, fs.beg);
-
+ZStream::ZStream(const char *begin, const char *end) {
     int windowBits = 15;
     m_inflateStream.zalloc = Z_NULL;
     m_inflateStream.zfree = Z_NULL;
     m_inflateStream.opaque = Z_NULL;
-    m_inflateStream.avail_in = 0;
-    m_inflateStream.next_in = Z_NULL;
+    m_inflateStream.next_in = (const unsigned char *)begin;
+    m_inflateStream.avail_in = (uInt)(end - begin);
 
     int retval = inflateInit2(&m_inflateStream, windowBits);
     if (retval != Z_OK) {
@@ -56,18 +47,9 @@ ZStream::ZStream(std::fstream &fs) : fs(fs) {
 void ZStream::read(void *ptr, size_t size) {
     uint8_t *targetPtr = (uint8_t *)ptr;
     while (size > 0) {
-        if (m_inflateStream.avail_in == 0) {
-            size_t remaining = fsize - fs.tellg();
-            m_inflateStream.next_in = m_inflateBuffer;
-            m_inflateStream.avail_in = (uInt)min(remaining, sizeof(m_inflateBuffer));
-            if (m_inflateStream.avail_in == 0) {
-                Error("Read less data than expected");
-            }
-
-            fs.read((char *)m_inflateBuffer, m_inflateStream.avail_in);
-        }
-
-        m_inflateStream.avail_out = (uInt)size;
+        // avail_out is 32 bits, so huge meshes go in a few calls
+        uInt chunk = (uInt)std::min(size, (size_t)1 << 30);
+        m_inflateStream.avail_out = chunk;
         m_inflateStream.next_out = targetPtr;
 
         int retval = inflate(&m_inflateStream, Z_NO_FLUSH);
@@ -86,11 +68,11 @@ void ZStream::read(void *ptr, size_t size) {
             }
         };
 
-        size_t outputSize = size - (size_t)m_inflateStream.avail_out;
+        size_t outputSize = chunk - (size_t)m_inflateStream.avail_out;
         targetPtr += outputSize;
         size -= outputSize;
 
-        if (size > 0 && retval == Z_STREAM_END) {
+        if (size > 0 && (retval == Z_STREAM_END || (outputSize == 0 && m_inflateStream.avail_in == 0))) {
             Error("inflate(): attempting to read past the end of the stream!");
         }
     }
@@ -100,90 +82,92 @@ ZStream::~ZStream() {
     inflateEnd(&m_inflateStream);
 }
 
-void skip_to_idx(std::fstream &fs, const short version, const size_t idx) {
-    // Go to the end of the file to see how many components are there
-    fs.seekg(-sizeof(uint32_t), fs.end);
-    uint32_t count = 0;
-    fs.read((char *)&count, sizeof(uint32_t));
-    size_t offset = 0;
-    if (version == MTS_FILEFORMAT_VERSION_V4) {
-        fs.seekg(-sizeof(uint64_t) * (count - idx) - sizeof(uint32_t), fs.end);
-        fs.read((char *)&offset, sizeof(size_t));
-    } else {  // V3
-        fs.seekg(-sizeof(uint32_t) * (count - idx + 1), fs.end);
-        uint32_t upos = 0;
-        fs.read((char *)&upos, sizeof(unsigned int));
-        offset = upos;
+SerializedFile::SerializedFile(const fs::path &filename) : filename(filename), file(filename) {
+    if (file.size < 2 * sizeof(short) + sizeof(uint32_t)) {
+        Error(std::string("Serialized file is too small: ") + filename.string());
+    }
+    // Format magic number, ignore it
+    std::memcpy(&version, file.data() + sizeof(short), sizeof(short));
+    if (version != MTS_FILEFORMAT_VERSION_V3 && version != MTS_FILEFORMAT_VERSION_V4) {
+        Error(std::string("Unsupported serialized version in ") + filename.string());
     }
-    fs.seekg(offset, fs.beg);
-    // Skip the header
-    fs.ignore(sizeof(short) * 2);
-}
 
-template <typename Precision>
-std::vector<Vector3> load_position(ZStream &zs, int num_vertices) {
-    std::vector<Vector3> vertices(num_vertices);
-    for (int i = 0; i < (int)num_vertices; i++) {
-        Precision x, y, z;
-        zs.read(&x, sizeof(Precision));
-        zs.read(&y, sizeof(Precision));
-        zs.read(&z, sizeof(Precision));
-        vertices[i] = Vector3{x, y, z};
+    // The table at the end holds where every shape starts, followed by the shape count
+    uint32_t count = 0;
+    std::memcpy(&count, file.data() + file.size - sizeof(uint32_t), sizeof(uint32_t));
+    size_t entry_size = version == MTS_FILEFORMAT_VERSION_V4 ? sizeof(uint64_t) : sizeof(uint32_t);
+    if (count == 0 || (size_t)count * entry_size + sizeof(uint32_t) > file.size) {
+        Error(std::string("Bad offset table in ") + filename.string());
+    }
+    table_start = file.size - sizeof(uint32_t) - (size_t)count * entry_size;
+
+    offsets.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        const char *entry = file.data() + table_start + i * entry_size;
+        if (version == MTS_FILEFORMAT_VERSION_V4) {
+            uint64_t offset;
+            std::memcpy(&offset, entry, sizeof(offset));
+            offsets[i] = offset;
+        } else {
+            uint32_t offset;
+            std::memcpy(&offset, entry, sizeof(offset));
+            offsets[i] = offset;
+        }
+        if (offsets[i] + 2 * sizeof(short) > table_start || (i > 0 && offsets[i] <= offsets[i - 1])) {
+            Error(std::string("Bad offset table in ") + filename.string());
+        }
     }
-    return vertices;
 }
 
 template <typename Precision>
-std::vector<Vector3> load_normal(ZStream &zs, int num_vertices) {
-    std::vector<Vector3> normals(num_vertices);
-    for (int i = 0; i < (int)normals.size(); i++) {
-        Precision x, y, z;
-        zs.read(&x, sizeof(Precision));
-        zs.read(&y, sizeof(Precision));
-        zs.read(&z, sizeof(Precision));
-        normals[i] = Vector3{x, y, z};
+static const uint8_t *convert_vec3(const uint8_t *src, std::vector<Vector3> &out, size_t count) {
+    out.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        Precision v[3];
+        std::memcpy(v, src, sizeof(v));
+        src += sizeof(v);
+        out[i] = Vector3{v[0], v[1], v[2]};
     }
-    return normals;
+    return src;
 }
 
 template <typename Precision>
-std::vector<Vector2> load_uv(ZStream &zs, int num_vertices) {
-    std::vector<Vector2> uvs(num_vertices);
-    for (int i = 0; i < (int)uvs.size(); i++) {
-        Precision u, v;
-        zs.read(&u, sizeof(Precision));
-        zs.read(&v, sizeof(Precision));
-        uvs[i] = Vector2{u, v};
+static const uint8_t *convert_vec2(const uint8_t *src, std::vector<Vector2> &out, size_t count) {
+    out.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        Precision v[2];
+        std::memcpy(v, src, sizeof(v));
+        src += sizeof(v);
+        out[i] = Vector2{v[0], v[1]};
     }
-    return uvs;
+    return src;
 }
 
 template <typename Precision>
-std::vector<Vector3> load_color(ZStream &zs, int num_vertices) {
-    std::vector<Vector3> colors(num_vertices);
-    for (int i = 0; i < num_vertices; i++) {
-        Precision r, g, b;
-        zs.read(&r, sizeof(Precision));
-        zs.read(&g, sizeof(Precision));
-        zs.read(&b, sizeof(Precision));
-        colors[i] = Vector3{r, g, b};
+static void convert_shape(const uint8_t *src, uint32_t flags, size_t vertex_count, ParsedTriangleMesh &mesh) {
+    src = convert_vec3<Precision>(src, mesh.positions, vertex_count);
+    if (flags & EHasNormals) {
+        src = convert_vec3<Precision>(src, mesh.normals, vertex_count);
     }
-    return colors;
+    if (flags & EHasTexcoords) {
+        src = convert_vec2<Precision>(src, mesh.uvs, vertex_count);
+    }
+    if (flags & EHasColors) {
+        // Ignore the color attributes.
+        src += 3 * sizeof(Precision) * vertex_count;
+    }
+    static_assert(sizeof(Vector3i) == 3 * sizeof(int));
+    std::memcpy(mesh.indices.data(), src, mesh.indices.size() * sizeof(Vector3i));
 }
 
-ParsedTriangleMesh parse_serialized(const fs::path &filename,
-                                    int shape_index,
-                                    const Matrix4x4 &to_world) {
-    std::fstream fs(filename.c_str(), std::fstream::in | std::fstream::binary);
-    // Format magic number, ignore it
-    fs.ignore(sizeof(short));
-    // Version number
-    short version = 0;
-    fs.read((char *)&version, sizeof(short));
-    if (shape_index > 0) {
-        skip_to_idx(fs, version, shape_index);
+ParsedTriangleMesh SerializedFile::load_shape(int shape_index) const {
+    if (shape_index < 0 || shape_index >= num_shapes()) {
+        Error(std::string("Shape index ") + std::to_string(shape_index) + " out of range in " + filename.string());
     }
-    ZStream zs(fs);
+    // Each shape repeats the magic and version before its stream
+    const char *begin = file.data() + offsets[shape_index] + 2 * sizeof(short);
+    const char *end = file.data() + (shape_index + 1 < num_shapes() ? offsets[shape_index + 1] : table_start);
+    ZStream zs(begin, end);
 
     uint32_t flags;
     zs.read((char *)&flags, sizeof(uint32_t));
@@ -197,60 +181,47 @@ ParsedTriangleMesh parse_serialized(const fs::path &filename,
             name.push_back(c);
         }
     }
-    size_t vertex_count = 0;
-    zs.read((char *)&vertex_count, sizeof(size_t));
-    size_t triangle_count = 0;
-    zs.read((char *)&triangle_count, sizeof(size_t));
+    uint64_t vertex_count = 0;
+    zs.read((char *)&vertex_count, sizeof(uint64_t));
+    uint64_t triangle_count = 0;
+    zs.read((char *)&triangle_count, sizeof(uint64_t));
 
     bool file_double_precision = flags & EDoublePrecision;
     // bool face_normals = flags & EFaceNormals;
 
+    // The counts give the exact size of everything that's left, so it all inflates in one go
+    size_t precision = file_double_precision ? sizeof(double) : sizeof(float);
+    size_t floats_per_vertex = 3 + (flags & EHasNormals ? 3 : 0) + (flags & EHasTexcoords ? 2 : 0) + (flags & EHasColors ? 3 : 0);
+    size_t vertex_bytes = vertex_count * floats_per_vertex * precision;
+    std::vector<uint8_t> payload(vertex_bytes + triangle_count * 3 * sizeof(uint32_t));
+    zs.read(payload.data(), payload.size());
+
     ParsedTriangleMesh mesh;
+    mesh.indices.resize(triangle_count);
     if (file_double_precision) {
-        mesh.positions = load_position<double>(zs, vertex_count);
+        convert_shape<double>(payload.data(), flags, vertex_count, mesh);
     } else {
-        mesh.positions = load_position<float>(zs, vertex_count);
+        convert_shape<float>(payload.data(), flags, vertex_count, mesh);
     }
+    return mesh;
+}
+
+void transform_serialized(ParsedTriangleMesh &mesh, const Matrix4x4 &to_world) {
     for (auto &p : mesh.positions) {
         p = xform_point(to_world, p);
     }
-
-    if (flags & EHasNormals) {
-        if (file_double_precision) {
-            mesh.normals = load_normal<double>(zs, vertex_count);
-        } else {
-            mesh.normals = load_normal<float>(zs, vertex_count);
-        }
+    if (!mesh.normals.empty()) {
+        Matrix4x4 normal_xform = inverse(to_world);
         for (auto &n : mesh.normals) {
-            n = xform_normal(inverse(to_world), n);
-        }
-    }
-
-    if (flags & EHasTexcoords) {
-        if (file_double_precision) {
-            mesh.uvs = load_uv<double>(zs, vertex_count);
-        } else {
-            mesh.uvs = load_uv<float>(zs, vertex_count);
+            n = xform_normal(normal_xform, n);
         }
     }
+}
 
-    if (flags & EHasColors) {
-        // Ignore the color attributes.
-        if (file_double_precision) {
-            load_color<double>(zs, vertex_count);
-        } else {
-            load_color<float>(zs, vertex_count);
-        }
-    }
-
-    mesh.indices.resize(triangle_count);
-    for (size_t i = 0; i < triangle_count; i++) {
-        int i0, i1, i2;
-        zs.read(&i0, sizeof(int));
-        zs.read(&i1, sizeof(int));
-        zs.read(&i2, sizeof(int));
-        mesh.indices[i] = Vector3i{i0, i1, i2};
-    }
-
+ParsedTriangleMesh parse_serialized(const fs::path &filename,
+                                    int shape_index,
+                                    const Matrix4x4 &to_world) {
+    ParsedTriangleMesh mesh = SerializedFile(filename).load_shape(shape_index);
+    transform_serialized(mesh, to_world);
     return mesh;
 }
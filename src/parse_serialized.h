@@ -2,8 +2,32 @@
 
 #include "torrey.h"
 #include "matrix.h"
+#include "mapped_file.h"
 #include "parse_scene.h"
 #include <filesystem>
+#include <vector>
+
+/// A Mitsuba serialized file with its offset table read once. Every shape is its own zlib stream,
+/// so any number of them can be decompressed at the same time from the one mapping.
+class SerializedFile {
+public:
+    SerializedFile(const fs::path &filename);
+
+    int num_shapes() const { return (int)offsets.size(); }
+
+    /// One shape in object space. Thread safe.
+    ParsedTriangleMesh load_shape(int shape_index) const;
+
+private:
+    fs::path filename;
+    MappedFile file;
+    short version = 0;
+    std::vector<size_t> offsets;
+    size_t table_start = 0;
+};
+
+/// Moves a shape from load_shape into world space.
+void transform_serialized(ParsedTriangleMesh &mesh, const Matrix4x4 &to_world);
 
 /// Parse Mitsuba's serialized file format.
 ParsedTriangleMesh parse_serialized(const fs::path &filename,
@@ -0,0 +1,326 @@
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct PerfEventInfo {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+#ifdef __linux__
+static const PerfEventInfo c_perf_events[(int)PerfEvent::Count] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache refs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+#else
+static const PerfEventInfo c_perf_events[(int)PerfEvent::Count] = {
+    {"cycles", 0, 0}, {"instructions", 0, 0}, {"cache refs", 0, 0}, {"cache misses", 0, 0},
+    {"branches", 0, 0}, {"branch misses", 0, 0},
+};
+#endif
+
+using PerfFds = std::array<int, (int)PerfEvent::Count>;
+
+static std::atomic<bool> g_perf_enabled{false};
+static std::mutex g_perf_fds_mutex; // perf_attach_thread appends while other threads read
+static std::vector<PerfFds> g_perf_fds; // One set per thread, -1 where the event couldn't be opened
+static bool g_event_available[(int)PerfEvent::Count] = {};
+static std::chrono::steady_clock::time_point g_perf_start;
+
+static std::mutex g_phases_mutex;
+static std::vector<PerfPhase> g_phases;
+
+double PerfCounts::ipc() const {
+    if (!has(PerfEvent::Cycles) || !has(PerfEvent::Instructions) || (*this)[PerfEvent::Cycles] == 0) {
+        return 0;
+    }
+    return (*this)[PerfEvent::Instructions] / (*this)[PerfEvent::Cycles];
+}
+
+PerfCounts &PerfCounts::operator+=(const PerfCounts &other) {
+    for (int i = 0; i < (int)PerfEvent::Count; i++) {
+        values[i] += other.values[i];
+        available[i] = available[i] || other.available[i];
+    }
+    return *this;
+}
+
+#ifdef __linux__
+static int open_counter(const PerfEventInfo &info, pid_t tid) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = info.type;
+    attr.config = info.config;
+    // User space only, that's all paranoid level 2 allows and all we care about anyways
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // No inherit: it would fold a later thread's counts into its parent's counters when it
+    // exits, on top of what that thread counted itself after perf_attach_thread
+    attr.inherit = 0;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+// Every thread of the process, including the pool's
+static std::vector<pid_t> list_threads() {
+    std::vector<pid_t> tids;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator("/proc/self/task", ec)) {
+        tids.push_back((pid_t)std::stol(entry.path().filename().string()));
+    }
+    if (tids.empty()) {
+        tids.push_back((pid_t)syscall(SYS_gettid));
+    }
+    return tids;
+}
+
+static PerfFds open_counters(pid_t tid, int &first_error) {
+    PerfFds fds;
+    for (int i = 0; i < (int)PerfEvent::Count; i++) {
+        fds[i] = open_counter(c_perf_events[i], tid);
+        if (fds[i] < 0 && first_error == 0) {
+            first_error = errno;
+        }
+    }
+    return fds;
+}
+#endif
+
+bool perf_enable() {
+    if (g_perf_enabled) {
+        return true;
+    }
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(g_perf_fds_mutex);
+    int first_error = 0;
+    for (pid_t tid : list_threads()) {
+        PerfFds fds = open_counters(tid, first_error);
+        for (int i = 0; i < (int)PerfEvent::Count; i++) {
+            g_event_available[i] |= fds[i] >= 0;
+        }
+        g_perf_fds.push_back(fds);
+    }
+
+    bool any = false;
+    for (bool available : g_event_available) {
+        any |= available;
+    }
+    if (!any) {
+        std::cerr << "Hardware counters unavailable (" << std::strerror(first_error)
+                  << "), check /proc/sys/kernel/perf_event_paranoid" << std::endl;
+        for (const PerfFds &fds : g_perf_fds) {
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+        g_perf_fds.clear();
+        return false;
+    }
+    for (int i = 0; i < (int)PerfEvent::Count; i++) {
+        if (!g_event_available[i]) {
+            std::cerr << "Hardware counter " << c_perf_events[i].name << " unavailable" << std::endl;
+        }
+    }
+    g_perf_start = std::chrono::steady_clock::now();
+    g_perf_enabled = true;
+    return true;
+#else
+    std::cerr << "Hardware counters are only supported on Linux" << std::endl;
+    return false;
+#endif
+}
+
+bool perf_enabled() {
+    return g_perf_enabled.load(std::memory_order_relaxed);
+}
+
+bool perf_attach_thread() {
+    if (!perf_enabled()) {
+        return false;
+    }
+#ifdef __linux__
+    int first_error = 0;
+    PerfFds fds = open_counters((pid_t)syscall(SYS_gettid), first_error);
+    // Only events perf_enable managed to open, the report's n/a columns stay as they were
+    for (int i = 0; i < (int)PerfEvent::Count; i++) {
+        if (fds[i] >= 0 && !g_event_available[i]) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+    std::lock_guard<std::mutex> lock(g_perf_fds_mutex);
+    g_perf_fds.push_back(fds);
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::vector<uint64_t> perf_read_raw() {
+    std::lock_guard<std::mutex> lock(g_perf_fds_mutex);
+    // value, time enabled, time running per counter, zeros for the ones that didn't open
+    std::vector<uint64_t> raw(g_perf_fds.size() * (int)PerfEvent::Count * 3, 0);
+#ifdef __linux__
+    if (!perf_enabled()) {
+        return raw;
+    }
+    for (size_t t = 0; t < g_perf_fds.size(); t++) {
+        for (int i = 0; i < (int)PerfEvent::Count; i++) {
+            uint64_t *data = &raw[(t * (int)PerfEvent::Count + i) * 3];
+            if (g_perf_fds[t][i] < 0 || read(g_perf_fds[t][i], data, 3 * sizeof(uint64_t)) != 3 * sizeof(uint64_t)) {
+                data[0] = data[1] = data[2] = 0;
+            }
+        }
+    }
+#endif
+    return raw;
+}
+
+PerfCounts perf_delta(const std::vector<uint64_t> &start, const std::vector<uint64_t> &end) {
+    PerfCounts counts;
+    bool ran[(int)PerfEvent::Count] = {};
+    for (size_t k = 0; k + 2 < end.size(); k += 3) {
+        // Threads attached during the window aren't in start, their counters began at zero within it
+        uint64_t base[3] = {};
+        if (k + 2 < start.size()) {
+            std::copy(&start[k], &start[k] + 3, base);
+        }
+        int event = k / 3 % (int)PerfEvent::Count;
+        double value = (double)(end[k] - base[0]);
+        uint64_t enabled = end[k + 1] - base[1];
+        uint64_t running = end[k + 2] - base[2];
+        // If the kernel had to time-slice the counter, scale up to the whole window
+        if (running > 0 && running < enabled) {
+            value *= (double)enabled / (double)running;
+        }
+        counts.values[event] += value;
+        ran[event] |= running > 0;
+    }
+    // A counter that never got on the PMU during a short phase reads 0, that's unknown rather than none
+    for (int i = 0; i < (int)PerfEvent::Count; i++) {
+        counts.available[i] = g_event_available[i] && ran[i];
+    }
+    return counts;
+}
+
+PerfCounts perf_read() {
+    std::vector<uint64_t> end = perf_read_raw();
+    return perf_delta(std::vector<uint64_t>(end.size(), 0), end);
+}
+
+std::vector<PerfPhase> perf_phases() {
+    std::lock_guard<std::mutex> lock(g_phases_mutex);
+    return g_phases;
+}
+
+void perf_reset_phases() {
+    std::lock_guard<std::mutex> lock(g_phases_mutex);
+    g_phases.clear();
+}
+
+static double seconds_since_start() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - g_perf_start).count();
+}
+
+PerfScope::PerfScope(const char *name) : name(name) {
+    if (perf_enabled()) {
+        active = true;
+        start_seconds = seconds_since_start();
+        start = perf_read_raw();
+    }
+}
+
+PerfScope::~PerfScope() {
+    if (!active) {
+        return;
+    }
+    PerfCounts delta = perf_delta(start, perf_read_raw());
+    double seconds = seconds_since_start() - start_seconds;
+
+    std::lock_guard<std::mutex> lock(g_phases_mutex);
+    auto it = std::find_if(g_phases.begin(), g_phases.end(), [&](const PerfPhase &phase) { return phase.name == name; });
+    if (it == g_phases.end()) {
+        g_phases.push_back(PerfPhase{name});
+        it = g_phases.end() - 1;
+    }
+    it->calls++;
+    it->seconds += seconds;
+    it->counts += delta;
+}
+
+// Counts get big, 1.2G reads better than 1234567890
+static std::string human_count(double count) {
+    const char *suffixes[] = {"", "K", "M", "G", "T"};
+    int s = 0;
+    while (count >= 1000 && s < 4) {
+        count /= 1000;
+        s++;
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(s == 0 ? 0 : 1) << count << suffixes[s];
+    return out.str();
+}
+
+void perf_report(std::ostream &os) {
+    if (!perf_enabled()) {
+        return;
+    }
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+
+    os << "Hardware counters per phase:" << std::endl;
+    os << std::left << std::setw(20) << "  phase" << std::right << std::setw(9) << "seconds" << std::setw(7) << "IPC";
+    for (int i = 0; i < (int)PerfEvent::Count; i++) {
+        if (i != (int)PerfEvent::Instructions) {
+            os << std::setw(14) << c_perf_events[i].name;
+        }
+    }
+    os << std::setw(11) << "miss/ref" << std::setw(12) << "mispredict" << std::endl;
+
+    for (const PerfPhase &phase : perf_phases()) {
+        const PerfCounts &c = phase.counts;
+        os << std::left << std::setw(20) << ("  " + phase.name) << std::right << std::fixed << std::setprecision(3)
+           << std::setw(9) << phase.seconds << std::setprecision(2) << std::setw(7) << c.ipc();
+        for (int i = 0; i < (int)PerfEvent::Count; i++) {
+            if (i != (int)PerfEvent::Instructions) {
+                os << std::setw(14) << (c.available[i] ? human_count(c.values[i]) : "n/a");
+            }
+        }
+        auto percent = [&](PerfEvent a, PerfEvent b) -> std::string {
+            if (!c.has(a) || !c.has(b) || c[b] == 0) {
+                return "n/a";
+            }
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(1) << 100 * c[a] / c[b] << "%";
+            return out.str();
+        };
+        os << std::setw(11) << percent(PerfEvent::CacheMisses, PerfEvent::CacheReferences)
+           << std::setw(12) << percent(PerfEvent::BranchMisses, PerfEvent::Branches) << std::endl;
+    }
+
+    os.flags(flags);
+    os.precision(precision);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "torrey.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Hardware counters (cycles, IPC, cache misses, branch mispredicts) per phase through Linux
+/// perf_event_open. Wall time alone doesn't say why a BVH layout is faster, these do.
+/// Everything is optional: if the kernel says no (perf_event_paranoid, containers, VMs without
+/// a PMU, not Linux) perf_enable returns false and the scopes turn into no-ops.
+
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    CacheReferences,
+    CacheMisses,
+    Branches,
+    BranchMisses,
+    Count // Kept to what fits the PMU at once (two fixed, four general), more and the kernel has to multiplex
+};
+
+struct PerfCounts {
+    double values[(int)PerfEvent::Count] = {};
+    bool available[(int)PerfEvent::Count] = {};
+
+    double operator[](PerfEvent event) const { return values[(int)event]; }
+    bool has(PerfEvent event) const { return available[(int)event]; }
+
+    /// Instructions per cycle, 0 if either counter is missing
+    double ipc() const;
+
+    PerfCounts &operator+=(const PerfCounts &other);
+};
+
+struct PerfPhase {
+    std::string name;
+    int calls = 0;
+    double seconds = 0;
+    PerfCounts counts;
+};
+
+/// Opens counters on every thread of the process that exists right now, so call it after
+/// parallel_init. The pool's threads then count live. A thread started later isn't counted
+/// unless it calls perf_attach_thread.
+/// Returns false and says why on stderr when no counter could be opened.
+bool perf_enable();
+bool perf_enabled();
+
+/// Opens counters for the calling thread, for threads started after perf_enable (the BVH
+/// build). Call it before the work to count. False when counters are off.
+bool perf_attach_thread();
+
+/// Process totals since perf_enable, scaled up if the kernel had to multiplex the counters.
+PerfCounts perf_read();
+
+/// Raw value, time enabled and time running for every open counter. Deltas have to be scaled
+/// over the same window, so scopes keep these instead of PerfCounts.
+std::vector<uint64_t> perf_read_raw();
+PerfCounts perf_delta(const std::vector<uint64_t> &start, const std::vector<uint64_t> &end);
+
+/// Totals per phase name, in the order each phase first showed up
+std::vector<PerfPhase> perf_phases();
+void perf_reset_phases();
+void perf_report(std::ostream &os);
+
+/// Adds the counter deltas between construction and destruction to the named phase.
+/// Counts the whole process, not only the calling thread, so nested phases overlap.
+class PerfScope {
+public:
+    PerfScope(const char *name);
+    ~PerfScope();
+
+    PerfScope(const PerfScope &) = delete;
+    PerfScope &operator=(const PerfScope &) = delete;
+
+private:
+    const char *name;
+    bool active = false;
+    double start_seconds = 0;
+    std::vector<uint64_t> start;
+};
@@ -0,0 +1,409 @@
+#include "profiler.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <csignal>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <spawn.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+// Same slotting as the other per-thread counters, threads outside the pool share slot 0
+static constexpr int PROFILE_SLOTS = 64;
+// A bit over a minute of one thread's CPU time at 1kHz. All slots get allocated and zeroed up front.
+static constexpr size_t SAMPLES_PER_SLOT = 1 << 16;
+
+// The handler claims an entry before it stores the pc, so a signal still in flight when the
+// samples get read can leave a claimed entry unwritten. Entries start at 0 and readers skip those.
+struct alignas(64) ProfileSlot {
+    std::atomic<size_t> count{0};
+    std::unique_ptr<std::atomic<uintptr_t>[]> pcs;
+};
+
+static ProfileSlot g_slots[PROFILE_SLOTS];
+static std::atomic<bool> g_profiling{false};
+static std::atomic<uint64_t> g_dropped{0};
+static int g_hz = 0;
+
+#ifdef __linux__
+static uintptr_t interrupted_pc(void *context) {
+    const ucontext_t *uc = (const ucontext_t *)context;
+#if defined(__x86_64__)
+    return (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+    return (uintptr_t)uc->uc_mcontext.pc;
+#else
+    return 0;
+#endif
+}
+
+// Runs inside the signal, so only lock-free atomics and plain stores in here
+static void on_sigprof(int, siginfo_t *, void *context) {
+    int saved_errno = errno;
+    uintptr_t pc = interrupted_pc(context);
+    ProfileSlot &slot = g_slots[ThreadIndex % PROFILE_SLOTS];
+    if (pc != 0 && slot.pcs) {
+        size_t i = slot.count.fetch_add(1, std::memory_order_relaxed);
+        if (i < SAMPLES_PER_SLOT) {
+            slot.pcs[i].store(pc, std::memory_order_relaxed);
+        } else {
+            g_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    errno = saved_errno;
+}
+#endif
+
+bool profiler_start(int hz) {
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    profiler_stop();
+    for (ProfileSlot &slot : g_slots) {
+        if (!slot.pcs) {
+            slot.pcs.reset(new std::atomic<uintptr_t>[SAMPLES_PER_SLOT]());
+        }
+        size_t used = std::min(slot.count.load(std::memory_order_relaxed), SAMPLES_PER_SLOT);
+        for (size_t i = 0; i < used; i++) {
+            slot.pcs[i].store(0, std::memory_order_relaxed);
+        }
+        slot.count.store(0, std::memory_order_relaxed);
+    }
+    g_dropped = 0;
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sigprof;
+    // Restart so the pool's condition variable waits and file reads don't see EINTR
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+        std::cerr << "Can't install the SIGPROF handler (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+
+    g_hz = std::max(hz, 1);
+    long period_us = std::max(1000000L / g_hz, 1L);
+    itimerval timer;
+    timer.it_interval.tv_sec = period_us / 1000000;
+    timer.it_interval.tv_usec = period_us % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        std::cerr << "Can't start the profiling timer (" << std::strerror(errno) << ")" << std::endl;
+        signal(SIGPROF, SIG_IGN);
+        return false;
+    }
+    g_profiling = true;
+    return true;
+#else
+    std::cerr << "The sampling profiler is only supported on Linux (x86-64 and arm64)" << std::endl;
+    return false;
+#endif
+}
+
+void profiler_stop() {
+#ifdef __linux__
+    if (!g_profiling) {
+        return;
+    }
+    itimerval off = {};
+    setitimer(ITIMER_PROF, &off, nullptr);
+    // Ignore rather than restore the default, a SIGPROF still in flight would kill the process
+    signal(SIGPROF, SIG_IGN);
+    g_profiling = false;
+#endif
+}
+
+bool profiler_running() {
+    return g_profiling;
+}
+
+uint64_t profiler_samples() {
+    uint64_t total = 0;
+    for (const ProfileSlot &slot : g_slots) {
+        total += std::min(slot.count.load(std::memory_order_relaxed), SAMPLES_PER_SLOT);
+    }
+    return total;
+}
+
+uint64_t profiler_dropped() {
+    return g_dropped;
+}
+
+struct Frame {
+    std::string function;
+    std::string location;
+};
+
+// "ns::f(int, float) const" to "ns::f". addr2line only has the bare name for some functions (statics,
+// the outer frame of inlined code), so this keeps the two spellings of one function together.
+// Overloads end up sharing a line, which is fine for finding the hot spot.
+static std::string strip_parameters(const std::string &function) {
+    size_t end = function.find_last_of(')');
+    if (end == std::string::npos || function.find_first_not_of(" const&", end + 1) != std::string::npos) {
+        return function;
+    }
+    int depth = 0;
+    for (size_t i = end + 1; i-- > 0;) {
+        if (function[i] == ')') {
+            depth++;
+        } else if (function[i] == '(' && --depth == 0) {
+            return i > 0 ? function.substr(0, i) : function;
+        }
+    }
+    return function;
+}
+
+#ifdef __linux__
+static std::string demangle(const char *name) {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    std::string out = status == 0 && demangled ? demangled : name;
+    std::free(demangled);
+    return out;
+}
+
+static std::string hex(uintptr_t value) {
+    std::ostringstream out;
+    out << "0x" << std::hex << value;
+    return out.str();
+}
+
+// Only the exported symbols, so for the executable itself this is the last resort
+static Frame dladdr_frame(uintptr_t pc) {
+    Dl_info info;
+    if (!dladdr((void *)pc, &info) || !info.dli_fname) {
+        return Frame{hex(pc), "?"};
+    }
+    std::string module = fs::path(info.dli_fname).filename().string();
+    if (info.dli_sname) {
+        return Frame{demangle(info.dli_sname), module};
+    }
+    // Internal functions of a library have no name here, lump them together per library
+    return Frame{"[" + module + "]", module + "+" + hex(pc - (uintptr_t)info.dli_fbase)};
+}
+
+static int first_module_bias(dl_phdr_info *info, size_t, void *data) {
+    // The executable always comes first
+    *(uintptr_t *)data = info->dlpi_addr;
+    return 1;
+}
+
+// Runs addr2line on the addresses in input (a file, as its stdin) and returns the read end of
+// its stdout, or -1. Spawned directly rather than through a shell, so the path needs no quoting.
+static int spawn_addr2line(const char *exe, int input, pid_t &pid) {
+    int output[2];
+    if (pipe(output) != 0) {
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addclose(&actions, output[0]);
+
+    const char *argv[] = {"addr2line", "-a", "-f", "-i", "-C", "-e", exe, nullptr};
+    int error = posix_spawnp(&pid, "addr2line", &actions, nullptr, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(output[1]);
+    if (error != 0) {
+        close(output[0]);
+        return -1;
+    }
+    return output[0];
+}
+
+// Names the executable's addresses from its debug info. With -a every address starts a new record,
+// and -i lists the inline chain innermost first, so the last function of a record is the real one.
+static void addr2line_frames(const std::vector<uintptr_t> &pcs, std::unordered_map<uintptr_t, Frame> &frames) {
+    char exe[4096];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (length <= 0 || pcs.empty()) {
+        return;
+    }
+    exe[length] = '\0';
+    uintptr_t bias = 0;
+    dl_iterate_phdr(first_module_bias, &bias);
+
+    // A file rather than a pipe for the addresses, addr2line answers as it reads and writing
+    // everything up front would block on its full output pipe. Unlinked right away, only the fd is used.
+    std::string name = (fs::temp_directory_path() / "torrey_profile_XXXXXX").string();
+    int input = mkstemp(name.data());
+    if (input < 0) {
+        return;
+    }
+    unlink(name.c_str());
+
+    std::string addresses;
+    for (uintptr_t pc : pcs) {
+        addresses += hex(pc - bias) + "\n";
+    }
+    bool written = write(input, addresses.data(), addresses.size()) == (ssize_t)addresses.size() &&
+                   lseek(input, 0, SEEK_SET) == 0;
+    pid_t pid = -1;
+    int output = written ? spawn_addr2line(exe, input, pid) : -1;
+    close(input);
+    if (output < 0) {
+        return;
+    }
+    FILE *pipe = fdopen(output, "r");
+    if (!pipe) {
+        close(output);
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+
+    int record = -1;
+    std::string function;
+    bool expect_function = true;
+    char *buffer = nullptr;
+    size_t capacity = 0;
+    ssize_t read;
+    while ((read = getline(&buffer, &capacity, pipe)) > 0) {
+        std::string line(buffer, read);
+        line.erase(line.find_last_not_of("\r\n") + 1);
+        if (line.rfind("0x", 0) == 0) {
+            record++;
+            expect_function = true;
+            continue;
+        }
+        if (record < 0 || record >= (int)pcs.size()) {
+            continue;
+        }
+        if (expect_function) {
+            function = line;
+        } else if (function != "??") {
+            // Keep the file name and line, drop the directory and any "(discriminator n)"
+            std::string location = line.substr(0, line.find(' '));
+            frames[pcs[record]] = Frame{function, fs::path(location).filename().string()};
+        }
+        expect_function = !expect_function;
+    }
+    std::free(buffer);
+    fclose(pipe);
+    waitpid(pid, nullptr, 0);
+}
+
+static std::unordered_map<uintptr_t, Frame> symbolize(const std::vector<uintptr_t> &pcs) {
+    Dl_info self;
+    bool found_self = dladdr((void *)&symbolize, &self) != 0;
+
+    std::vector<uintptr_t> in_exe;
+    for (uintptr_t pc : pcs) {
+        Dl_info info;
+        if (found_self && dladdr((void *)pc, &info) && info.dli_fbase == self.dli_fbase) {
+            in_exe.push_back(pc);
+        }
+    }
+
+    std::unordered_map<uintptr_t, Frame> frames;
+    addr2line_frames(in_exe, frames);
+    // Shared libraries, and anything addr2line couldn't name (no binutils, stripped binary)
+    for (uintptr_t pc : pcs) {
+        if (frames.find(pc) == frames.end()) {
+            frames[pc] = dladdr_frame(pc);
+        }
+    }
+    return frames;
+}
+#endif
+
+std::vector<ProfileEntry> profiler_hot_functions() {
+    profiler_stop();
+
+    std::unordered_map<uintptr_t, uint64_t> counts;
+    for (const ProfileSlot &slot : g_slots) {
+        size_t n = std::min(slot.count.load(std::memory_order_relaxed), SAMPLES_PER_SLOT);
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t pc = slot.pcs[i].load(std::memory_order_relaxed);
+            if (pc != 0) {
+                counts[pc]++;
+            }
+        }
+    }
+    if (counts.empty()) {
+        return {};
+    }
+
+    std::vector<uintptr_t> pcs;
+    for (const auto &[pc, count] : counts) {
+        pcs.push_back(pc);
+    }
+#ifdef __linux__
+    std::unordered_map<uintptr_t, Frame> frames = symbolize(pcs);
+#else
+    std::unordered_map<uintptr_t, Frame> frames;
+#endif
+
+    struct Group {
+        uint64_t samples = 0;
+        std::map<std::string, uint64_t> locations;
+    };
+    std::unordered_map<std::string, Group> groups;
+    for (const auto &[pc, count] : counts) {
+        const Frame &frame = frames[pc];
+        Group &group = groups[strip_parameters(frame.function)];
+        group.samples += count;
+        group.locations[frame.location] += count;
+    }
+
+    std::vector<ProfileEntry> entries;
+    for (const auto &[function, group] : groups) {
+        auto hottest = std::max_element(group.locations.begin(), group.locations.end(),
+                                        [](const auto &a, const auto &b) { return a.second < b.second; });
+        entries.push_back(ProfileEntry{function, hottest->first, group.samples});
+    }
+    std::sort(entries.begin(), entries.end(), [](const ProfileEntry &a, const ProfileEntry &b) {
+        return a.samples > b.samples || (a.samples == b.samples && a.function < b.function);
+    });
+    return entries;
+}
+
+void profiler_report(std::ostream &os, int top) {
+    std::vector<ProfileEntry> entries = profiler_hot_functions();
+    if (entries.empty()) {
+        return;
+    }
+    uint64_t total = 0;
+    for (const ProfileEntry &entry : entries) {
+        total += entry.samples;
+    }
+
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+
+    os << "Hot functions, " << total << " samples at " << g_hz << " Hz (" << std::fixed << std::setprecision(2)
+       << (Real)total / g_hz << "s of CPU):" << std::endl;
+    os << std::setw(8) << "self" << std::setw(10) << "samples" << "  function" << std::endl;
+    for (int i = 0; i < std::min(top, (int)entries.size()); i++) {
+        const ProfileEntry &entry = entries[i];
+        // Template arguments make some of these very long, the start is what tells them apart
+        std::string function = entry.function.size() > 90 ? entry.function.substr(0, 87) + "..." : entry.function;
+        os << std::setw(7) << std::setprecision(1) << 100.0 * entry.samples / total << "%" << std::setw(10) << entry.samples
+           << "  " << function << "  (" << entry.location << ")" << std::endl;
+    }
+    if (profiler_dropped() > 0) {
+        os << "  " << profiler_dropped() << " samples dropped, a thread's buffer filled up" << std::endl;
+    }
+
+    os.flags(flags);
+    os.precision(precision);
+}
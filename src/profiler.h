@@ -0,0 +1,36 @@
+#pragma once
+
+#include "torrey.h"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Built-in sampling profiler, for machines where perf can't be installed. A SIGPROF timer
+/// interrupts whichever thread is burning CPU and the handler drops the interrupted program counter
+/// into that thread's buffer, no locks and no allocation. Samples are only symbolized at the end,
+/// through the binary's debug info (addr2line, falling back to dladdr), and reported as a flat list
+/// of the functions the time was spent in. Inlined code counts towards the function it was inlined into.
+/// Linux only, profiler_start returns false elsewhere.
+
+struct ProfileEntry {
+    std::string function;
+    std::string location; // file:line inside the function that got the most samples
+    uint64_t samples = 0;
+};
+
+/// Samples every 1/hz seconds of CPU time, summed over all threads. Starting again clears old samples.
+bool profiler_start(int hz = 1000);
+void profiler_stop();
+bool profiler_running();
+
+/// Samples taken so far, and the ones that didn't fit in their thread's buffer
+uint64_t profiler_samples();
+uint64_t profiler_dropped();
+
+/// Symbolizes everything recorded, most sampled first. Stops the profiler if it's still running.
+std::vector<ProfileEntry> profiler_hot_functions();
+
+/// Flat top-N report of profiler_hot_functions, nothing if no samples were taken
+void profiler_report(std::ostream &os, int top = 25);
@@ -1,45 +1,109 @@
 #pragma once
 
 #include "torrey.h"
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
 
 /// For printing how much work is done for an operation.
 /// The operations are thread-safe so we can safely use this in multi-thread environment.
+/// Counting is a couple of relaxed atomic adds, no lock. Printing is throttled, whichever thread
+/// wins the compare-exchange on the print time writes the line and everyone else moves on.
 class ProgressReporter {
 public:
-    ProgressReporter(uint64_t total_work) : total_work(total_work), work_done(0) {
-    }
-    void update(uint64_t num) {
-        std::lock_guard<std::mutex> lock(mutex);
-        work_done += num;
-        Real work_ratio = (Real)work_done / (Real)total_work;
-        fprintf(stdout,
-                "\r %.2f Percent Done (%llu / %llu)",
-                work_ratio * Real(100.0),
-                (unsigned long long)work_done,
-                (unsigned long long)total_work);
+    /// rays_traced is only polled when a line gets printed, so it can afford to sum per-thread counters
+    ProgressReporter(uint64_t total_work, std::function<uint64_t()> rays_traced = nullptr)
+        : total_work(total_work), rays_traced(std::move(rays_traced)), start(Clock::now()) {
     }
+
+    /// samples is how many pixel samples the finished work covered, 0 if that doesn't apply
+    void update(uint64_t num, uint64_t samples = 0) {
+        work_done.fetch_add(num, std::memory_order_relaxed);
+        if (samples > 0) {
+            samples_done.fetch_add(samples, std::memory_order_relaxed);
+        }
+
+        int64_t now = nanoseconds();
+        int64_t last = last_print.load(std::memory_order_relaxed);
+        if (now - last < print_interval_ns ||
+                !last_print.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            return;
+        }
+        fprintf(stdout, "\r%s", status().c_str());
+        fflush(stdout);
+    }
+
     void done() {
         work_done = total_work;
-        fprintf(stdout,
-                "\r %.2f Percent Done (%llu / %llu)\n",
-                Real(100.0),
-                (unsigned long long)work_done,
-                (unsigned long long)total_work);
+        fprintf(stdout, "\r%s\n", status().c_str());
     }
+
     uint64_t get_work_done() const {
-        return work_done;
+        return work_done.load(std::memory_order_relaxed);
+    }
+
+    uint64_t get_samples_done() const {
+        return samples_done.load(std::memory_order_relaxed);
+    }
+
+    Real elapsed() const {
+        return nanoseconds() * Real(1e-9);
+    }
+
+    /// The line update and done print: percent, Mrays/s if rays are counted, elapsed and ETA
+    std::string status() const {
+        uint64_t done = get_work_done();
+        Real seconds = elapsed();
+        Real work_ratio = total_work > 0 ? (Real)done / (Real)total_work : Real(1);
+
+        char line[256];
+        int n = snprintf(line, sizeof(line), " %.2f Percent Done (%llu / %llu)", work_ratio * Real(100.0),
+                         (unsigned long long)done, (unsigned long long)total_work);
+        auto append = [&](const char *format, auto value) {
+            if (n >= 0 && n < (int)sizeof(line)) {
+                n += snprintf(line + n, sizeof(line) - n, format, value);
+            }
+        };
+        if (rays_traced && seconds > 0) {
+            append(", %.2f Mrays/s", (Real)rays_traced() / seconds * Real(1e-6));
+        }
+        uint64_t samples = get_samples_done();
+        if (samples > 0) {
+            append(", %llu samples", (unsigned long long)samples);
+        }
+        append(", %.1fs elapsed", seconds);
+        if (done > 0 && done < total_work) {
+            // Assumes the rest goes as fast as what's done so far
+            append(", ETA %.1fs", seconds * (Real)(total_work - done) / (Real)done);
+        }
+        // Pad over whatever a longer previous line left behind
+        append("%s", "    ");
+        return line;
     }
 
 private:
+    using Clock = std::chrono::steady_clock;
+
+    // A few lines a second is plenty to watch, and keeps the fprintf off the hot path
+    static constexpr int64_t print_interval_ns = 250000000;
+
+    int64_t nanoseconds() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
     const uint64_t total_work;
-    uint64_t work_done;
-    std::mutex mutex;
+    std::function<uint64_t()> rays_traced;
+    const Clock::time_point start;
+    std::atomic<uint64_t> work_done{0};
+    std::atomic<uint64_t> samples_done{0};
+    std::atomic<int64_t> last_print{0};
 };
 
 /*
 Example usage:
-ProgressReporter reporter(num_tiles_x * num_tiles_y);
+ProgressReporter reporter(num_tiles_x * num_tiles_y, [&]() { return rays_traced(); });
 parallel_for([&](const Vector2i &tile) {
     // Use a different rng stream for each thread.
     pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
@@ -52,7 +116,7 @@ parallel_for([&](const Vector2i &tile) {
             ...
         }
     }
-    reporter.update(1);
+    reporter.update(1, (x1 - x0) * (y1 - y0) * spp);
 }, Vector2i(num_tiles_x, num_tiles_y));
 reporter.done();
 */
@@ -5,10 +5,26 @@
 #include "../custom/shapes.h"
 #include "../custom/utils.h"
 #include "../custom/sah.h"
+#include "../custom/ray_packet.h"
+#include "../custom/camera.h"
+#include "../custom/pcg.h"
+#include "../custom/bvh_cache.h"
+#include "../custom/render_stats.h"
+#include "../custom/memory_report.h"
+#include "../custom/bvh_analysis.h"
+#include "../custom/scene.h"
+#include <sstream>
 
 
 using namespace cu_utils;
 
+// Frees the shapes a test allocated
+static void freeShapes(std::vector<Shape*> &shapes) {
+    for (Shape *shape : shapes)
+        delete shape;
+    shapes.clear();
+}
+
 // Bounding box tests
 TEST(BoundingBoxTest, CheckHitWithSphere) {
     BoundingBox box(Vector3(-1, -1, -1), Vector3(1, 1, 1));
@@ -243,4 +259,466 @@ TEST(BVHNode, CheckHit) {
     // hit = node.checkHit(ray, 0.0f, std::numeric_limits<float>::infinity());
     // EXPECT_TRUE(hit.hit);
     // EXPECT_NEAR((ray * hit.t).z, 1.0f, 1e-6);
-}
\ No newline at end of file
+}
+TEST(BVHNode, PacketMatchesSingleRay) {
+    // Random cloud of small spheres in front of the camera
+    pcg32_state rng = init_pcg32(7, 7);
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < 2000; i++) {
+        Vector3 center = Vector3(next_pcg32_real<Real>(rng) * 20 - 10, next_pcg32_real<Real>(rng) * 20 - 10, -next_pcg32_real<Real>(rng) * 20 - 5);
+        shapes.push_back(new Sphere(center, 0.1 + next_pcg32_real<Real>(rng) * 0.4, 0));
+    }
+    BVHNode root = BVHNode::buildTree(shapes);
+
+    const int width = 256, height = 256;
+    Camera cam = CameraBuilder(width, height)
+                     .setLookFrom(Vector3(0, 0, 0))
+                     .setLookAt(Vector3(0, 0, -1))
+                     .setUp(Vector3(0, 1, 0))
+                     .setFov(60)
+                     .build();
+
+    std::vector<RayHit> single(width * height);
+    std::vector<RayHit> packed(width * height);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            single[y * width + x] = root.checkHit(cam.ScToWRay(x + 0.5, y + 0.5), 0, std::numeric_limits<Real>::max());
+        }
+    }
+
+    for (int by = 0; by < height; by += PACKET_WIDTH) {
+        for (int bx = 0; bx < width; bx += PACKET_WIDTH) {
+            RayPacket packet;
+            for (int y = by; y < by + PACKET_WIDTH; y++)
+                for (int x = bx; x < bx + PACKET_WIDTH; x++)
+                    packet.add(cam.ScToWRay(x + 0.5, y + 0.5));
+
+            root.checkHitPacket(packet);
+
+            int k = 0;
+            for (int y = by; y < by + PACKET_WIDTH; y++)
+                for (int x = bx; x < bx + PACKET_WIDTH; x++)
+                    packed[y * width + x] = packet.hits[k++];
+        }
+    }
+
+    int numHits = 0;
+    for (int i = 0; i < width * height; i++) {
+        ASSERT_EQ(single[i].hit, packed[i].hit);
+        if (single[i].hit) {
+            EXPECT_EQ(single[i].sphere, packed[i].sphere);
+            EXPECT_NEAR(single[i].t, packed[i].t, 1e-9);
+            numHits++;
+        }
+    }
+    EXPECT_GT(numHits, 0);
+
+    // Shadow packets towards a point light only need to know whether anything is in the way
+    Vector3 light = Vector3(0, 15, -15);
+    for (int by = 0; by < height; by += PACKET_WIDTH) {
+        for (int bx = 0; bx < width; bx += PACKET_WIDTH) {
+            RayPacket packet;
+            packet.anyHit = true;
+            int pixels[PACKET_SIZE];
+            for (int y = by; y < by + PACKET_WIDTH; y++) {
+                for (int x = bx; x < bx + PACKET_WIDTH; x++) {
+                    const RayHit &hit = single[y * width + x];
+                    if (!hit.hit)
+                        continue;
+                    Vector3 p = cam.ScToWRay(x + 0.5, y + 0.5) * hit.t + hit.normal * 1e-4;
+                    pixels[packet.size] = y * width + x;
+                    packet.add(Ray(p, light - p), length(light - p));
+                }
+            }
+
+            root.checkHitPacket(packet);
+
+            for (int k = 0; k < packet.size; k++) {
+                bool occluded = false;
+                for (Shape *shape : shapes) {
+                    RayHit hit = shape->checkHit(packet.rays[k], 0, length(light - packet.rays[k].origin));
+                    occluded = occluded || hit.hit;
+                }
+                EXPECT_EQ(packet.hits[k].hit, occluded) << "pixel " << pixels[k];
+            }
+        }
+    }
+}
+
+TEST(TriangleBlock, MatchesTriangleCheckHit) {
+    pcg32_state rng = init_pcg32(3, 3);
+    auto randomPoint = [&]() {
+        return Vector3(next_pcg32_real<Real>(rng) * 4 - 2, next_pcg32_real<Real>(rng) * 4 - 2, next_pcg32_real<Real>(rng) * 4 - 2);
+    };
+
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < 200; i++)
+        shapes.push_back(new Triangle(randomPoint(), randomPoint(), randomPoint(), 0));
+    BVHNode root = BVHNode::buildTree(shapes);
+
+    for (int i = 0; i < 2000; i++) {
+        Ray ray(Vector3(0, 0, -6), randomPoint() - Vector3(0, 0, -6));
+
+        // Brute force with the scalar test
+        RayHit expected = RayHit();
+        for (Shape *shape : shapes) {
+            RayHit hit = shape->checkHit(ray, 0, std::numeric_limits<Real>::max());
+            if (hit.hit && (!expected.hit || hit.t < expected.t))
+                expected = hit;
+        }
+
+        RayHit hit = root.checkHit(ray, 0, std::numeric_limits<Real>::max());
+        ASSERT_EQ(expected.hit, hit.hit);
+        if (hit.hit) {
+            EXPECT_EQ(expected.sphere, hit.sphere);
+            EXPECT_NEAR(expected.t, hit.t, 1e-9);
+            EXPECT_NEAR(expected.u, hit.u, 1e-9);
+            EXPECT_NEAR(expected.v, hit.v, 1e-9);
+        }
+    }
+}
+
+TEST(BVHNode, OccludedMatchesCheckHit) {
+    pcg32_state rng = init_pcg32(5, 5);
+    auto randomPoint = [&]() {
+        return Vector3(next_pcg32_real<Real>(rng) * 4 - 2, next_pcg32_real<Real>(rng) * 4 - 2, next_pcg32_real<Real>(rng) * 4 - 2);
+    };
+
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < 200; i++)
+        shapes.push_back(new Triangle(randomPoint(), randomPoint(), randomPoint(), 0));
+    for (int i = 0; i < 20; i++)
+        shapes.push_back(new Sphere(randomPoint(), 0.2, 0));
+    BVHNode root = BVHNode::buildTree(shapes);
+
+    int numOccluded = 0;
+    for (int i = 0; i < 2000; i++) {
+        // Short segments so both answers come up
+        Vector3 from = randomPoint();
+        Vector3 to = randomPoint();
+        Ray ray(from, to - from);
+        Real maxt = next_pcg32_real<Real>(rng);
+
+        bool occluded = root.occluded(ray, 0, maxt);
+        ASSERT_EQ(root.checkHit(ray, 0, maxt).hit, occluded);
+        numOccluded += occluded;
+    }
+    EXPECT_GT(numOccluded, 0);
+    EXPECT_LT(numOccluded, 2000);
+}
+
+TEST(BVHNode, CheckHitCostMatchesCheckHit) {
+    pcg32_state rng = init_pcg32(7, 7);
+    auto randomPoint = [&]() {
+        return Vector3(next_pcg32_real<Real>(rng) * 4 - 2, next_pcg32_real<Real>(rng) * 4 - 2, next_pcg32_real<Real>(rng) * 4 - 2);
+    };
+
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < 300; i++)
+        shapes.push_back(new Triangle(randomPoint(), randomPoint(), randomPoint(), 0));
+    BVHNode root = BVHNode::buildTree(shapes);
+
+    for (int i = 0; i < 500; i++) {
+        Vector3 from = randomPoint() * 3.0;
+        Ray ray(from, randomPoint() - from);
+        TraversalCost cost;
+        RayHit counted = root.checkHitCost(ray, 0, 100, cost);
+        RayHit plain = root.checkHit(ray, 0, 100);
+        ASSERT_EQ(counted.hit, plain.hit);
+        if (plain.hit) {
+            ASSERT_EQ(counted.t, plain.t);
+        }
+        ASSERT_GE(cost.nodesVisited, 1);
+        ASSERT_LE(cost.primitivesTested, (int)shapes.size());
+    }
+
+    // Ray that misses the root box only costs the root
+    TraversalCost cost;
+    root.checkHitCost(Ray(Vector3(10.0, 10.0, 10.0), Vector3(1.0, 0.0, 0.0)), 0, 100, cost);
+    EXPECT_EQ(cost.nodesVisited, 1);
+    EXPECT_EQ(cost.primitivesTested, 0);
+
+    freeShapes(shapes);
+}
+
+TEST(MemoryReport, CountsSceneAndBVH) {
+    Scene scene;
+    for (int i = 0; i < 100; i++)
+        scene.shapes.push_back(new Triangle(Vector3((Real)i, 0.0, 0.0), Vector3(i + 1.0, 0.0, 0.0), Vector3((Real)i, 1.0, 0.0), 0));
+    scene.shapes.push_back(new Sphere(Vector3(0.0, 5.0, 0.0), 1.0, 0));
+    BVHNode root = BVHNode::buildTree(scene.shapes);
+
+    // Every shape pointer lives in exactly one leaf, and the tree holds at least that much
+    EXPECT_GE(root.memoryBytes(), scene.shapes.size() * sizeof(Shape *));
+
+    MemoryReport report;
+    report.addScene(scene);
+    report.addBVH(root);
+    report.addFramebuffer(Image3(16, 8));
+
+    EXPECT_EQ(report.numPrimitives, 101);
+    EXPECT_EQ(report[MemCategory::Shapes], scene.shapes.capacity() * sizeof(Shape *) + 100 * sizeof(Triangle) + sizeof(Sphere));
+    EXPECT_EQ(report[MemCategory::BVHNodes], sizeof(BVHNode) + root.memoryBytes());
+    EXPECT_EQ(report[MemCategory::Framebuffers], 16 * 8 * sizeof(Vector3));
+    EXPECT_EQ(report[MemCategory::PathState], 0);
+    EXPECT_EQ(report.total(), report[MemCategory::Shapes] + report[MemCategory::BVHNodes] + report[MemCategory::Framebuffers] +
+                                  report[MemCategory::Textures]);
+
+    std::ostringstream out;
+    report.print(out);
+    EXPECT_NE(out.str().find("101 primitives"), std::string::npos);
+    EXPECT_GT(peakRssBytes(), 0);
+
+    freeShapes(scene.shapes);
+}
+
+TEST(BVHAnalysis, BuildSettingsShapeTheTree) {
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < 200; i++)
+        shapes.push_back(new Triangle(Vector3((Real)i, 0.0, 0.0), Vector3(i + 1.0, 0.0, 0.0), Vector3((Real)i, 1.0, 0.0), 0));
+
+    // Default settings build the same tree as the plain overload
+    BVHQuality defaults = analyzeBVH(BVHNode::buildTree(shapes, BVHBuildSettings()));
+    BVHQuality plain = analyzeBVH(BVHNode::buildTree(shapes));
+    EXPECT_EQ(defaults.numNodes, plain.numNodes);
+    EXPECT_DOUBLE_EQ(defaults.sahCost, plain.sahCost);
+    EXPECT_LE((int)defaults.leavesPerSize.size(), MAX_LEAF_SIZE + 1);
+
+    BVHBuildSettings single;
+    single.maxLeafSize = 1;
+    BVHNode root = BVHNode::buildTree(shapes, single);
+    BVHQuality quality = analyzeBVH(root);
+    EXPECT_EQ(quality.numLeaves, 200);
+    EXPECT_EQ(quality.numNodes, 399);
+    ASSERT_EQ(quality.leavesPerSize.size(), 2);
+    EXPECT_EQ(quality.leavesPerSize[1], 200);
+    EXPECT_DOUBLE_EQ(quality.meanLeafSize, 1);
+    // Side by side triangles, siblings only ever touch
+    EXPECT_NEAR(quality.siblingOverlap, 0, 1e-9);
+    EXPECT_GT(quality.sahCost, defaults.sahCost * 0.5);
+
+    int leaves = 0;
+    for (int count : quality.leavesPerDepth)
+        leaves += count;
+    EXPECT_EQ(leaves, 200);
+
+    BVHBuildSettings median;
+    median.split = BVHSplit::Median;
+    EXPECT_EQ(analyzeBVH(BVHNode::buildTree(shapes, median)).numLeaves, 64); // 200 halved down to 3s and 4s
+
+    // Rays straight down through the strip all hit, rays pointing away all miss
+    std::vector<Ray> rays;
+    for (int i = 0; i < 50; i++)
+        rays.push_back(Ray(Vector3(i * 4 + 0.25, 0.25, 1.0), Vector3(0.0, 0.0, -1.0)));
+    measureRays(root, rays, quality);
+    EXPECT_EQ(quality.numRays, 50);
+    EXPECT_DOUBLE_EQ(quality.hitFraction, 1);
+    EXPECT_GE(quality.primitivesPerRay, 1);
+    EXPECT_GT(quality.nodesPerRay, quality.maxDepth * 0.5);
+
+    for (const Ray &ray : sampleRays(root.box, 100))
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            EXPECT_GE(ray.origin[k], root.box.minc[k]);
+            EXPECT_LE(ray.origin[k], root.box.maxc[k]);
+        }
+        EXPECT_NEAR(length(ray.dir), 1, 1e-9);
+    }
+
+    freeShapes(shapes);
+}
+
+TEST(RenderStats, MergesSlotsAndCountsTraversal) {
+    RenderStats::reset();
+    RenderStats::add(Stat::CameraRays, 3);
+    RenderStats::add(Stat::BounceRays, 2);
+    RenderStats::addPathLength(2);
+    RenderStats::addPathLength(100); // Clamped into the last bucket
+
+    RenderStats stats = RenderStats::merge();
+    EXPECT_EQ(stats[Stat::CameraRays], 3);
+    EXPECT_EQ(stats[Stat::BounceRays], 2);
+    EXPECT_EQ(stats.pathLengths[2], 1);
+    EXPECT_EQ(stats.pathLengths[STATS_MAX_PATH_LENGTH], 1);
+
+    std::ostringstream out;
+    stats.print(out);
+    EXPECT_NE(out.str().find("5 (3 camera, 2 bounce, 0 shadow)"), std::string::npos);
+
+#ifdef TORREY_STATS
+    // Only counted when the macros are compiled in
+    std::vector<Shape*> shapes;
+    shapes.push_back(new Triangle(Vector3(0, 0, 0), Vector3(1, 0, 0), Vector3(0, 1, 0), 0));
+    shapes.push_back(new Triangle(Vector3(0, 0, 5), Vector3(1, 0, 5), Vector3(0, 1, 5), 0));
+    BVHNode root = BVHNode::buildTree(shapes);
+
+    RenderStats::reset();
+    Ray ray(Vector3(0.25, 0.25, -1.0), Vector3(0.0, 0.0, 1.0));
+    root.checkHit(ray, 0, 100);
+    root.occluded(ray, 0, 100);
+    stats = RenderStats::merge();
+    EXPECT_EQ(stats[Stat::ShadowRays], 1);
+    EXPECT_GT(stats[Stat::NodesVisited], 0);
+    EXPECT_GE(stats[Stat::NodesVisited], stats[Stat::BoxesHit]);
+    EXPECT_GT(stats[Stat::PrimitivesTested], 0);
+
+    freeShapes(shapes);
+#endif
+    RenderStats::reset();
+}
+
+TEST(TriangleBlock, DegenerateTriangles) {
+    Ray ray(Vector3(0.25, 0.25, -1.0), Vector3(0.0, 0.0, 1.0));
+
+    // Zero area triangles (collinear or repeated vertices) sitting right in front of the ray
+    Triangle line(Vector3(0.0, 0.0, 0.0), Vector3(0.5, 0.5, 0.0), Vector3(1.0, 1.0, 0.0), 0);
+    Triangle point(Vector3(0.25, 0.25, 0.0), Vector3(0.25, 0.25, 0.0), Vector3(0.25, 0.25, 0.0), 0);
+    EXPECT_FALSE(line.checkHit(ray, 0, 10).hit);
+    EXPECT_FALSE(point.checkHit(ray, 0, 10).hit);
+
+    // Ray running parallel to (and inside the plane of) a regular triangle
+    Triangle flat(Vector3(0.0, 0.0, 0.0), Vector3(1.0, 0.0, 0.0), Vector3(0.0, 1.0, 0.0), 0);
+    Ray grazing(Vector3(-1.0, 0.25, 0.0), Vector3(1.0, 0.0, 0.0));
+    EXPECT_FALSE(flat.checkHit(grazing, 0, 10).hit);
+
+    // A good triangle behind them in the same block still gets hit
+    Triangle behind(Vector3(0.0, 0.0, 1.0), Vector3(1, 0, 1), Vector3(0, 1, 1), 0);
+    TriangleBlock block;
+    block.add(&line);
+    block.add(&point);
+    block.add(&behind);
+
+    Real t, u, v;
+    int lane = block.intersect(ray, 0, 10, t, u, v);
+    EXPECT_EQ(lane, 2);
+    EXPECT_NEAR(t, 2, 1e-9);
+    EXPECT_EQ(block.intersect(grazing, 0, 10, t, u, v), -1);
+}
+
+TEST(TriangleBlock, WatertightSharedEdges) {
+    // Jittered, tilted grid mesh so vertices and edges land on awkward floating point values
+    const int n = 6;
+    pcg32_state rng = init_pcg32(11, 11);
+    std::vector<Vector3> verts((n + 1) * (n + 1));
+    for (int j = 0; j <= n; j++) {
+        for (int i = 0; i <= n; i++) {
+            Real x = i / (Real)n * 2 - 1;
+            Real y = j / (Real)n * 2 - 1;
+            if (i > 0 && i < n && j > 0 && j < n) {
+                x += (next_pcg32_real<Real>(rng) - 0.5) * 0.1;
+                y += (next_pcg32_real<Real>(rng) - 0.5) * 0.1;
+            }
+            verts[j * (n + 1) + i] = Vector3(x, y, 0.3 * x + 0.17 * y + 0.1);
+        }
+    }
+
+    std::vector<Shape*> shapes;
+    std::vector<std::pair<Vector3, Vector3>> sharedEdges;
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+            const Vector3 &a = verts[j * (n + 1) + i];
+            const Vector3 &b = verts[j * (n + 1) + i + 1];
+            const Vector3 &c = verts[(j + 1) * (n + 1) + i];
+            const Vector3 &d = verts[(j + 1) * (n + 1) + i + 1];
+            shapes.push_back(new Triangle(a, b, d, 0));
+            shapes.push_back(new Triangle(a, d, c, 0));
+
+            // The diagonal, and the right and top edges unless they are on the border
+            sharedEdges.push_back({a, d});
+            if (i < n - 1)
+                sharedEdges.push_back({b, d});
+            if (j < n - 1)
+                sharedEdges.push_back({c, d});
+        }
+    }
+    BVHNode root = BVHNode::buildTree(shapes);
+
+    std::vector<Vector3> origins = {
+        Vector3(0.0, 0.0, -3.0),
+        Vector3(0.37, -0.21, -2.3),
+        Vector3(-1.9, 1.3, -0.7),
+        Vector3(0.2, 0.1, 4.0)
+    };
+
+    // Dense sweep of rays aimed straight at every shared edge
+    auto countMisses = [&]() {
+        int misses = 0;
+        for (const Vector3 &origin : origins) {
+            for (const auto &edge : sharedEdges) {
+                for (int s = 1; s < 256; s++) {
+                    Vector3 target = edge.first + (edge.second - edge.first) * (s / 256.0);
+                    Ray ray(origin, target - origin);
+
+                    if (!root.checkHit(ray, 0, std::numeric_limits<Real>::max()).hit)
+                        misses++;
+
+                    bool scalarHit = false;
+                    for (Shape *shape : shapes)
+                        scalarHit = scalarHit || shape->checkHit(ray, 0, std::numeric_limits<Real>::max()).hit;
+                    if (!scalarHit)
+                        misses++;
+                }
+            }
+        }
+        return misses;
+    };
+
+    std::cout << "Moller-Trumbore misses: " << countMisses() << std::endl;
+
+    Triangle::watertight = true;
+    EXPECT_EQ(countMisses(), 0);
+    Triangle::watertight = false;
+}
+
+TEST(BVHCache, ReloadMatchesBuild) {
+    // Mix of triangles and spheres so leaves have both
+    pcg32_state rng = init_pcg32(3, 3);
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < 3000; i++) {
+        Vector3 p = Vector3(next_pcg32_real<Real>(rng) * 20 - 10, next_pcg32_real<Real>(rng) * 20 - 10, -next_pcg32_real<Real>(rng) * 20 - 5);
+        if (i % 5 == 0) {
+            shapes.push_back(new Sphere(p, 0.2, 0));
+        } else {
+            Vector3 d1 = Vector3(next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng));
+            Vector3 d2 = Vector3(next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng));
+            shapes.push_back(new Triangle(p, p + d1, p + d2, 0));
+        }
+    }
+
+    fs::path path = fs::temp_directory_path() / "torrey_bvh_test.torreybvh";
+    BVHNode built = BVHNode::buildTree(shapes);
+    ASSERT_TRUE(saveBVH(built, shapes, path));
+
+    // A cache folder that can't be created skips caching instead of throwing
+    EXPECT_FALSE(saveBVH(built, shapes, path / "sub" / "tree.torreybvh"));
+
+    BVHNode loaded;
+    ASSERT_TRUE(loadBVH(path, shapes, loaded));
+
+    for (int i = 0; i < 2000; i++) {
+        Vector3 dir = normalize(Vector3(next_pcg32_real<Real>(rng) - 0.5, next_pcg32_real<Real>(rng) - 0.5, -1.0));
+        Ray ray(Vector3(0, 0, 0), dir);
+        RayHit a = built.checkHit(ray, 0, std::numeric_limits<Real>::max());
+        RayHit b = loaded.checkHit(ray, 0, std::numeric_limits<Real>::max());
+        ASSERT_EQ(a.hit, b.hit);
+        if (a.hit) {
+            EXPECT_EQ(a.t, b.t);
+        }
+    }
+
+    // A file cut short no longer adds up to its header's counts
+    fs::resize_file(path, fs::file_size(path) - sizeof(int32_t));
+    BVHNode truncated;
+    EXPECT_FALSE(loadBVH(path, shapes, truncated));
+    saveBVH(built, shapes, path);
+
+    // Moving one vertex changes the geometry hash, so the file no longer applies
+    static_cast<Triangle*>(shapes[1])->v0.x += 1e-9;
+    BVHNode stale;
+    EXPECT_FALSE(loadBVH(path, shapes, stale));
+
+    freeShapes(shapes);
+    fs::remove(path);
+}
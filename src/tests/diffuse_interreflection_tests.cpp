@@ -4,6 +4,10 @@
 #include "../custom/shapes.h"
 #include "../custom/utils.h"
 #include "../custom/materials.h"
+#include "../custom/scene.h"
+#include "../custom/renderer.h"
+#include "../flexception.h"
+#include <fstream>
 
 
 using namespace cu_utils;
@@ -69,4 +73,90 @@ TEST(LambertMaterial, Scatter) {
 
     sum = normalize(sum);
     EXPECT_NEAR(dot(sum, hit.normal), 1.0f, 0.01);
-}
\ No newline at end of file
+}
+TEST(Wavefront, MatchesRecursive) {
+    // Two diffuse spheres under a flat skybox
+    Scene scene = Scene::defaultScene();
+    scene.shapes = {
+        new Sphere(Vector3(0, 0, -3), 1, 0),
+        new Sphere(Vector3(0, -101, -3), 100, 0)
+    };
+    scene.skybox = Image3(8, 6);
+    for (Vector3 &texel : scene.skybox.data)
+        texel = Vector3(0.5, 0.5, 0.5);
+
+    Renderer renderer(Mode::MATTE_REFLECT);
+    renderer.spp = 64;
+    renderer.maxDepth = 4;
+
+    Image3 recursive(32, 32);
+    renderer.render(recursive, scene);
+
+    renderer.wavefront = true;
+    Image3 wavefront(32, 32);
+    renderer.render(wavefront, scene);
+
+    // Different random streams, so only compare the converged average
+    Vector3 recursiveSum = Vector3(0, 0, 0), wavefrontSum = Vector3(0, 0, 0);
+    for (int i = 0; i < (int)recursive.data.size(); i++) {
+        recursiveSum += recursive.data[i];
+        wavefrontSum += wavefront.data[i];
+    }
+
+    Real n = recursive.data.size();
+    EXPECT_NEAR(average(recursiveSum) / n, average(wavefrontSum) / n, 0.01);
+}
+
+TEST(Wavefront, SortedRaysMatchUnsorted) {
+    Scene scene = Scene::defaultScene();
+    scene.shapes = {
+        new Sphere(Vector3(-1, 0, -3), 1, 0),
+        new Sphere(Vector3(1, 0, -4), 1, 0),
+        new Sphere(Vector3(0, -101, -3), 100, 0)
+    };
+    scene.skybox = Image3(8, 6);
+    for (Vector3 &texel : scene.skybox.data)
+        texel = Vector3(0.5, 0.5, 0.5);
+
+    Renderer renderer(Mode::MATTE_REFLECT);
+    renderer.spp = 16;
+    renderer.maxDepth = 4;
+    renderer.wavefront = true;
+
+    Image3 unsorted(32, 32);
+    renderer.render(unsorted, scene);
+
+    // Every path owns its rng, so tracing order must not change the image at all
+    renderer.sortRays = true;
+    Image3 sorted(32, 32);
+    renderer.render(sorted, scene);
+
+    for (int i = 0; i < (int)sorted.data.size(); i++) {
+        EXPECT_EQ(unsorted.data[i].x, sorted.data[i].x);
+        EXPECT_EQ(unsorted.data[i].y, sorted.data[i].y);
+        EXPECT_EQ(unsorted.data[i].z, sorted.data[i].z);
+    }
+}
+
+TEST(Renderer, TextureErrorReachesTheCaller) {
+    // The BVH is still building on its own thread when the missing texture throws
+    fs::path dir = fs::temp_directory_path() / "torrey_missing_texture_test";
+    fs::create_directories(dir);
+    {
+        std::ofstream xml(dir / "scene.xml");
+        xml << "<scene version=\"0.5.0\">"
+               "<sensor type=\"perspective\"><film type=\"hdrfilm\"><integer name=\"width\" value=\"8\"/>"
+               "<integer name=\"height\" value=\"8\"/></film></sensor>"
+               "<bsdf type=\"diffuse\" id=\"mat\"><texture type=\"bitmap\" name=\"reflectance\">"
+               "<string name=\"filename\" value=\"no_such_texture.png\"/></texture></bsdf>"
+               "<shape type=\"sphere\"><point name=\"center\" x=\"0\" y=\"0\" z=\"-3\"/><float name=\"radius\" value=\"1\"/>"
+               "<ref id=\"mat\"/></shape>"
+               "</scene>";
+    }
+    ParsedScene parsed = parse_scene(dir / "scene.xml");
+
+    Renderer renderer(Mode::MATTE_REFLECT);
+    EXPECT_THROW(renderer.render(parsed), fl_exception);
+
+    fs::remove_all(dir);
+}
@@ -0,0 +1,301 @@
+#include <gtest/gtest.h>
+#include "../parse_obj.h"
+#include "../mesh_cache.h"
+#include "../parse_ply.h"
+#include "../parse_serialized.h"
+#include "../3rdparty/miniz.h"
+#include <fstream>
+
+static void expectSameMesh(const ParsedTriangleMesh &a, const ParsedTriangleMesh &b) {
+    ASSERT_EQ(a.positions.size(), b.positions.size());
+    ASSERT_EQ(a.indices.size(), b.indices.size());
+    ASSERT_EQ(a.uvs.size(), b.uvs.size());
+    ASSERT_EQ(a.normals.size(), b.normals.size());
+    for (size_t i = 0; i < a.positions.size(); i++) {
+        EXPECT_EQ(a.positions[i].x, b.positions[i].x);
+        EXPECT_EQ(a.positions[i].y, b.positions[i].y);
+        EXPECT_EQ(a.positions[i].z, b.positions[i].z);
+    }
+    for (size_t i = 0; i < a.indices.size(); i++) {
+        EXPECT_EQ(a.indices[i].x, b.indices[i].x);
+        EXPECT_EQ(a.indices[i].y, b.indices[i].y);
+        EXPECT_EQ(a.indices[i].z, b.indices[i].z);
+    }
+    for (size_t i = 0; i < a.uvs.size(); i++) {
+        EXPECT_EQ(a.uvs[i].x, b.uvs[i].x);
+        EXPECT_EQ(a.uvs[i].y, b.uvs[i].y);
+    }
+}
+
+TEST(ParseObj, FaceFormats) {
+    std::string obj =
+        "# comment\n"
+        "v 0 0 0\n"
+        "v 1 0 0\r\n"
+        "v 1 1 0 2\n"
+        "  v 0 1 0\n"
+        "vt 0 0\n"
+        "vt 1 0.25\n"
+        "vn 0 0 2\n"
+        "f 1/1/1 2/2/1 3/1/1 4/2/1\n"
+        "f -4//-1 -3//-1 -2//-1\n";
+
+    ParsedTriangleMesh mesh = parse_obj(obj.data(), obj.size(), Matrix4x4::identity(), 1 << 20);
+
+    // Quad splits into two triangles, the last face uses new (v, vn) corners
+    ASSERT_EQ(mesh.indices.size(), 3);
+    ASSERT_EQ(mesh.positions.size(), 7);
+    EXPECT_EQ(mesh.indices[1].x, 0);
+    EXPECT_EQ(mesh.indices[1].y, 2);
+    EXPECT_EQ(mesh.indices[1].z, 3);
+    EXPECT_EQ(mesh.indices[2].x, 4);
+
+    // w divides, v flips, normals get normalized
+    EXPECT_EQ(mesh.positions[2].x, 0.5);
+    EXPECT_EQ(mesh.positions[6].y, 0.5);
+    EXPECT_EQ(mesh.uvs[1].y, 0.75);
+    EXPECT_EQ(mesh.uvs.size(), 4);
+    EXPECT_EQ(mesh.normals.size(), 7);
+    EXPECT_EQ(mesh.normals[0].z, 1);
+}
+
+TEST(ParseObj, ChunksMatchSinglePass) {
+    // Negative indices near chunk boundaries have to reach back into the previous chunk
+    std::string obj;
+    int n = 40;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            obj += "v " + std::to_string(x) + " " + std::to_string(y) + " " + std::to_string((x * y) % 7) + "\n";
+            obj += "vt " + std::to_string(x / Real(n)) + " " + std::to_string(y / Real(n)) + "\n";
+            if (x > 0 && y > 0) {
+                obj += "f -1/-1 -2/-2 " + std::to_string((y - 1) * n + x) + "/1 " + std::to_string((y - 1) * n + x + 1) + "/2\n";
+            }
+        }
+    }
+
+    Matrix4x4 to_world = Matrix4x4::identity();
+    to_world(0, 3) = 2;
+    ParsedTriangleMesh whole = parse_obj(obj.data(), obj.size(), to_world, obj.size() + 1);
+    ParsedTriangleMesh chunked = parse_obj(obj.data(), obj.size(), to_world, 100);
+
+    EXPECT_EQ(whole.indices.size(), 2 * (n - 1) * (n - 1));
+    expectSameMesh(whole, chunked);
+}
+
+// Points mesh_cache_dir at a scratch folder, and puts it back even when an ASSERT bails out early
+class MeshCache : public ::testing::Test {
+protected:
+    void SetUp() override {
+        fs::create_directories(dir);
+        old_dir = mesh_cache_dir;
+        mesh_cache_dir = dir;
+    }
+
+    void TearDown() override {
+        mesh_cache_dir = old_dir;
+        fs::remove_all(dir);
+    }
+
+    fs::path dir = fs::temp_directory_path() / "torrey_mesh_cache_test";
+    fs::path old_dir;
+};
+
+TEST_F(MeshCache, RoundTripAndStale) {
+    fs::path source = dir / "quad.obj";
+    {
+        std::ofstream out(source);
+        out << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvt 0 0\nvt 1 1\nf 1/1 2/2 3/1 4/2\n";
+    }
+    ParsedTriangleMesh mesh = parse_obj(source, Matrix4x4::identity());
+    mesh.normals = {Vector3(0, 0, 1), Vector3(0, 0, 1), Vector3(0, 0, 1), Vector3(0, 0, 1)};
+
+    fs::path cache = mesh_cache_path(source, "a");
+    EXPECT_NE(cache, mesh_cache_path(source, "b"));
+
+    ParsedTriangleMesh loaded;
+    EXPECT_FALSE(load_mesh_cache(cache, source, loaded));
+    save_mesh_cache(cache, source, mesh);
+    ASSERT_TRUE(load_mesh_cache(cache, source, loaded));
+    expectSameMesh(mesh, loaded);
+    EXPECT_EQ(loaded.normals.size(), 4);
+
+    // Touching the source invalidates it
+    fs::last_write_time(source, fs::last_write_time(source) + std::chrono::seconds(5));
+    ParsedTriangleMesh stale;
+    EXPECT_FALSE(load_mesh_cache(cache, source, stale));
+}
+
+TEST_F(MeshCache, RejectsCorruptCaches) {
+    fs::path source = dir / "tri.obj";
+    {
+        std::ofstream out(source);
+        out << "v 0 0 0\nv 1 0 0\nv 1 1 0\nf 1 2 3\n";
+    }
+    ParsedTriangleMesh mesh = parse_obj(source, Matrix4x4::identity());
+    fs::path cache = mesh_cache_path(source, "a");
+    ParsedTriangleMesh loaded;
+
+    // An index past the vertex buffers
+    ParsedTriangleMesh bad = mesh;
+    bad.indices[0][2] = 3;
+    save_mesh_cache(cache, source, bad);
+    EXPECT_FALSE(load_mesh_cache(cache, source, loaded));
+
+    // A count whose byte size wraps around to the real file size
+    save_mesh_cache(cache, source, mesh);
+    ASSERT_TRUE(load_mesh_cache(cache, source, loaded));
+    {
+        std::fstream file(cache, std::ios::binary | std::ios::in | std::ios::out);
+        // 12 * (2^62 + 1) == 12 modulo 2^64, the size of the one real triangle
+        uint64_t num_indices = (1ull << 62) + 1;
+        file.seekp(40);
+        file.write((const char *)&num_indices, sizeof(num_indices));
+    }
+    EXPECT_FALSE(load_mesh_cache(cache, source, loaded));
+}
+
+// A Mitsuba V4 file with two shapes: floats with normals and uvs, then doubles with nothing extra
+static void writeSerialized(const fs::path &path) {
+    std::ofstream out(path, std::ios::binary);
+    std::vector<uint64_t> offsets;
+    auto put = [](std::string &buf, const void *data, size_t size) { buf.append((const char *)data, size); };
+
+    for (int shape = 0; shape < 2; shape++) {
+        std::string raw;
+        uint32_t flags = shape == 0 ? (0x0001 | 0x0002 | 0x1000) : 0x2000;
+        put(raw, &flags, sizeof(flags));
+        raw += shape == 0 ? "first" : "second";
+        raw.push_back('\0');
+        uint64_t vertex_count = 3, triangle_count = 1;
+        put(raw, &vertex_count, sizeof(vertex_count));
+        put(raw, &triangle_count, sizeof(triangle_count));
+        for (int v = 0; v < 3; v++) {
+            if (shape == 0) {
+                float p[3] = {(float)v, 1, 2};
+                put(raw, p, sizeof(p));
+            } else {
+                double p[3] = {0, (double)v, 0.5};
+                put(raw, p, sizeof(p));
+            }
+        }
+        if (shape == 0) {
+            for (int v = 0; v < 3; v++) {
+                float n[3] = {0, 0, 1};
+                put(raw, n, sizeof(n));
+            }
+            for (int v = 0; v < 3; v++) {
+                float uv[2] = {0.25f * v, 0.5f};
+                put(raw, uv, sizeof(uv));
+            }
+        }
+        uint32_t indices[3] = {2, 1, 0};
+        put(raw, indices, sizeof(indices));
+
+        std::vector<unsigned char> packed(compressBound(raw.size()));
+        mz_ulong packed_size = packed.size();
+        compress(packed.data(), &packed_size, (const unsigned char *)raw.data(), raw.size());
+
+        offsets.push_back(out.tellp());
+        short header[2] = {0x041C, 0x0004};
+        out.write((const char *)header, sizeof(header));
+        out.write((const char *)packed.data(), packed_size);
+    }
+    out.write((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+    uint32_t count = offsets.size();
+    out.write((const char *)&count, sizeof(count));
+}
+
+TEST(ParseSerialized, ShapesFromOffsetTable) {
+    fs::path dir = fs::temp_directory_path() / "torrey_serialized_test";
+    fs::create_directories(dir);
+    writeSerialized(dir / "two.serialized");
+
+    SerializedFile file(dir / "two.serialized");
+    ASSERT_EQ(file.num_shapes(), 2);
+
+    ParsedTriangleMesh first = file.load_shape(0);
+    ASSERT_EQ(first.positions.size(), 3);
+    EXPECT_EQ(first.positions[2].x, 2);
+    EXPECT_EQ(first.normals.size(), 3);
+    EXPECT_EQ(first.uvs[1].x, 0.25);
+    EXPECT_EQ(first.indices[0].x, 2);
+
+    Matrix4x4 to_world = Matrix4x4::identity();
+    to_world(0, 3) = 3;
+    ParsedTriangleMesh second = parse_serialized(dir / "two.serialized", 1, to_world);
+    ASSERT_EQ(second.positions.size(), 3);
+    EXPECT_EQ(second.positions[1].x, 3);
+    EXPECT_EQ(second.positions[1].y, 1);
+    EXPECT_EQ(second.normals.size(), 0);
+    EXPECT_EQ(second.uvs.size(), 0);
+    EXPECT_THROW(file.load_shape(2), std::runtime_error);
+
+    // Scene entries sharing the file and a shape still each get their own transform
+    {
+        std::ofstream xml(dir / "scene.xml");
+        xml << "<scene version=\"0.5.0\">"
+               "<shape type=\"serialized\"><string name=\"filename\" value=\"two.serialized\"/><integer name=\"shapeIndex\" value=\"1\"/></shape>"
+               "<shape type=\"serialized\"><string name=\"filename\" value=\"two.serialized\"/><integer name=\"shapeIndex\" value=\"0\"/></shape>"
+               "<shape type=\"serialized\"><string name=\"filename\" value=\"two.serialized\"/><integer name=\"shapeIndex\" value=\"1\"/>"
+               "<transform name=\"toWorld\"><translate x=\"3\"/></transform></shape>"
+               "</scene>";
+    }
+    ParsedScene scene = parse_scene(dir / "scene.xml");
+    ASSERT_EQ(scene.shapes.size(), 3);
+    std::vector<ParsedTriangleMesh> meshes;
+    for (const ParsedShape &shape : scene.shapes) {
+        meshes.push_back(std::get<ParsedTriangleMesh>(shape));
+    }
+    expectSameMesh(meshes[1], first);
+
+    // Shape 1 has no normals in the file, so loading fills them in
+    EXPECT_EQ(meshes[0].normals.size(), 3);
+    meshes[0].normals.clear();
+    meshes[2].normals.clear();
+    expectSameMesh(meshes[0], file.load_shape(1));
+    expectSameMesh(meshes[2], second);
+
+    fs::remove_all(dir);
+}
+
+static void writePly(const fs::path &path, int corners) {
+    std::ofstream out(path, std::ios::binary);
+    out << "ply\nformat binary_little_endian 1.0\nelement vertex 4\n"
+           "property double x\nproperty double y\nproperty double z\nproperty float nx\nproperty float ny\nproperty float nz\n"
+           "element face " << (corners == 3 ? 2 : 1) << "\nproperty list uchar uint vertex_indices\nend_header\n";
+    for (int v = 0; v < 4; v++) {
+        double p[3] = {(double)(v & 1), (double)(v >> 1), 0};
+        float n[3] = {0, 1, 0};
+        out.write((const char *)p, sizeof(p));
+        out.write((const char *)n, sizeof(n));
+    }
+    std::vector<std::vector<uint32_t>> faces = corners == 3 ? std::vector<std::vector<uint32_t>>{{0, 1, 2}, {1, 3, 2}}
+                                                            : std::vector<std::vector<uint32_t>>{{0, 1, 3, 2}};
+    for (const auto &face : faces) {
+        uint8_t count = face.size();
+        out.write((const char *)&count, 1);
+        out.write((const char *)face.data(), face.size() * sizeof(uint32_t));
+    }
+}
+
+TEST(ParsePly, TransformsAndRejectsQuads) {
+    fs::path dir = fs::temp_directory_path() / "torrey_ply_test";
+    fs::create_directories(dir);
+    writePly(dir / "tris.ply", 3);
+    writePly(dir / "quad.ply", 4);
+
+    // Scaling y by 2 halves the y of normals before they're renormalized
+    Matrix4x4 to_world = Matrix4x4::identity();
+    to_world(1, 1) = 2;
+    to_world(0, 3) = 1;
+    ParsedTriangleMesh mesh = parse_ply(dir / "tris.ply", to_world);
+    ASSERT_EQ(mesh.positions.size(), 4);
+    ASSERT_EQ(mesh.indices.size(), 2);
+    EXPECT_EQ(mesh.positions[3].x, 2);
+    EXPECT_EQ(mesh.positions[3].y, 2);
+    EXPECT_EQ(mesh.indices[1].y, 3);
+    EXPECT_NEAR(mesh.normals[0].y, 1, 1e-12);
+
+    EXPECT_THROW(parse_ply(dir / "quad.ply", to_world), std::runtime_error);
+    fs::remove_all(dir);
+}
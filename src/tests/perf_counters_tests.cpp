@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+#include "../perf_counters.h"
+
+#include <sstream>
+#include <thread>
+
+TEST(PerfCounters, ScopesRecordPhasesOrDoNothing) {
+    perf_reset_phases();
+    {
+        PerfScope scope("disabled or not, this must not crash");
+    }
+
+    if (!perf_enable()) {
+        // No counters in this environment, everything stays a no-op
+        EXPECT_FALSE(perf_enabled());
+        EXPECT_TRUE(perf_phases().empty());
+        std::ostringstream out;
+        perf_report(out);
+        EXPECT_TRUE(out.str().empty());
+        GTEST_SKIP() << "perf_event_open not available";
+    }
+
+    perf_reset_phases();
+    volatile double sum = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        PerfScope scope("loop");
+        for (int i = 0; i < 1000000; i++)
+            sum = sum + i;
+    }
+
+    std::vector<PerfPhase> phases = perf_phases();
+    ASSERT_EQ(phases.size(), 1);
+    EXPECT_EQ(phases[0].name, "loop");
+    EXPECT_EQ(phases[0].calls, 2);
+    if (phases[0].counts.has(PerfEvent::Instructions)) {
+        EXPECT_GT(phases[0].counts[PerfEvent::Instructions], 1000000);
+    }
+
+    std::ostringstream out;
+    perf_report(out);
+    EXPECT_NE(out.str().find("loop"), std::string::npos);
+    perf_reset_phases();
+}
+
+TEST(PerfCounters, AttachedThreadsCount) {
+    if (!perf_enable()) {
+        EXPECT_FALSE(perf_attach_thread());
+        GTEST_SKIP() << "perf_event_open not available";
+    }
+
+    // The thread starts after perf_enable, only attaching gets its loop into the scope
+    perf_reset_phases();
+    {
+        PerfScope scope("late thread");
+        std::thread worker([] {
+            EXPECT_TRUE(perf_attach_thread());
+            volatile double sum = 0;
+            for (int i = 0; i < 5000000; i++)
+                sum = sum + i;
+        });
+        worker.join();
+    }
+
+    std::vector<PerfPhase> phases = perf_phases();
+    ASSERT_EQ(phases.size(), 1);
+    if (phases[0].counts.has(PerfEvent::Instructions)) {
+        EXPECT_GT(phases[0].counts[PerfEvent::Instructions], 5000000);
+    }
+    perf_reset_phases();
+}
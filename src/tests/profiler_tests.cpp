@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+#include "../profiler.h"
+
+#include <chrono>
+#include <cmath>
+#include <sstream>
+
+// Kept out of line so it shows up in the profile under its own name
+__attribute__((noinline)) static double profiler_busy_loop(double seconds) {
+    volatile double sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds) {
+        for (int i = 0; i < 10000; i++)
+            sum = sum + std::sqrt((double)i);
+    }
+    return sum;
+}
+
+TEST(Profiler, FindsTheHotFunction) {
+    if (!profiler_start(1000)) {
+        GTEST_SKIP() << "No sampling profiler on this platform";
+    }
+    EXPECT_TRUE(profiler_running());
+    profiler_busy_loop(0.3);
+    profiler_stop();
+    EXPECT_FALSE(profiler_running());
+
+    // CPU time, so a loaded machine can make this short, but never empty
+    ASSERT_GT(profiler_samples(), 0);
+    std::vector<ProfileEntry> hot = profiler_hot_functions();
+    ASSERT_FALSE(hot.empty());
+    uint64_t total = 0, busy = 0;
+    for (const ProfileEntry &entry : hot) {
+        total += entry.samples;
+        if (entry.function.find("profiler_busy_loop") != std::string::npos) {
+            busy += entry.samples;
+        }
+    }
+    EXPECT_EQ(total, profiler_samples());
+    EXPECT_GT(busy, total / 2);
+
+    std::ostringstream out;
+    profiler_report(out, 5);
+    EXPECT_NE(out.str().find("Hot functions"), std::string::npos);
+}
@@ -0,0 +1,26 @@
+#include <gtest/gtest.h>
+#include "../progressreporter.h"
+#include "../parallel.h"
+
+#include <atomic>
+
+TEST(ProgressReporter, CountsWithoutLocking) {
+    std::atomic<uint64_t> rays{0};
+    ProgressReporter reporter(64, [&]() { return rays.load(); });
+    parallel_for([&](int64_t i) {
+        rays += 100;
+        reporter.update(1, 4);
+    }, 32);
+
+    EXPECT_EQ(reporter.get_work_done(), 32);
+    EXPECT_EQ(reporter.get_samples_done(), 128);
+    std::string status = reporter.status();
+    EXPECT_NE(status.find("50.00 Percent Done (32 / 64)"), std::string::npos);
+    EXPECT_NE(status.find("Mrays/s"), std::string::npos);
+    EXPECT_NE(status.find("128 samples"), std::string::npos);
+    EXPECT_NE(status.find("ETA"), std::string::npos);
+
+    reporter.done();
+    EXPECT_EQ(reporter.get_work_done(), 64);
+    EXPECT_EQ(reporter.status().find("ETA"), std::string::npos);
+}
@@ -0,0 +1,242 @@
+#include <gtest/gtest.h>
+#include "../vector.h"
+#include "../image.h"
+#include "../custom/ray.h"
+#include "../custom/shapes.h"
+#include "../custom/camera.h"
+#include "../custom/texture.h"
+#include "../custom/pcg.h"
+#include "../custom/scene.h"
+#include "../custom/texture_cache.h"
+#include "../flexception.h"
+
+using namespace cu_utils;
+
+static Image3 checkerboard(int width, int height) {
+    Image3 image(width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            image(x, y) = (x + y) % 2 == 0 ? Vector3(1, 1, 1) : Vector3(0, 0, 0);
+    return image;
+}
+
+TEST(MipMap, BuildsPyramid) {
+    MipMap map(checkerboard(8, 4));
+
+    // 8x4, 4x2, 2x1, 1x1
+    ASSERT_EQ(map.numLevels(), 4);
+    EXPECT_EQ(map.level(1).width, 4);
+    EXPECT_EQ(map.level(1).height, 2);
+    EXPECT_EQ(map.level(3).width, 1);
+    EXPECT_EQ(map.level(3).height, 1);
+
+    // Every 2x2 block of a checkerboard averages out to grey
+    for (int i = 1; i < map.numLevels(); i++)
+        for (int y = 0; y < map.level(i).height; y++)
+            for (int x = 0; x < map.level(i).width; x++)
+                EXPECT_NEAR(map.level(i).texel(x, y).x, 0.5, 1e-9);
+}
+
+TEST(MipMap, FootprintPicksLevel) {
+    pcg32_state rng = init_pcg32(5, 5);
+    Image3 image(16, 16);
+    for (Vector3 &texel : image.data)
+        texel = Vector3(next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng), next_pcg32_real<Real>(rng));
+    MipMap map(image);
+
+    // No footprint is a plain bilinear lookup on the base level, same as the old material lookup
+    Real u = 0.3, v = 0.7;
+    Real rx = 16 * u, ry = 16 * v;
+    int x = (int)rx, y = (int)ry;
+    Real dx = rx - x, dy = ry - y;
+    Vector3 expected = (image(x, y) * (1 - dx) + image(x + 1, y) * dx) * (1 - dy) + (image(x, y + 1) * (1 - dx) + image(x + 1, y + 1) * dx) * dy;
+    EXPECT_NEAR(map.sample(u, v, 0).x, expected.x, 1e-3);
+
+    // 4 texels wide lands exactly on level 2, halfway between 2 and 3 blends them
+    EXPECT_NEAR(map.sample(u, v, 4).y, map.bilinear(2, u, v).y, 1e-9);
+    Vector3 blended = (map.bilinear(2, u, v) + map.bilinear(3, u, v)) * 0.5;
+    EXPECT_NEAR(map.sample(u, v, std::pow(2.0, 2.5)).z, blended.z, 1e-9);
+
+    // Anything wider than the texture is just the average
+    EXPECT_NEAR(map.sample(u, v, 1000).x, map.level(map.numLevels() - 1).texel(0, 0).x, 1e-9);
+}
+
+TEST(MipMap, CompactStorage) {
+    Image3 image(64, 64);
+    for (int y = 0; y < 64; y++)
+        for (int x = 0; x < 64; x++)
+            image(x, y) = Vector3(x / 63.0, y / 63.0, 0.25);
+
+    // 3 bytes a texel, plus a third more for the mips
+    MipMap gamma(image, TexelFormat::GAMMA8);
+    EXPECT_EQ(gamma.level(0).memoryBytes(), 64 * 64 * 3);
+    EXPECT_LT(gamma.memoryBytes(), 64 * 64 * 3 * 4 / 3 + 64);
+
+    MipMap half(image, TexelFormat::HALF);
+    EXPECT_EQ(half.level(0).memoryBytes(), 64 * 64 * 6);
+
+    // 8-bit is good to about a percent, halves to about 3 digits
+    for (int y = 0; y < 64; y += 7) {
+        for (int x = 0; x < 64; x += 7) {
+            Vector3f g = gamma.level(0).texel(x, y);
+            Vector3f h = half.level(0).texel(x, y);
+            EXPECT_NEAR(g.x, image(x, y).x, 0.01);
+            EXPECT_NEAR(h.y, image(x, y).y, 1e-3);
+            EXPECT_NEAR(h.z, 0.25, 1e-9);
+        }
+    }
+}
+
+TEST(MipMap, HalfConversion) {
+    float values[] = {0.0f, 1.0f, -2.5f, 0.1f, 65504.0f, 6.1e-5f, 3.0e-7f};
+    for (float value : values)
+        EXPECT_NEAR(halfToFloat(floatToHalf(value)), value, std::abs(value) * 1e-3 + 1e-7);
+
+    EXPECT_EQ(floatToHalf(1.0f), 0x3c00);
+    EXPECT_TRUE(std::isinf(halfToFloat(floatToHalf(1e6f))));
+}
+
+TEST(Scene, TextureHandles) {
+    fs::path path = fs::temp_directory_path() / "torrey_handle_test.exr";
+    imwrite(path, checkerboard(8, 8));
+
+    Scene scene = Scene::defaultScene();
+    ParsedImageTexture meta;
+    meta.filename = path;
+    meta.uscale = 2;
+
+    // Same file twice shares one texture
+    Material *a = scene.materials[0];
+    a->scene = &scene;
+    a->loadTexture(&meta);
+    LambertMaterial b;
+    b.scene = &scene;
+    b.loadTexture(&meta);
+    scene.loadTextures();
+
+    EXPECT_EQ(scene.textures.size(), 1);
+    EXPECT_EQ(a->colorTex.handle, 0);
+    EXPECT_EQ(b.colorTex.handle, 0);
+    EXPECT_EQ(a->colorTex.uscale, 2);
+    EXPECT_FALSE(a->normalTex.valid());
+    EXPECT_FALSE(a->emissiveTex.valid());
+
+    // uscale 2 halves the texel size in u, lookups on texel corners give the exact colors
+    EXPECT_NEAR(a->getTexColor(0.0, 0.0).x, 1, 1e-3);
+    EXPECT_NEAR(a->getTexColor(1.0 / 16, 0.0).x, 0, 1e-3);
+    EXPECT_NEAR(a->getTexColor(2.0 / 16, 0.0).x, 1, 1e-3);
+
+    fs::remove(path);
+}
+
+static Image3 gradient(int width, int height) {
+    Image3 image(width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            image(x, y) = Vector3(x / Real(width), y / Real(height), (x * 7 + y * 3) % 11 / 10.0);
+    return image;
+}
+
+TEST(TextureCache, MatchesMipMap) {
+    // Not a multiple of the tile size, so the edge tiles are partial
+    MipMap map(gradient(100, 70), TexelFormat::GAMMA8);
+    fs::path path = fs::temp_directory_path() / "torrey_cache_test.torreytex";
+    writeTiledTexture(map, path, 16);
+
+    TextureCache cache(1 << 20, fs::temp_directory_path());
+    int handle = cache.addTiled(path);
+    EXPECT_EQ(cache.width(handle), 100);
+    EXPECT_EQ(cache.height(handle), 70);
+    EXPECT_EQ(cache.numLevels(handle), map.numLevels());
+
+    pcg32_state rng = init_pcg32(1, 7);
+    for (int i = 0; i < 500; i++) {
+        Real u = next_pcg32_real<Real>(rng) * 3 - 1;
+        Real v = next_pcg32_real<Real>(rng) * 3 - 1;
+        Real footprint = next_pcg32_real<Real>(rng) * 100;
+
+        Vector3 expected = map.sample(u, v, footprint);
+        Vector3 cached = cache.sample(handle, u, v, footprint);
+        EXPECT_EQ(expected.x, cached.x);
+        EXPECT_EQ(expected.y, cached.y);
+        EXPECT_EQ(expected.z, cached.z);
+    }
+
+    // Everything fits, so every tile got read exactly once
+    TextureCacheStats stats = cache.stats();
+    EXPECT_EQ(stats.evictions, 0);
+    EXPECT_GT(stats.hitRate(), 0.9);
+
+    fs::remove(path);
+}
+
+TEST(TextureCache, EvictsPastCap) {
+    MipMap map(gradient(256, 256), TexelFormat::HALF);
+    fs::path path = fs::temp_directory_path() / "torrey_evict_test.torreytex";
+    writeTiledTexture(map, path, 32);
+
+    // Room for four 32x32 half tiles out of the 64 in the base level
+    size_t tileBytes = 32 * 32 * 6;
+    TextureCache cache(4 * tileBytes, fs::temp_directory_path());
+    int handle = cache.addTiled(path);
+
+    for (int y = 0; y < 256; y += 8)
+        for (int x = 0; x < 256; x += 8)
+            EXPECT_NEAR(cache.bilinear(handle, 0, x / 256.0, y / 256.0).x, map.level(0).texel(x, y).x, 1e-9);
+
+    TextureCacheStats stats = cache.stats();
+    EXPECT_LE(stats.residentBytes, 4 * tileBytes);
+    EXPECT_LE(stats.peakBytes, 4 * tileBytes);
+    EXPECT_GE(stats.misses, 64);
+    EXPECT_GT(stats.evictions, 0);
+    // The thread's own slots still point at some of the evicted tiles
+    EXPECT_GT(stats.heldBytes, 0);
+
+    fs::remove(path);
+}
+
+TEST(TextureCache, RejectsTruncatedFile) {
+    MipMap map(gradient(64, 64), TexelFormat::GAMMA8);
+    fs::path path = fs::temp_directory_path() / "torrey_truncated_test.torreytex";
+    writeTiledTexture(map, path, 16);
+    EXPECT_FALSE(fs::exists(fs::path(path.string() + ".tmp")));
+
+    // Like a run that got killed halfway through the tiles
+    fs::resize_file(path, fs::file_size(path) / 2);
+    TextureCache cache(1 << 20, fs::temp_directory_path());
+    EXPECT_ANY_THROW(cache.addTiled(path));
+
+    // A missing source reports like any other image that can't be loaded
+    EXPECT_THROW(cache.convert(fs::temp_directory_path() / "torrey_no_such_texture.png"), fl_exception);
+
+    fs::remove(path);
+}
+
+TEST(RayDifferentials, TriangleUVFootprint) {
+    // Quad at z = -2 spanning [-1, 1], uv runs over [0, 1] across it
+    Triangle tri(Vector3(-1.0, -1.0, -2.0), Vector3(1.0, -1.0, -2.0), Vector3(1.0, 1.0, -2.0), 0);
+    tri.setUVs(Vector2(0, 0), Vector2(1, 0), Vector2(1, 1));
+
+    const int width = 64;
+    Camera cam = CameraBuilder(width, width)
+                     .setLookFrom(Vector3(0, 0, 0))
+                     .setLookAt(Vector3(0, 0, -1))
+                     .setUp(Vector3(0, 1, 0))
+                     .setFov(90)
+                     .build();
+
+    Ray ray = cam.ScToWRayDifferential(width / 2 + 0.5, width / 2 + 0.5);
+    RayHit hit = tri.checkHit(ray, 0, 100);
+    ASSERT_TRUE(hit.hit);
+
+    // A pixel covers 2 * 2 / 64 world units at that distance, which is half that in uv.
+    // Screen y points down while v points up.
+    EXPECT_NEAR(hit.dudx, 2.0 / width, 1e-3);
+    EXPECT_NEAR(hit.dvdx, 0, 1e-3);
+    EXPECT_NEAR(hit.dudy, 0, 1e-3);
+    EXPECT_NEAR(hit.dvdy, -2.0 / width, 1e-3);
+
+    // Rays without differentials leave the footprint at zero
+    hit = tri.checkHit(cam.ScToWRay(width / 2 + 0.5, width / 2 + 0.5), 0, 100);
+    EXPECT_EQ(hit.dudx, 0);
+}
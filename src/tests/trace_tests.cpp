@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include "../trace.h"
+#include "../parallel.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+TEST(Trace, WritesScopesPerThread) {
+    {
+        // Off until enabled, so this one shouldn't show up
+        TraceScope ignored("before enable");
+    }
+
+    trace_enable();
+    {
+        TraceScope outer("outer phase");
+        parallel_for([&](const Vector2i &tile) {
+            TraceScope trace("tile", "render", tile[0], tile[1]);
+        }, Vector2i(2, 2));
+    }
+
+    fs::path path = fs::temp_directory_path() / "torrey_trace_test.json";
+    trace_write(path);
+
+    std::ifstream in(path);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    std::string json = contents.str();
+    fs::remove(path);
+
+    EXPECT_EQ(json.find("before enable"), std::string::npos);
+    EXPECT_NE(json.find("\"name\": \"outer phase\", \"cat\": \"phase\", \"ph\": \"X\""), std::string::npos);
+    EXPECT_NE(json.find("\"args\": {\"x\": 1, \"y\": 1}"), std::string::npos);
+    EXPECT_NE(json.find("\"thread_name\""), std::string::npos);
+    EXPECT_EQ(json.back(), '\n');
+    EXPECT_EQ(json.substr(json.size() - 4), "\n]}\n");
+
+    // Later tests render too, they shouldn't pile events into the buffers
+    trace_disable();
+    EXPECT_FALSE(trace_enabled());
+}
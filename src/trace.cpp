@@ -0,0 +1,128 @@
+#include "trace.h"
+#include "flexception.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent {
+    const char *name;
+    const char *category;
+    int64_t start, duration; // Nanoseconds since trace_enable
+    int x, y;
+};
+
+struct TraceBuffer {
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+static std::atomic<bool> g_enabled{false};
+static std::chrono::steady_clock::time_point g_start;
+
+// Buffers are never freed, the pool threads live until the end anyways
+static std::mutex g_buffers_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> g_buffers;
+static thread_local TraceBuffer *t_buffer = nullptr;
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_start).count();
+}
+
+static TraceBuffer &thread_buffer() {
+    if (t_buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(g_buffers_mutex);
+        // Threads outside the pool (like the BVH build thread) also have ThreadIndex 0,
+        // give them their own row instead of mixing them up with the main thread
+        int tid = ThreadIndex;
+        for (const auto &buffer : g_buffers) {
+            if (buffer->tid == tid) {
+                tid = 1000 + (int)g_buffers.size();
+                break;
+            }
+        }
+        g_buffers.push_back(std::make_unique<TraceBuffer>(TraceBuffer{tid, {}}));
+        t_buffer = g_buffers.back().get();
+    }
+    return *t_buffer;
+}
+
+void trace_enable() {
+    if (!g_enabled) {
+        g_start = std::chrono::steady_clock::now();
+        g_enabled = true;
+        // Claim tid 0 for the calling (main) thread before any helper thread can
+        thread_buffer();
+    }
+}
+
+bool trace_enabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+void trace_disable() {
+    g_enabled = false;
+    std::lock_guard<std::mutex> lock(g_buffers_mutex);
+    // Threads keep pointers to their buffers, so only empty them
+    for (const auto &buffer : g_buffers) {
+        buffer->events.clear();
+    }
+}
+
+TraceScope::TraceScope(const char *name, const char *category) : name(name), category(category) {
+    if (trace_enabled()) {
+        start = now_ns();
+    }
+}
+
+TraceScope::TraceScope(const char *name, const char *category, int x, int y)
+    : name(name), category(category), x(x), y(y) {
+    if (trace_enabled()) {
+        start = now_ns();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (start < 0) {
+        return;
+    }
+    thread_buffer().events.push_back(TraceEvent{name, category, start, now_ns() - start, x, y});
+}
+
+void trace_write(const fs::path &filename) {
+    std::ofstream out(filename);
+    if (!out) {
+        Error(std::string("Can't write trace to ") + filename.string());
+    }
+
+    std::lock_guard<std::mutex> lock(g_buffers_mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    auto separator = [&]() {
+        out << (first ? "" : ",\n");
+        first = false;
+    };
+    for (const auto &buffer : g_buffers) {
+        separator();
+        std::string thread_name = buffer->tid == 0 ? "main" : buffer->tid >= 1000 ? "other thread" : "worker " + std::to_string(buffer->tid);
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << buffer->tid
+            << ", \"args\": {\"name\": \"" << thread_name << "\"}}";
+
+        for (const TraceEvent &event : buffer->events) {
+            separator();
+            // Chrome wants microseconds, one decimal (0.1 us) is plenty for phases and tiles
+            out << "{\"name\": \"" << event.name << "\", \"cat\": \"" << event.category << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+                << buffer->tid << ", \"ts\": " << event.start / 1000 << "." << event.start % 1000 / 100
+                << ", \"dur\": " << event.duration / 1000 << "." << event.duration % 1000 / 100;
+            if (event.x >= 0) {
+                out << ", \"args\": {\"x\": " << event.x << ", \"y\": " << event.y << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+}
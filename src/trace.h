@@ -0,0 +1,40 @@
+#pragma once
+
+#include "torrey.h"
+
+#include <cstdint>
+
+/// Timeline of the big phases (parsing, scene build, textures, BVH, render tiles, image write)
+/// in the Chrome trace format, open it in chrome://tracing or ui.perfetto.dev.
+/// Nothing gets recorded until trace_enable(). After that every TraceScope appends to its
+/// own thread's buffer, so tracing doesn't add any locking to the render.
+void trace_enable();
+bool trace_enabled();
+
+/// Stops recording and drops the events so far, a later trace_enable starts a fresh timeline.
+/// Same as trace_write, only call it when nothing is running on the thread pool.
+void trace_disable();
+
+/// Dumps every event recorded so far. Call it when nothing is running on the thread pool.
+void trace_write(const fs::path &filename);
+
+/// Records the time between construction and destruction as one event.
+/// name and category have to stay alive until trace_write, so use string literals.
+class TraceScope {
+public:
+    TraceScope(const char *name, const char *category = "phase");
+
+    // For tiles, x and y show up as the event's args
+    TraceScope(const char *name, const char *category, int x, int y);
+
+    ~TraceScope();
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *name;
+    const char *category;
+    int x = -1, y = -1;
+    int64_t start = -1; // -1 if tracing was off when the scope opened
+};